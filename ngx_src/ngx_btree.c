@@ -0,0 +1,427 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * Both insert and delete work top-down in a single pass: a full child is
+ * split before the descent, and a child with the minimum number of keys
+ * is refilled from a sibling or merged with it, so a change never has to
+ * propagate back up to the parent.
+ */
+
+
+static ngx_btree_node_t *ngx_btree_alloc(ngx_btree_t *tree, ngx_uint_t leaf);
+static void ngx_btree_free(ngx_btree_t *tree, ngx_btree_node_t *node);
+static ngx_int_t ngx_btree_split_child(ngx_btree_t *tree, ngx_btree_node_t *parent, ngx_uint_t i);
+static ngx_btree_node_t *ngx_btree_fill_child(ngx_btree_t *tree, ngx_btree_node_t *parent, ngx_uint_t i);
+static void ngx_btree_merge_children(ngx_btree_t *tree, ngx_btree_node_t *parent, ngx_uint_t i);
+
+
+/* the index of the child subtree which may contain the key */
+
+static ngx_inline ngx_uint_t ngx_btree_child_index(ngx_btree_node_t *node, ngx_btree_key_t key)
+{
+	ngx_uint_t i = 0;
+	while (i < node->nkeys && key >= node->keys[i])
+		i++;
+
+	return i;
+}
+
+/* the index of the first key in a leaf that is not less than the key */
+
+static ngx_inline ngx_uint_t ngx_btree_leaf_index(ngx_btree_node_t *node, ngx_btree_key_t key)
+{
+	ngx_uint_t i = 0;
+	while (i < node->nkeys && key > node->keys[i])
+		i++;
+
+	return i;
+}
+
+ngx_btree_t* ngx_btree_create(ngx_pool_t *pool)
+{
+	ngx_btree_t* tree = ngx_palloc(pool, sizeof(ngx_btree_t));
+	if (tree == NULL)
+		return NULL;
+
+	tree->pool = pool;
+	tree->free_list = NULL;
+	tree->start = NULL;
+	tree->size = 0;
+	tree->count = 0;
+	tree->height = 1;
+
+	tree->root = ngx_btree_alloc(tree, 1);
+	if (tree->root == NULL)
+		return NULL;
+
+	return tree;
+}
+
+ngx_int_t ngx_btree_insert(ngx_btree_t *tree, ngx_btree_key_t key, void *value)
+{
+	if (tree->root->nkeys == NGX_BTREE_KEYS)
+	{
+		ngx_btree_node_t* root = ngx_btree_alloc(tree, 0);
+		if (root == NULL)
+			return NGX_ERROR;
+
+		root->u.child[0] = tree->root;
+
+		if (ngx_btree_split_child(tree, root, 0) != NGX_OK)
+		{
+			ngx_btree_free(tree, root);
+			return NGX_ERROR;
+		}
+
+		tree->root = root;
+		tree->height++;
+	}
+
+	ngx_btree_node_t* node = tree->root;
+	while (!node->leaf)
+	{
+		ngx_uint_t i = ngx_btree_child_index(node, key);
+
+		if (node->u.child[i]->nkeys == NGX_BTREE_KEYS)
+		{
+			if (ngx_btree_split_child(tree, node, i) != NGX_OK)
+				return NGX_ERROR;
+
+			if (key >= node->keys[i])
+				i++;
+		}
+
+		node = node->u.child[i];
+	}
+
+	ngx_uint_t i = ngx_btree_leaf_index(node, key);
+	if (i < node->nkeys && node->keys[i] == key)
+		return NGX_BUSY;
+
+	ngx_memmove(&node->keys[i + 1], &node->keys[i],
+				(node->nkeys - i) * sizeof(ngx_btree_key_t));
+	ngx_memmove(&node->u.leaf.value[i + 1], &node->u.leaf.value[i],
+				(node->nkeys - i) * sizeof(void *));
+
+	node->keys[i] = key;
+	node->u.leaf.value[i] = value;
+	node->nkeys++;
+
+	tree->count++;
+	return NGX_OK;
+}
+
+ngx_int_t ngx_btree_delete(ngx_btree_t *tree, ngx_btree_key_t key)
+{
+	ngx_btree_node_t* node = tree->root;
+	while (!node->leaf)
+	{
+		ngx_uint_t i = ngx_btree_child_index(node, key);
+
+		if (node->u.child[i]->nkeys > NGX_BTREE_MIN_KEYS)
+		{
+			node = node->u.child[i];
+			continue;
+		}
+
+		node = ngx_btree_fill_child(tree, node, i);
+
+		/* the root has lost its last key after a merge */
+		if (tree->root->nkeys == 0 && !tree->root->leaf)
+		{
+			ngx_btree_node_t* root = tree->root;
+			tree->root = root->u.child[0];
+			tree->height--;
+			ngx_btree_free(tree, root);
+		}
+	}
+
+	ngx_uint_t i = ngx_btree_leaf_index(node, key);
+	if (i == node->nkeys || node->keys[i] != key)
+		return NGX_DECLINED;
+
+	/*
+	 * The key may still be used as a separator above, that is fine:
+	 * all keys of the right subtree remain greater than or equal to it.
+	 */
+
+	node->nkeys--;
+
+	ngx_memmove(&node->keys[i], &node->keys[i + 1],
+				(node->nkeys - i) * sizeof(ngx_btree_key_t));
+	ngx_memmove(&node->u.leaf.value[i], &node->u.leaf.value[i + 1],
+				(node->nkeys - i) * sizeof(void *));
+
+	tree->count--;
+	return NGX_OK;
+}
+
+void* ngx_btree_find(ngx_btree_t *tree, ngx_btree_key_t key)
+{
+	ngx_btree_node_t* node = tree->root;
+	while (!node->leaf)
+	{
+		node = node->u.child[ngx_btree_child_index(node, key)];
+	}
+
+	ngx_uint_t i = ngx_btree_leaf_index(node, key);
+	if (i < node->nkeys && node->keys[i] == key)
+		return node->u.leaf.value[i];
+
+	return NULL;
+}
+
+ngx_int_t ngx_btree_min(ngx_btree_t *tree, ngx_btree_cursor_t *c)
+{
+	ngx_btree_node_t* node = tree->root;
+	while (!node->leaf)
+	{
+		node = node->u.child[0];
+	}
+
+	c->node = node;
+	c->pos = 0;
+
+	/* only the root leaf may be empty */
+	return node->nkeys ? NGX_OK : NGX_DECLINED;
+}
+
+ngx_int_t ngx_btree_next(ngx_btree_cursor_t *c)
+{
+	if (++c->pos < c->node->nkeys)
+		return NGX_OK;
+
+	c->node = c->node->u.leaf.next;
+	c->pos = 0;
+
+	return c->node ? NGX_OK : NGX_DECLINED;
+}
+
+/* split the full child i of the parent, which must not be full itself */
+
+static ngx_int_t ngx_btree_split_child(ngx_btree_t *tree, ngx_btree_node_t *parent, ngx_uint_t i)
+{
+	ngx_btree_node_t* left = parent->u.child[i];
+	ngx_btree_node_t* right = ngx_btree_alloc(tree, left->leaf);
+	if (right == NULL)
+		return NGX_ERROR;
+
+	ngx_btree_key_t separator;
+	ngx_uint_t half = NGX_BTREE_KEYS / 2;
+
+	if (left->leaf)
+	{
+		/* the separator is copied up, the right leaf keeps it */
+		right->nkeys = left->nkeys - half;
+		ngx_memcpy(right->keys, &left->keys[half],
+				   right->nkeys * sizeof(ngx_btree_key_t));
+		ngx_memcpy(right->u.leaf.value, &left->u.leaf.value[half],
+				   right->nkeys * sizeof(void *));
+
+		right->u.leaf.next = left->u.leaf.next;
+		left->u.leaf.next = right;
+
+		left->nkeys = half;
+		separator = right->keys[0];
+	}
+	else
+	{
+		/* the separator is moved up */
+		right->nkeys = left->nkeys - half - 1;
+		ngx_memcpy(right->keys, &left->keys[half + 1],
+				   right->nkeys * sizeof(ngx_btree_key_t));
+		ngx_memcpy(right->u.child, &left->u.child[half + 1],
+				   (right->nkeys + 1) * sizeof(ngx_btree_node_t *));
+
+		left->nkeys = half;
+		separator = left->keys[half];
+	}
+
+	ngx_memmove(&parent->keys[i + 1], &parent->keys[i],
+				(parent->nkeys - i) * sizeof(ngx_btree_key_t));
+	ngx_memmove(&parent->u.child[i + 2], &parent->u.child[i + 1],
+				(parent->nkeys - i) * sizeof(ngx_btree_node_t *));
+
+	parent->keys[i] = separator;
+	parent->u.child[i + 1] = right;
+	parent->nkeys++;
+
+	return NGX_OK;
+}
+
+/*
+ * Make sure the child i of the parent has more than the minimum number
+ * of keys before the descent, returns the node to descend into.
+ */
+
+static ngx_btree_node_t* ngx_btree_fill_child(ngx_btree_t *tree, ngx_btree_node_t *parent, ngx_uint_t i)
+{
+	ngx_btree_node_t* child = parent->u.child[i];
+	ngx_btree_node_t* left = (i > 0) ? parent->u.child[i - 1] : NULL;
+	ngx_btree_node_t* right = (i < parent->nkeys) ? parent->u.child[i + 1] : NULL;
+
+	if (left && left->nkeys > NGX_BTREE_MIN_KEYS)
+	{
+		/* borrow the last key of the left sibling */
+
+		ngx_memmove(&child->keys[1], &child->keys[0],
+					child->nkeys * sizeof(ngx_btree_key_t));
+
+		if (child->leaf)
+		{
+			ngx_memmove(&child->u.leaf.value[1], &child->u.leaf.value[0],
+						child->nkeys * sizeof(void *));
+
+			child->keys[0] = left->keys[left->nkeys - 1];
+			child->u.leaf.value[0] = left->u.leaf.value[left->nkeys - 1];
+			parent->keys[i - 1] = child->keys[0];
+		}
+		else
+		{
+			ngx_memmove(&child->u.child[1], &child->u.child[0],
+						(child->nkeys + 1) * sizeof(ngx_btree_node_t *));
+
+			child->keys[0] = parent->keys[i - 1];
+			child->u.child[0] = left->u.child[left->nkeys];
+			parent->keys[i - 1] = left->keys[left->nkeys - 1];
+		}
+
+		left->nkeys--;
+		child->nkeys++;
+		return child;
+	}
+
+	if (right && right->nkeys > NGX_BTREE_MIN_KEYS)
+	{
+		/* borrow the first key of the right sibling */
+
+		if (child->leaf)
+		{
+			child->keys[child->nkeys] = right->keys[0];
+			child->u.leaf.value[child->nkeys] = right->u.leaf.value[0];
+
+			ngx_memmove(&right->u.leaf.value[0], &right->u.leaf.value[1],
+						(right->nkeys - 1) * sizeof(void *));
+		}
+		else
+		{
+			child->keys[child->nkeys] = parent->keys[i];
+			child->u.child[child->nkeys + 1] = right->u.child[0];
+			parent->keys[i] = right->keys[0];
+
+			ngx_memmove(&right->u.child[0], &right->u.child[1],
+						right->nkeys * sizeof(ngx_btree_node_t *));
+		}
+
+		ngx_memmove(&right->keys[0], &right->keys[1],
+					(right->nkeys - 1) * sizeof(ngx_btree_key_t));
+
+		right->nkeys--;
+		child->nkeys++;
+
+		if (child->leaf)
+			parent->keys[i] = right->keys[0];
+
+		return child;
+	}
+
+	if (right)
+	{
+		ngx_btree_merge_children(tree, parent, i);
+		return child;
+	}
+
+	ngx_btree_merge_children(tree, parent, i - 1);
+	return left;
+}
+
+/* merge the child i + 1 of the parent into the child i */
+
+static void ngx_btree_merge_children(ngx_btree_t *tree, ngx_btree_node_t *parent, ngx_uint_t i)
+{
+	ngx_btree_node_t* left = parent->u.child[i];
+	ngx_btree_node_t* right = parent->u.child[i + 1];
+
+	if (left->leaf)
+	{
+		ngx_memcpy(&left->keys[left->nkeys], right->keys,
+				   right->nkeys * sizeof(ngx_btree_key_t));
+		ngx_memcpy(&left->u.leaf.value[left->nkeys], right->u.leaf.value,
+				   right->nkeys * sizeof(void *));
+
+		left->u.leaf.next = right->u.leaf.next;
+		left->nkeys += right->nkeys;
+	}
+	else
+	{
+		/* the separator moves down between the two halves */
+		left->keys[left->nkeys] = parent->keys[i];
+
+		ngx_memcpy(&left->keys[left->nkeys + 1], right->keys,
+				   right->nkeys * sizeof(ngx_btree_key_t));
+		ngx_memcpy(&left->u.child[left->nkeys + 1], right->u.child,
+				   (right->nkeys + 1) * sizeof(ngx_btree_node_t *));
+
+		left->nkeys += right->nkeys + 1;
+	}
+
+	parent->nkeys--;
+
+	ngx_memmove(&parent->keys[i], &parent->keys[i + 1],
+				(parent->nkeys - i) * sizeof(ngx_btree_key_t));
+	ngx_memmove(&parent->u.child[i + 1], &parent->u.child[i + 2],
+				(parent->nkeys - i) * sizeof(ngx_btree_node_t *));
+
+	ngx_btree_free(tree, right);
+}
+
+/*
+ * Nodes are carved out of page-sized chunks, as ngx_radix_alloc() does:
+ * a pool allocation per node would be a separate malloc() and an entry
+ * in the pool large list.  Neighbouring nodes share a page, and a page
+ * aligned chunk keeps 256-byte nodes on cache line boundaries.
+ */
+
+static ngx_btree_node_t* ngx_btree_alloc(ngx_btree_t *tree, ngx_uint_t leaf)
+{
+	ngx_btree_node_t* node = tree->free_list;
+
+	if (node)
+	{
+		tree->free_list = node->u.child[0];
+	}
+	else
+	{
+		if (tree->size < sizeof(ngx_btree_node_t))
+		{
+			tree->start = ngx_pmemalign(tree->pool, ngx_pagesize, ngx_pagesize);
+			if (tree->start == NULL)
+				return NULL;
+
+			tree->size = ngx_pagesize;
+		}
+
+		node = (ngx_btree_node_t*) tree->start;
+		tree->start += sizeof(ngx_btree_node_t);
+		tree->size -= sizeof(ngx_btree_node_t);
+	}
+
+	node->nkeys = 0;
+	node->leaf = leaf;
+	node->u.leaf.next = NULL;
+	return node;
+}
+
+static void ngx_btree_free(ngx_btree_t *tree, ngx_btree_node_t *node)
+{
+	node->u.child[0] = tree->free_list;
+	tree->free_list = node;
+}
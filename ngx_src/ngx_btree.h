@@ -0,0 +1,93 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_BTREE_H_INCLUDED_
+#define _NGX_BTREE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * A B+tree keeping many keys per node, an ordered index with better
+ * locality than ngx_rbtree_t.  Values live in the leaves only, and the
+ * leaves are linked for in-order iteration.
+ *
+ * Keys are unique integers, compared as plain values: there is neither
+ * a compare callback nor room for duplicates, and inserting a key which
+ * is present returns NGX_BUSY.  A string-keyed index stores the hash as
+ * the key and chains the colliding entries off the value, which the
+ * caller tells apart by the string.
+ *
+ * With 15 keys a node takes 256 bytes (four cache lines) on 64-bit
+ * platforms, a tree of 1M keys is only 5-6 levels deep.
+ */
+
+#ifndef NGX_BTREE_KEYS
+#define NGX_BTREE_KEYS  15
+#endif
+
+/* minimum number of keys in a node other than the root */
+#define NGX_BTREE_MIN_KEYS  (NGX_BTREE_KEYS / 2)
+
+typedef ngx_uint_t  ngx_btree_key_t;
+
+typedef struct ngx_btree_node_s  ngx_btree_node_t;
+
+struct ngx_btree_node_s
+{
+	uint32_t               nkeys;
+	uint32_t               leaf;
+	ngx_btree_key_t        keys[NGX_BTREE_KEYS];
+
+	union {
+		ngx_btree_node_t  *child[NGX_BTREE_KEYS + 1];
+
+		struct {
+			void              *value[NGX_BTREE_KEYS];
+			ngx_btree_node_t  *next;
+		} leaf;
+	} u;
+};
+
+typedef struct {
+	ngx_btree_node_t      *root;
+	ngx_pool_t            *pool;
+
+	// deleted node are reused in free_list
+	ngx_btree_node_t      *free_list;
+
+	// the unused rest of the last page-sized chunk
+	char                  *start;
+	size_t                 size;
+
+	ngx_uint_t             count;
+	ngx_uint_t             height;
+} ngx_btree_t;
+
+/* position of a key in a leaf */
+typedef struct {
+	ngx_btree_node_t      *node;
+	ngx_uint_t             pos;
+} ngx_btree_cursor_t;
+
+#define ngx_btree_cursor_key(c)    ((c)->node->keys[(c)->pos])
+#define ngx_btree_cursor_value(c)  ((c)->node->u.leaf.value[(c)->pos])
+
+ngx_btree_t *ngx_btree_create(ngx_pool_t *pool);
+
+/* NGX_BUSY if the key is already in the tree */
+ngx_int_t ngx_btree_insert(ngx_btree_t *tree, ngx_btree_key_t key, void *value);
+/* NGX_DECLINED if the key is not in the tree */
+ngx_int_t ngx_btree_delete(ngx_btree_t *tree, ngx_btree_key_t key);
+void *ngx_btree_find(ngx_btree_t *tree, ngx_btree_key_t key);
+
+/* ordered iteration, both return NGX_DECLINED past the last key */
+ngx_int_t ngx_btree_min(ngx_btree_t *tree, ngx_btree_cursor_t *c);
+ngx_int_t ngx_btree_next(ngx_btree_cursor_t *c);
+
+#endif /* _NGX_BTREE_H_INCLUDED_ */
@@ -66,6 +66,9 @@ struct ngx_cycle_s {
     ngx_list_t                open_files;
     ngx_list_t                shared_memory;
 
+    /* ngx_radix_diff_target_t, the trees a prefix diff may change */
+    ngx_array_t              *radix_diff_targets;
+
     ngx_uint_t                connection_n;
     ngx_uint_t                files_n;
 
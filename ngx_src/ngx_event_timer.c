@@ -10,9 +10,198 @@
 #include <ngx_event.h>
 
 
+/*
+ * The slots are a single slab allocation, rounded up to whole pages.  The
+ * slab pool also takes its header, the slot lists and a descriptor per
+ * page from the zone, and aligns the pages, under two pages here: the
+ * zone adds the 8 pages which the nginx modules accept as the smallest
+ * zone.
+ */
+#define NGX_EVENT_TIMER_STAT_ZONE_SIZE                                        \
+    (8 * ngx_pagesize                                                         \
+     + ngx_align(NGX_MAX_PROCESSES * sizeof(ngx_event_timer_stat_t), ngx_pagesize))
+
+/* counts when no stats zone is configured */
+static ngx_event_timer_stat_t  ngx_event_timer_local_stat;
+
+ngx_uint_t               ngx_event_timer_noncancelable;
+ngx_event_timer_stat_t  *ngx_event_timer_stat = &ngx_event_timer_local_stat;
+
+static ngx_msec_t  ngx_event_timer_second;
+static ngx_uint_t  ngx_event_timer_calls;
+
+static ngx_int_t ngx_event_timer_stat_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_event_timer_stat_t *ngx_event_timer_stat_slots(void);
+
+
+/*
+ * The "timer_stat_zone name;" directive of the events block: each worker
+ * keeps its timer counters in the slot ngx_worker of the zone, so that
+ * they may be read from outside, e.g. by a status handler or a debugger
+ * attached to the master.
+ */
+
+char *ngx_event_timer_stat_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *value = cf->args->elts;
+
+	ngx_shm_zone_t *shm_zone = ngx_shared_memory_add(cf, &value[1], NGX_EVENT_TIMER_STAT_ZONE_SIZE,
+													 &ngx_event_timer_stat_zone);
+	if (shm_zone == NULL)
+		return NGX_CONF_ERROR;
+
+	shm_zone->init = ngx_event_timer_stat_init_zone;
+
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_event_timer_stat_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	if (data)
+	{
+		shm_zone->data = data;
+		return NGX_OK;
+	}
+
+	ngx_slab_pool_t *shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists)
+	{
+		shm_zone->data = shpool->data;
+		return NGX_OK;
+	}
+
+	ngx_event_timer_stat_t *stat = ngx_slab_calloc(shpool, NGX_MAX_PROCESSES * sizeof(ngx_event_timer_stat_t));
+	if (stat == NULL)
+		return NGX_ERROR;
+
+	shpool->data = stat;
+	shm_zone->data = stat;
+
+	return NGX_OK;
+}
+
+/* called by ngx_event_timer_init() of the backend */
+
+void ngx_event_timer_stat_init(void)
+{
+	ngx_event_timer_stat = &ngx_event_timer_local_stat;
+
+	/*
+	 * the slots are indexed by ngx_worker, which is 0 in the cache manager,
+	 * the cache loader and a single process as well: those keep counting
+	 * into the static structure
+	 */
+
+	if (ngx_process == NGX_PROCESS_WORKER)
+	{
+		ngx_event_timer_stat_t *stat = ngx_event_timer_stat_slots();
+		if (stat)
+			ngx_event_timer_stat = &stat[ngx_worker < NGX_MAX_PROCESSES ? ngx_worker : 0];
+	}
+
+	ngx_memzero(ngx_event_timer_stat, sizeof(ngx_event_timer_stat_t));
+	ngx_event_timer_stat->pid = ngx_pid;
+}
+
+/* the slots of the timer stats zone, NULL if there is none */
+
+static ngx_event_timer_stat_t *ngx_event_timer_stat_slots(void)
+{
+	ngx_list_part_t *part = &((ngx_cycle_t *) ngx_cycle)->shared_memory.part;
+	ngx_shm_zone_t *shm_zone = part->elts;
+
+	for (ngx_uint_t i = 0; /* void */ ; i++)
+	{
+		if (i >= part->nelts)
+		{
+			if (part->next == NULL)
+				break;
+
+			part = part->next;
+			shm_zone = part->elts;
+			i = 0;
+		}
+
+		if (shm_zone[i].tag == &ngx_event_timer_stat_zone && shm_zone[i].data)
+			return shm_zone[i].data;
+	}
+
+	return NULL;
+}
+
+ngx_msec_t ngx_event_find_timer(void)
+{
+	ngx_msec_t timer = ngx_event_timer_nearest();
+	ngx_uint_t i = NGX_TIMER_WAIT_BUCKETS - 1;
+
+	if (timer != NGX_TIMER_INFINITE)
+	{
+		ngx_msec_t n = timer;
+		for (i = 0; n && i < NGX_TIMER_WAIT_BUCKETS - 2; i++)
+			n >>= 1;
+	}
+
+	ngx_event_timer_stat->wait[i]++;
+
+	return timer;
+}
+
+/* called once per event loop iteration by ngx_event_expire_timers() */
+
+void ngx_event_timer_count_expired(ngx_uint_t n)
+{
+	ngx_uint_t i;
+
+	for (i = 0; n && i < NGX_TIMER_EXPIRED_BUCKETS - 1; i++)
+		n >>= 1;
+
+	ngx_event_timer_stat->expired[i]++;
+
+	ngx_msec_t second = ngx_current_msec / 1000;
+	if (second != ngx_event_timer_second)
+	{
+		/* the costlier gauges are sampled once a second */
+		ngx_event_timer_stat->wakeups = ngx_event_timer_calls;
+
+		/* nobody reads the static counters */
+		if (ngx_event_timer_stat != &ngx_event_timer_local_stat)
+			ngx_event_timer_stat->height = ngx_event_timer_height();
+
+		ngx_event_timer_second = second;
+		ngx_event_timer_calls = 0;
+	}
+
+	ngx_event_timer_calls++;
+}
+
+/*
+ * Exiting workers call it on every iteration, so instead of walking all
+ * the timers it checks the count kept by ngx_event_add_timer() and
+ * ngx_event_timer_unset().
+ */
+
+ngx_int_t ngx_event_no_timers_left(void)
+{
+	if (ngx_event_timer_noncancelable)
+		return NGX_AGAIN;
+
+	/* only cancelable timers left */
+
+	return NGX_OK;
+}
+
+
+#if !(NGX_EVENT_TIMER_WHEEL) && !(NGX_EVENT_TIMER_HEAP)
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+/* expired timers waiting for their handlers, a circular list */
+static ngx_rbtree_node_t  ngx_event_timer_detached;
+
+static void ngx_event_timer_detach(ngx_rbtree_node_t *node);
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -21,69 +210,103 @@ static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
 ngx_int_t ngx_event_timer_init(ngx_log_t *log)
 {
-	ngx_rbtree_init(&ngx_event_timer_rbtree, 
-					&ngx_event_timer_sentinel,
-					ngx_rbtree_insert_timer_value);
+	ngx_event_timer_stat_init();
+
+	ngx_rbtree_timer_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel);
+
+	ngx_event_timer_detached.left = &ngx_event_timer_detached;
+	ngx_event_timer_detached.right = &ngx_event_timer_detached;
 
 	return NGX_OK;
 }
 
-ngx_msec_t ngx_event_find_timer(void)
+ngx_msec_t ngx_event_timer_nearest(void)
 {
 	if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel)
 		return NGX_TIMER_INFINITE;
 
-	ngx_rbtree_node_t *root = ngx_event_timer_rbtree.root;
-	ngx_rbtree_node_t *sentinel = ngx_event_timer_rbtree.sentinel;
-	ngx_rbtree_node_t *node = ngx_rbtree_min(root, sentinel);
+	ngx_rbtree_node_t *node = ngx_event_timer_rbtree.leftmost;
 	ngx_msec_int_t timer = (ngx_msec_int_t)(node->key - ngx_current_msec);
 	return (ngx_msec_t)(timer > 0 ? timer : 0);
 }
 
+/*
+ * All the expired timers are detached from the rbtree in one pass, and
+ * only then their handlers are called, so a timeout storm does not mix
+ * the rebalancing with the handlers.  The detached timers are still set:
+ * a handler which deletes one, e.g. when closing a connection whose both
+ * timers have expired, just unlinks it from the list, see
+ * ngx_event_timer_delete().  Timers which handlers add already expired
+ * are picked up by the next pass.
+ */
+
 void ngx_event_expire_timers(void)
 {
-	ngx_rbtree_node_t *sentinel = ngx_event_timer_rbtree.sentinel;
+	ngx_rbtree_node_t *head = &ngx_event_timer_detached;
+	ngx_uint_t n = 0;
+
 	for ( ;; )
 	{
-		ngx_rbtree_node_t *root = ngx_event_timer_rbtree.root;
-		if (root == sentinel)
-			return;
+		ngx_uint_t detached = ngx_rbtree_extract_le(&ngx_event_timer_rbtree,
+													ngx_current_msec,
+													ngx_event_timer_detach);
+		if (detached == 0)
+			break;
+
+		n += detached;
 
-		ngx_rbtree_node_t *node = ngx_rbtree_min(root, sentinel);
-		if ((ngx_msec_int_t) (node->key - ngx_current_msec) > 0)
-			return;
+		while (head->right != head)
+		{
+			ngx_rbtree_node_t *node = head->right;
 
-		ngx_event_t *ev = (ngx_event_t *)((char *)node - offsetof(ngx_event_t, timer));
+			node->left->right = node->right;
+			node->right->left = node->left;
 
-		ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
-					   "event timer del: %d: %M",
-					   ngx_event_ident(ev->data), ev->timer.key);
+			ngx_event_t *ev = (ngx_event_t *)((char *)node - offsetof(ngx_event_t, timer));
 
-		ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+			ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+						   "event timer expired: %d",
+						   ngx_event_ident(ev->data));
 
-		ev->timer_set = 0;
-		ev->timedout = 1;
-		ev->handler(ev);
+			ngx_event_timer_unset(ev);
+			ev->timedout = 1;
+			ev->handler(ev);
+		}
 	}
+
+	ngx_event_timer_count_expired(n);
 }
 
-ngx_int_t ngx_event_no_timers_left(void)
+/*
+ * Not the height itself, which takes a walk of the whole tree, but its
+ * bound: no path is longer than twice the black height, which is counted
+ * down the left spine in O(log n).
+ */
+
+ngx_uint_t ngx_event_timer_height(void)
 {
-	ngx_rbtree_node_t *root = ngx_event_timer_rbtree.root;
 	ngx_rbtree_node_t *sentinel = ngx_event_timer_rbtree.sentinel;
-	if (root == sentinel)
-		return NGX_OK;
+	ngx_uint_t black = 0;
 
-	for (ngx_rbtree_node_t *node = ngx_rbtree_min(root, sentinel);
-		 node;
-		 node = ngx_rbtree_next(&ngx_event_timer_rbtree, node))
+	for (ngx_rbtree_node_t *node = ngx_event_timer_rbtree.root; node != sentinel; node = node->left)
 	{
-		ngx_event_t* ev = (ngx_event_t *)((char *)node - offsetof(ngx_event_t, timer));
-		if (!ev->cancelable)
-			return NGX_AGAIN;
+		if (ngx_rbt_is_black(node))
+			black++;
 	}
 
-	/* only cancelable timers left */
+	return 2 * black;
+}
 
-	return NGX_OK;
+static void ngx_event_timer_detach(ngx_rbtree_node_t *node)
+{
+	ngx_rbtree_node_t *head = &ngx_event_timer_detached;
+
+	node->color = NGX_TIMER_DETACHED;
+
+	node->right = head;
+	node->left = head->left;
+	head->left->right = node;
+	head->left = node;
 }
+
+#endif /* !NGX_EVENT_TIMER_WHEEL && !NGX_EVENT_TIMER_HEAP */
@@ -14,17 +14,168 @@
 #include <ngx_event.h>
 
 
-#define NGX_TIMER_LAZY_DELAY  300
+/*
+ * A re-armed timer keeps its deadline if the new one is less than
+ * NGX_TIMER_LAZY_PERCENT of the timeout away, but the window is at least
+ * NGX_TIMER_LAZY_MIN and at most NGX_TIMER_LAZY_MAX milliseconds.
+ */
+#define NGX_TIMER_LAZY_PERCENT  5
+#define NGX_TIMER_LAZY_MIN      10
+#define NGX_TIMER_LAZY_MAX      3000
+
 #define NGX_TIMER_INFINITE  (ngx_msec_t) -1
 
+/*
+ * Timer precision classes: a deadline is rounded up to a multiple of
+ * 2^class milliseconds, so that timers of a class expire together and
+ * the event loop wakes up at most once per 8 ms for coarse timers and
+ * once per 1024 ms for idle ones.  Deadlines are never moved earlier.
+ */
+#define NGX_TIMER_EXACT   0
+#define NGX_TIMER_COARSE  3
+#define NGX_TIMER_IDLE    10
+
 ngx_int_t ngx_event_timer_init(ngx_log_t *log);
 ngx_msec_t ngx_event_find_timer(void);
 void ngx_event_expire_timers(void);
 ngx_int_t ngx_event_no_timers_left(void);
 
+/*
+ * timers expired per ngx_event_expire_timers() call: the first bucket
+ * counts calls with none, bucket i counts [2^(i-1), 2^i) timers
+ */
+#define NGX_TIMER_EXPIRED_BUCKETS  16
+
+/*
+ * ngx_event_find_timer() results: bucket 0 counts 0 ms, bucket i counts
+ * [2^(i-1), 2^i) ms, and the last one NGX_TIMER_INFINITE
+ */
+#define NGX_TIMER_WAIT_BUCKETS     24
+
+typedef struct {
+    ngx_pid_t     pid;
+
+    /* gauges */
+    ngx_uint_t    armed;
+
+    /*
+     * twice the black height of the rbtree, which bounds its height, the
+     * height of the heap, or the number of levels in use for the wheel;
+     * sampled only into a stats zone
+     */
+    ngx_uint_t    height;
+
+    /* ngx_event_expire_timers() calls, i.e. event loop wakeups, in the last second */
+    ngx_uint_t    wakeups;
+
+    /* timer operations done and saved by the lazy window */
+    ngx_uint_t    inserted;
+    ngx_uint_t    deleted;
+    ngx_uint_t    lazy_skipped;
+
+    ngx_uint_t    expired[NGX_TIMER_EXPIRED_BUCKETS];
+    ngx_uint_t    wait[NGX_TIMER_WAIT_BUCKETS];
+} ngx_event_timer_stat_t;
+
+/* the counters of this worker, in the timer stats zone if there is one */
+extern ngx_event_timer_stat_t  *ngx_event_timer_stat;
+
+char *ngx_event_timer_stat_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+void ngx_event_timer_stat_init(void);
+void ngx_event_timer_count_expired(ngx_uint_t n);
+
+/* implemented by the backend */
+ngx_msec_t ngx_event_timer_nearest(void);
+ngx_uint_t ngx_event_timer_height(void);
+
+/* armed timers which are not cancelable */
+extern ngx_uint_t  ngx_event_timer_noncancelable;
+
+/* ev->timer.data flags */
+#define NGX_TIMER_NONCANCELABLE  0x01
+#define NGX_TIMER_USEC           0x02
+
+#if (NGX_HAVE_TIMERFD)
+
+/*
+ * microsecond timers, kept apart from the millisecond ones and armed
+ * with a timerfd, see ngx_event_timerfd.c
+ */
+void ngx_event_add_timer_usec(ngx_event_t *ev, uint64_t usec);
+void ngx_event_timerfd_delete(ngx_rbtree_node_t *node);
+void ngx_event_timerfd_done(void);
+
+#endif
+
+
+/*
+ * The timers are kept in the rbtree by default, building with
+ * NGX_EVENT_TIMER_WHEEL selects the timing wheel of ngx_event_timer_wheel.c,
+ * and NGX_EVENT_TIMER_HEAP the 4-ary heap of ngx_event_timer_heap.c.
+ * ngx_event_timer_insert() fails only for the heap, when it cannot grow.
+ */
+
+#if (NGX_EVENT_TIMER_WHEEL)
+
+void ngx_event_timer_wheel_insert(ngx_rbtree_node_t *node);
+void ngx_event_timer_wheel_delete(ngx_rbtree_node_t *node);
+
+#define ngx_event_timer_insert(node)  (ngx_event_timer_wheel_insert(node), NGX_OK)
+#define ngx_event_timer_delete(node)  ngx_event_timer_wheel_delete(node)
+
+#elif (NGX_EVENT_TIMER_HEAP)
+
+ngx_int_t ngx_event_timer_heap_insert(ngx_rbtree_node_t *node);
+void ngx_event_timer_heap_delete(ngx_rbtree_node_t *node);
+
+#define ngx_event_timer_insert(node)  ngx_event_timer_heap_insert(node)
+#define ngx_event_timer_delete(node)  ngx_event_timer_heap_delete(node)
+
+/* the heap position of a timer, kept in the parent field of ev->timer */
+#define NGX_TIMER_HEAP_NONE  ((ngx_uint_t) -1)
+
+#define ngx_timer_heap_index(node)  ((ngx_uint_t) (uintptr_t) (node)->parent)
+#define ngx_timer_heap_set_index(node, i)                                     \
+    ((node)->parent = (ngx_rbtree_node_t *) (uintptr_t) (i))
+
+#else
 
 extern ngx_rbtree_t  ngx_event_timer_rbtree;
 
+/*
+ * Expired timers are detached from the rbtree before their handlers run,
+ * a handler may still delete a timer which is waiting in the detached list
+ */
+#define NGX_TIMER_DETACHED  2
+
+#define ngx_event_timer_insert(node)                                          \
+    (ngx_rbtree_insert(&ngx_event_timer_rbtree, node), NGX_OK)
+
+static ngx_inline void ngx_event_timer_delete(ngx_rbtree_node_t *node)
+{
+    if (node->color == NGX_TIMER_DETACHED) {
+        node->left->right = node->right;
+        node->right->left = node->left;
+        return;
+    }
+
+    ngx_rbtree_delete(&ngx_event_timer_rbtree, node);
+}
+
+#endif
+
+
+static ngx_inline void ngx_event_timer_unset(ngx_event_t *ev)
+{
+    if (ev->timer.data & NGX_TIMER_NONCANCELABLE) {
+        ngx_event_timer_noncancelable--;
+    }
+
+    ev->timer.data = 0;
+
+    ngx_event_timer_stat->armed--;
+    ev->timer_set = 0;
+}
 
 static ngx_inline void ngx_event_del_timer(ngx_event_t *ev)
 {
@@ -32,25 +183,48 @@ static ngx_inline void ngx_event_del_timer(ngx_event_t *ev)
                    "event timer del: %d: %M",
                     ngx_event_ident(ev->data), ev->timer.key);
 
-    ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+#if (NGX_HAVE_TIMERFD)
+    if (ev->timer.data & NGX_TIMER_USEC) {
+        ngx_event_timerfd_delete(&ev->timer);
 
-    ev->timer_set = 0;
+    } else
+#endif
+    {
+        ngx_event_timer_delete(&ev->timer);
+    }
+
+    ngx_event_timer_stat->deleted++;
+
+    ngx_event_timer_unset(ev);
 }
 
-static ngx_inline void ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
+static ngx_inline ngx_msec_t ngx_event_timer_lazy(ngx_msec_t timer)
+{
+    ngx_msec_t lazy = timer / 100 * NGX_TIMER_LAZY_PERCENT;
+
+    if (lazy < NGX_TIMER_LAZY_MIN)
+        return NGX_TIMER_LAZY_MIN;
+
+    return lazy < NGX_TIMER_LAZY_MAX ? lazy : NGX_TIMER_LAZY_MAX;
+}
+
+static ngx_inline void ngx_event_add_timer_precision(ngx_event_t *ev, ngx_msec_t timer, ngx_uint_t precision)
 {
-	ngx_msec_t key = ngx_current_msec + timer;
+	ngx_msec_t slack = ((ngx_msec_t) 1 << precision) - 1;
+	ngx_msec_t key = (ngx_current_msec + timer + slack) & ~slack;
 
-    if (ev->timer_set)
+    if (ev->timer_set && !(ev->timer.data & NGX_TIMER_USEC))
 	{
         /*
          * Use a previous timer value if difference between it and a new
-         * value is less than NGX_TIMER_LAZY_DELAY milliseconds: this allows
-         * to minimize the rbtree operations for fast connections.
+         * value is within the lazy window of the timeout: this allows
+         * to minimize the timer operations for fast connections.
          */
 
 		ngx_msec_int_t diff = (ngx_msec_int_t)(key - ev->timer.key);
-        if (ngx_abs(diff) < NGX_TIMER_LAZY_DELAY) {
+        if ((ngx_msec_t) ngx_abs(diff) < ngx_event_timer_lazy(timer)) {
+            ngx_event_timer_stat->lazy_skipped++;
+
             ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                            "event timer: %d, old: %M, new: %M",
                             ngx_event_ident(ev->data), ev->timer.key, key);
@@ -58,17 +232,39 @@ static ngx_inline void ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
         }
 
         ngx_del_timer(ev);
+
+    } else if (ev->timer_set) {
+        /* a microsecond timer is replaced */
+        ngx_del_timer(ev);
     }
 
     ev->timer.key = key;
+    ev->timer.data = 0;
 
     ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "event timer add: %d: %M:%M",
                     ngx_event_ident(ev->data), timer, ev->timer.key);
 
-    ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    /* the backend has logged the failure, the event is left without a timer */
+
+    if (ngx_event_timer_insert(&ev->timer) != NGX_OK) {
+        return;
+    }
+
+    if (!ev->cancelable) {
+        ev->timer.data = NGX_TIMER_NONCANCELABLE;
+        ngx_event_timer_noncancelable++;
+    }
+
+    ngx_event_timer_stat->inserted++;
+    ngx_event_timer_stat->armed++;
 
     ev->timer_set = 1;
 }
 
+static ngx_inline void ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
+{
+    ngx_event_add_timer_precision(ev, timer, NGX_TIMER_EXACT);
+}
+
 #endif /* _NGX_EVENT_TIMER_H_INCLUDED_ */
@@ -0,0 +1,235 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#if (NGX_EVENT_TIMER_HEAP)
+
+/*
+ * An array-backed 4-ary min-heap.  An entry keeps the key next to the
+ * timer node, so sifting compares keys without touching the events,
+ * and the array is offset so that the four children of an entry share
+ * one 64-byte cache line.  The position of a timer in the heap is kept
+ * in its node, see ngx_timer_heap_index(), which makes delete O(log n).
+ */
+
+#define NGX_TIMER_HEAP_D      4
+#define NGX_TIMER_HEAP_ALIGN  64
+
+/* the children of the root start at entries[1] */
+#define NGX_TIMER_HEAP_SKEW   (NGX_TIMER_HEAP_ALIGN / sizeof(ngx_event_timer_entry_t) - 1)
+
+typedef struct {
+	ngx_msec_t          key;
+	ngx_rbtree_node_t  *node;
+} ngx_event_timer_entry_t;
+
+typedef struct {
+	ngx_event_timer_entry_t  *entries;
+	ngx_uint_t                nelts;
+	ngx_uint_t                nalloc;
+
+	/* the allocated block, entries are skewed inside it */
+	void                     *block;
+} ngx_event_timer_heap_t;
+
+
+static ngx_int_t ngx_event_timer_heap_grow(ngx_log_t *log);
+static void ngx_event_timer_heap_sift_up(ngx_uint_t i, ngx_event_timer_entry_t entry);
+static void ngx_event_timer_heap_sift_down(ngx_uint_t i, ngx_event_timer_entry_t entry);
+
+static ngx_event_timer_heap_t  ngx_event_timer_heap;
+
+#define ngx_timer_heap_less(a, b)  ((ngx_msec_int_t) ((a) - (b)) < 0)
+
+#define ngx_timer_heap_place(i, entry)                                        \
+    (ngx_event_timer_heap.entries[i] = (entry),                               \
+     ngx_timer_heap_set_index((entry).node, i))
+
+
+ngx_int_t ngx_event_timer_init(ngx_log_t *log)
+{
+	ngx_event_timer_stat_init();
+
+	ngx_event_timer_heap.nalloc = 0;
+	ngx_event_timer_heap.nelts = 0;
+
+	return ngx_event_timer_heap_grow(log);
+}
+
+ngx_int_t ngx_event_timer_heap_insert(ngx_rbtree_node_t *node)
+{
+	ngx_event_timer_heap_t *heap = &ngx_event_timer_heap;
+
+	if (heap->nelts == heap->nalloc
+		&& ngx_event_timer_heap_grow(ngx_cycle->log) != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+					  "event timer heap is full, timer %M is not set", node->key);
+		ngx_timer_heap_set_index(node, NGX_TIMER_HEAP_NONE);
+		return NGX_ERROR;
+	}
+
+	ngx_event_timer_entry_t entry = { node->key, node };
+
+	ngx_event_timer_heap_sift_up(heap->nelts++, entry);
+
+	return NGX_OK;
+}
+
+void ngx_event_timer_heap_delete(ngx_rbtree_node_t *node)
+{
+	ngx_event_timer_heap_t *heap = &ngx_event_timer_heap;
+
+	ngx_uint_t i = ngx_timer_heap_index(node);
+	if (i == NGX_TIMER_HEAP_NONE)
+		return;
+
+	ngx_timer_heap_set_index(node, NGX_TIMER_HEAP_NONE);
+
+	ngx_event_timer_entry_t last = heap->entries[--heap->nelts];
+	if (i == heap->nelts)
+		return;
+
+	/* the last entry fills the hole, and moves up or down from there */
+
+	if (i > 0 && ngx_timer_heap_less(last.key, heap->entries[(i - 1) / NGX_TIMER_HEAP_D].key))
+		ngx_event_timer_heap_sift_up(i, last);
+	else
+		ngx_event_timer_heap_sift_down(i, last);
+}
+
+ngx_msec_t ngx_event_timer_nearest(void)
+{
+	if (ngx_event_timer_heap.nelts == 0)
+		return NGX_TIMER_INFINITE;
+
+	ngx_msec_int_t timer = (ngx_msec_int_t)(ngx_event_timer_heap.entries[0].key - ngx_current_msec);
+	return (ngx_msec_t)(timer > 0 ? timer : 0);
+}
+
+void ngx_event_expire_timers(void)
+{
+	ngx_event_timer_heap_t *heap = &ngx_event_timer_heap;
+	ngx_uint_t n = 0;
+
+	while (heap->nelts)
+	{
+		if ((ngx_msec_int_t) (heap->entries[0].key - ngx_current_msec) > 0)
+			break;
+
+		ngx_rbtree_node_t *node = heap->entries[0].node;
+		ngx_event_t *ev = (ngx_event_t *)((char *)node - offsetof(ngx_event_t, timer));
+
+		ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+					   "event timer del: %d: %M",
+					   ngx_event_ident(ev->data), ev->timer.key);
+
+		ngx_event_timer_heap_delete(node);
+		n++;
+
+		ngx_event_timer_unset(ev);
+		ev->timedout = 1;
+		ev->handler(ev);
+	}
+
+	ngx_event_timer_count_expired(n);
+}
+
+ngx_uint_t ngx_event_timer_height(void)
+{
+	ngx_uint_t height = 0;
+
+	for (ngx_uint_t n = ngx_event_timer_heap.nelts; n; n = (n - 1) / NGX_TIMER_HEAP_D)
+		height++;
+
+	return height;
+}
+
+static ngx_int_t ngx_event_timer_heap_grow(ngx_log_t *log)
+{
+	ngx_event_timer_heap_t *heap = &ngx_event_timer_heap;
+
+	/* the read and write events of every connection may have a timer */
+
+	ngx_uint_t n = heap->nalloc ? heap->nalloc * 2 : 2 * ngx_cycle->connection_n;
+	if (n < NGX_TIMER_HEAP_ALIGN)
+		n = NGX_TIMER_HEAP_ALIGN;
+
+	void *block = ngx_memalign(NGX_TIMER_HEAP_ALIGN,
+							   (n + NGX_TIMER_HEAP_SKEW) * sizeof(ngx_event_timer_entry_t), log);
+	if (block == NULL)
+		return NGX_ERROR;
+
+	ngx_event_timer_entry_t *entries = (ngx_event_timer_entry_t *) block + NGX_TIMER_HEAP_SKEW;
+
+	if (heap->block)
+	{
+		ngx_memcpy(entries, heap->entries, heap->nelts * sizeof(ngx_event_timer_entry_t));
+		ngx_free(heap->block);
+	}
+
+	heap->block = block;
+	heap->entries = entries;
+	heap->nalloc = n;
+
+	return NGX_OK;
+}
+
+static void ngx_event_timer_heap_sift_up(ngx_uint_t i, ngx_event_timer_entry_t entry)
+{
+	ngx_event_timer_entry_t *entries = ngx_event_timer_heap.entries;
+
+	while (i > 0)
+	{
+		ngx_uint_t parent = (i - 1) / NGX_TIMER_HEAP_D;
+
+		if (!ngx_timer_heap_less(entry.key, entries[parent].key))
+			break;
+
+		ngx_timer_heap_place(i, entries[parent]);
+		i = parent;
+	}
+
+	ngx_timer_heap_place(i, entry);
+}
+
+static void ngx_event_timer_heap_sift_down(ngx_uint_t i, ngx_event_timer_entry_t entry)
+{
+	ngx_event_timer_entry_t *entries = ngx_event_timer_heap.entries;
+	ngx_uint_t n = ngx_event_timer_heap.nelts;
+
+	for ( ;; )
+	{
+		ngx_uint_t child = i * NGX_TIMER_HEAP_D + 1;
+		if (child >= n)
+			break;
+
+		/* the smallest of up to four children */
+
+		ngx_uint_t min = child;
+		ngx_uint_t last = ngx_min(child + NGX_TIMER_HEAP_D, n);
+
+		for (child++; child < last; child++)
+		{
+			if (ngx_timer_heap_less(entries[child].key, entries[min].key))
+				min = child;
+		}
+
+		if (!ngx_timer_heap_less(entries[min].key, entry.key))
+			break;
+
+		ngx_timer_heap_place(i, entries[min]);
+		i = min;
+	}
+
+	ngx_timer_heap_place(i, entry);
+}
+
+#endif /* NGX_EVENT_TIMER_HEAP */
@@ -0,0 +1,311 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#if (NGX_EVENT_TIMER_WHEEL)
+
+/*
+ * A hierarchical timing wheel with a 1ms tick: 256 slots at the first
+ * level and 64 slots at each of the three upper levels cover 2^26 ms
+ * (about 18.6 hours), a longer timer is parked in the last level and
+ * cascaded again until it gets into range.  The slots are circular
+ * doubly linked lists of the ngx_event_t timer nodes, node->left is
+ * the previous and node->right the next entry, node->color keeps the
+ * level, so add and delete are O(1).
+ *
+ * A slot of an upper level is cascaded, that is, its timers are spread
+ * over the lower levels, when the first level wraps around.
+ */
+
+#define NGX_TIMER_WHEEL_BITS0   8
+#define NGX_TIMER_WHEEL_BITS    6
+#define NGX_TIMER_WHEEL_LEVELS  4
+
+#define NGX_TIMER_WHEEL_SLOTS0  (1 << NGX_TIMER_WHEEL_BITS0)
+#define NGX_TIMER_WHEEL_SLOTS   (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_MASK0   (NGX_TIMER_WHEEL_SLOTS0 - 1)
+#define NGX_TIMER_WHEEL_MASK    (NGX_TIMER_WHEEL_SLOTS - 1)
+
+#define NGX_TIMER_WHEEL_RANGE                                                 \
+    ((ngx_msec_int_t) 1 << (NGX_TIMER_WHEEL_BITS0                             \
+                            + NGX_TIMER_WHEEL_BITS * (NGX_TIMER_WHEEL_LEVELS - 1)))
+
+#define ngx_timer_wheel_shift(level)                                          \
+    (NGX_TIMER_WHEEL_BITS0 + NGX_TIMER_WHEEL_BITS * ((level) - 1))
+
+typedef struct {
+	ngx_rbtree_node_t   tv0[NGX_TIMER_WHEEL_SLOTS0];
+	ngx_rbtree_node_t   tv[NGX_TIMER_WHEEL_LEVELS - 1][NGX_TIMER_WHEEL_SLOTS];
+
+	ngx_uint_t          count[NGX_TIMER_WHEEL_LEVELS];
+
+	/* the current tick, all the earlier ones have been expired */
+	ngx_msec_t          base;
+} ngx_event_timer_wheel_t;
+
+
+static void ngx_event_timer_wheel_cascade(ngx_uint_t level, ngx_uint_t index);
+static void ngx_event_timer_wheel_tick(void);
+
+static ngx_event_timer_wheel_t  ngx_event_timer_wheel;
+
+#define ngx_timer_wheel_slot(level, index)                                    \
+    ((level) == 0 ? &ngx_event_timer_wheel.tv0[index]                         \
+                  : &ngx_event_timer_wheel.tv[(level) - 1][index])
+
+#define ngx_timer_wheel_empty(head)  ((head)->right == (head))
+
+
+ngx_int_t ngx_event_timer_init(ngx_log_t *log)
+{
+	ngx_event_timer_wheel_t *wheel = &ngx_event_timer_wheel;
+
+	ngx_event_timer_stat_init();
+
+	for (ngx_uint_t i = 0; i < NGX_TIMER_WHEEL_SLOTS0; i++)
+	{
+		wheel->tv0[i].left = &wheel->tv0[i];
+		wheel->tv0[i].right = &wheel->tv0[i];
+	}
+
+	for (ngx_uint_t level = 0; level < NGX_TIMER_WHEEL_LEVELS - 1; level++)
+	{
+		for (ngx_uint_t i = 0; i < NGX_TIMER_WHEEL_SLOTS; i++)
+		{
+			wheel->tv[level][i].left = &wheel->tv[level][i];
+			wheel->tv[level][i].right = &wheel->tv[level][i];
+		}
+	}
+
+	ngx_memzero(wheel->count, sizeof(wheel->count));
+
+	wheel->base = ngx_current_msec;
+
+	return NGX_OK;
+}
+
+void ngx_event_timer_wheel_insert(ngx_rbtree_node_t *node)
+{
+	ngx_event_timer_wheel_t *wheel = &ngx_event_timer_wheel;
+
+	ngx_uint_t level, index;
+	ngx_msec_t expires = node->key;
+	ngx_msec_int_t diff = (ngx_msec_int_t) (expires - wheel->base);
+
+	if (diff < 0)
+	{
+		/* already expired, goes to the current slot */
+		level = 0;
+		index = wheel->base & NGX_TIMER_WHEEL_MASK0;
+	}
+	else if (diff < NGX_TIMER_WHEEL_SLOTS0)
+	{
+		level = 0;
+		index = expires & NGX_TIMER_WHEEL_MASK0;
+	}
+	else
+	{
+		if (diff >= NGX_TIMER_WHEEL_RANGE)
+			expires = wheel->base + NGX_TIMER_WHEEL_RANGE - 1;
+
+		for (level = 1; level < NGX_TIMER_WHEEL_LEVELS - 1; level++)
+		{
+			if (diff < (ngx_msec_int_t) 1 << ngx_timer_wheel_shift(level + 1))
+				break;
+		}
+
+		index = (expires >> ngx_timer_wheel_shift(level)) & NGX_TIMER_WHEEL_MASK;
+	}
+
+	ngx_rbtree_node_t *head = ngx_timer_wheel_slot(level, index);
+
+	node->color = (u_char) level;
+	node->right = head;
+	node->left = head->left;
+	head->left->right = node;
+	head->left = node;
+
+	wheel->count[level]++;
+}
+
+void ngx_event_timer_wheel_delete(ngx_rbtree_node_t *node)
+{
+	node->left->right = node->right;
+	node->right->left = node->left;
+
+	ngx_event_timer_wheel.count[node->color]--;
+
+#if (NGX_DEBUG)
+	node->left = NULL;
+	node->right = NULL;
+#endif
+}
+
+ngx_msec_t ngx_event_timer_nearest(void)
+{
+	ngx_event_timer_wheel_t *wheel = &ngx_event_timer_wheel;
+
+	ngx_uint_t upper = 0;
+	for (ngx_uint_t level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++)
+		upper += wheel->count[level];
+
+	if (wheel->count[0] == 0 && upper == 0)
+		return NGX_TIMER_INFINITE;
+
+	/*
+	 * The first non-empty slot of the first level gives the exact
+	 * expiry, unless there are upper level timers to be cascaded
+	 * before it.  In the latter case the wheel is woken up at the
+	 * wrap of the first level.
+	 */
+
+	ngx_msec_t t = wheel->base;
+
+	if (wheel->count[0] == 0)
+	{
+		t = (t | NGX_TIMER_WHEEL_MASK0) + 1;
+	}
+	else
+	{
+		for (ngx_uint_t i = 0; i < NGX_TIMER_WHEEL_SLOTS0; i++, t++)
+		{
+			if (i && (t & NGX_TIMER_WHEEL_MASK0) == 0 && upper)
+				break;
+
+			if (!ngx_timer_wheel_empty(&wheel->tv0[t & NGX_TIMER_WHEEL_MASK0]))
+				break;
+		}
+	}
+
+	ngx_msec_int_t timer = (ngx_msec_int_t) (t - ngx_current_msec);
+	return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+void ngx_event_expire_timers(void)
+{
+	ngx_event_timer_wheel_t *wheel = &ngx_event_timer_wheel;
+	ngx_uint_t n = 0;
+
+	for ( ;; )
+	{
+		/*
+		 * all the timers in the current slot are due: the slot keeps
+		 * the keys from base to base + 255 with the same low bits
+		 */
+
+		ngx_rbtree_node_t *head = &wheel->tv0[wheel->base & NGX_TIMER_WHEEL_MASK0];
+
+		while (!ngx_timer_wheel_empty(head))
+		{
+			ngx_rbtree_node_t *node = head->right;
+			ngx_event_t *ev = (ngx_event_t *)((char *)node - offsetof(ngx_event_t, timer));
+
+			ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+						   "event timer del: %d: %M",
+						   ngx_event_ident(ev->data), ev->timer.key);
+
+			ngx_event_timer_wheel_delete(node);
+			n++;
+
+			ngx_event_timer_unset(ev);
+			ev->timedout = 1;
+			ev->handler(ev);
+		}
+
+		if ((ngx_msec_int_t) (ngx_current_msec - wheel->base) <= 0)
+			break;
+
+		if (wheel->count[0] == 0)
+		{
+			/* nothing to expire until the next wrap, skip the empty ticks */
+
+			ngx_msec_t next = (wheel->base | NGX_TIMER_WHEEL_MASK0) + 1;
+
+			if ((ngx_msec_int_t) (ngx_current_msec - next) < 0)
+			{
+				wheel->base = ngx_current_msec;
+				break;
+			}
+
+			wheel->base = next;
+		}
+		else
+		{
+			wheel->base++;
+		}
+
+		ngx_event_timer_wheel_tick();
+	}
+
+	ngx_event_timer_count_expired(n);
+}
+
+/* the wheel has no tree, the number of levels in use is reported */
+
+ngx_uint_t ngx_event_timer_height(void)
+{
+	for (ngx_uint_t level = NGX_TIMER_WHEEL_LEVELS; level > 0; level--)
+	{
+		if (ngx_event_timer_wheel.count[level - 1])
+			return level;
+	}
+
+	return 0;
+}
+
+/* cascades the upper levels when the first one wraps around */
+
+static void ngx_event_timer_wheel_tick(void)
+{
+	ngx_msec_t base = ngx_event_timer_wheel.base;
+
+	if (base & NGX_TIMER_WHEEL_MASK0)
+		return;
+
+	for (ngx_uint_t level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++)
+	{
+		ngx_uint_t index = (base >> ngx_timer_wheel_shift(level)) & NGX_TIMER_WHEEL_MASK;
+
+		ngx_event_timer_wheel_cascade(level, index);
+
+		if (index != 0)
+			break;
+	}
+}
+
+static void ngx_event_timer_wheel_cascade(ngx_uint_t level, ngx_uint_t index)
+{
+	ngx_rbtree_node_t *head = ngx_timer_wheel_slot(level, index);
+
+	if (ngx_timer_wheel_empty(head))
+		return;
+
+	/* move the list aside, a timer out of range may come back to this slot */
+
+	ngx_rbtree_node_t list;
+
+	list.right = head->right;
+	list.left = head->left;
+	list.right->left = &list;
+	list.left->right = &list;
+
+	head->left = head;
+	head->right = head;
+
+	while (list.right != &list)
+	{
+		ngx_rbtree_node_t *node = list.right;
+
+		ngx_event_timer_wheel_delete(node);
+		ngx_event_timer_wheel_insert(node);
+	}
+}
+
+#endif /* NGX_EVENT_TIMER_WHEEL */
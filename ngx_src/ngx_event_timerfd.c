@@ -0,0 +1,233 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#if (NGX_HAVE_TIMERFD)
+
+#include <sys/timerfd.h>
+
+/*
+ * Microsecond timers for deadlines below the millisecond resolution of
+ * ngx_current_msec.  They are kept in their own rbtree keyed in CLOCK_MONOTONIC
+ * microseconds, and a timerfd registered with the event module is armed
+ * for the earliest of them, so the event loop is woken up on time
+ * regardless of the millisecond timers.  An event has a single timer node,
+ * NGX_TIMER_USEC in ev->timer.data tells ngx_event_del_timer() which tree
+ * the node is in.
+ *
+ * The timerfd is created on the first microsecond timer, if that fails
+ * the timers fall back to ngx_event_add_timer() rounded up to milliseconds.
+ */
+
+static ngx_int_t ngx_event_timerfd_init(ngx_cycle_t *cycle);
+static void ngx_event_timerfd_arm(uint64_t now);
+static void ngx_event_timerfd_handler(ngx_event_t *rev);
+static uint64_t ngx_event_timerfd_now(void);
+
+static ngx_rbtree_t        ngx_event_timerfd_rbtree;
+static ngx_rbtree_node_t   ngx_event_timerfd_sentinel;
+static ngx_connection_t   *ngx_event_timerfd_conn;
+static ngx_uint_t          ngx_event_timerfd_failed;
+
+/* the deadline the timerfd is armed for, 0 if disarmed */
+static uint64_t            ngx_event_timerfd_armed;
+
+
+void ngx_event_add_timer_usec(ngx_event_t *ev, uint64_t usec)
+{
+	if (ngx_event_timerfd_conn == NULL
+		&& (ngx_event_timerfd_failed
+			|| ngx_event_timerfd_init((ngx_cycle_t *) ngx_cycle) != NGX_OK))
+	{
+		ngx_event_add_timer(ev, (usec + 999) / 1000);
+		return;
+	}
+
+	if (ev->timer_set)
+		ngx_del_timer(ev);
+
+	uint64_t key = ngx_event_timerfd_now() + usec;
+
+	/* on 32-bit platforms the node keeps the low bits of the deadline */
+
+	ev->timer.key = (ngx_rbtree_key_t) key;
+	ev->timer.data = NGX_TIMER_USEC;
+
+	if (!ev->cancelable)
+	{
+		ev->timer.data |= NGX_TIMER_NONCANCELABLE;
+		ngx_event_timer_noncancelable++;
+	}
+
+	ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+				   "event timer add usec: %d: %uL:%uL",
+				   ngx_event_ident(ev->data), usec, key);
+
+	ngx_rbtree_insert(&ngx_event_timerfd_rbtree, &ev->timer);
+
+	ngx_event_timer_stat->inserted++;
+	ngx_event_timer_stat->armed++;
+
+	ev->timer_set = 1;
+
+	/* the timerfd is rearmed only for a new earliest deadline */
+
+	if (ngx_event_timerfd_rbtree.leftmost == &ev->timer)
+		ngx_event_timerfd_arm(key - usec);
+}
+
+void ngx_event_timerfd_delete(ngx_rbtree_node_t *node)
+{
+	/*
+	 * the timerfd is not rearmed on delete, an early wakeup finds nothing
+	 * to expire and arms it for the next deadline
+	 */
+
+	ngx_rbtree_delete(&ngx_event_timerfd_rbtree, node);
+}
+
+static ngx_int_t ngx_event_timerfd_init(ngx_cycle_t *cycle)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (fd == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, "timerfd_create() failed");
+		ngx_event_timerfd_failed = 1;
+		return NGX_ERROR;
+	}
+
+	ngx_connection_t *c = ngx_get_connection(fd, cycle->log);
+	if (c == NULL)
+	{
+		if (close(fd) == -1)
+			ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, "timerfd close() failed");
+
+		ngx_event_timerfd_failed = 1;
+		return NGX_ERROR;
+	}
+
+	c->read->handler = ngx_event_timerfd_handler;
+	c->read->log = cycle->log;
+	c->log = cycle->log;
+
+	if (ngx_handle_read_event(c->read, 0) != NGX_OK)
+	{
+		ngx_close_connection(c);
+		ngx_event_timerfd_failed = 1;
+		return NGX_ERROR;
+	}
+
+	ngx_rbtree_timer_init(&ngx_event_timerfd_rbtree, &ngx_event_timerfd_sentinel);
+
+	ngx_event_timerfd_conn = c;
+	ngx_event_timerfd_armed = 0;
+
+	return NGX_OK;
+}
+
+/* closes the timerfd of an exiting worker, all its timers are gone by then */
+
+void ngx_event_timerfd_done(void)
+{
+	if (ngx_event_timerfd_conn == NULL)
+		return;
+
+	ngx_close_connection(ngx_event_timerfd_conn);
+	ngx_event_timerfd_conn = NULL;
+}
+
+static void ngx_event_timerfd_arm(uint64_t now)
+{
+	struct itimerspec its;
+
+	ngx_memzero(&its, sizeof(struct itimerspec));
+
+	uint64_t key = 0;
+
+	if (ngx_event_timerfd_rbtree.root != &ngx_event_timerfd_sentinel)
+	{
+		ngx_rbtree_key_t low = ngx_event_timerfd_rbtree.leftmost->key;
+		key = now + (ngx_rbtree_key_int_t) (low - (ngx_rbtree_key_t) now);
+
+		/* a zero it_value disarms the timer */
+		if (key == 0)
+			key = 1;
+
+		its.it_value.tv_sec = key / 1000000;
+		its.it_value.tv_nsec = (key % 1000000) * 1000;
+	}
+
+	if (key == ngx_event_timerfd_armed)
+		return;
+
+	if (timerfd_settime(ngx_event_timerfd_conn->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, ngx_event_timerfd_conn->log, ngx_errno,
+					  "timerfd_settime() failed");
+		return;
+	}
+
+	ngx_event_timerfd_armed = key;
+}
+
+static void ngx_event_timerfd_handler(ngx_event_t *rev)
+{
+	uint64_t expirations;
+
+	ngx_log_debug0(NGX_LOG_DEBUG_EVENT, rev->log, 0, "timerfd handler");
+
+	if (read(ngx_event_timerfd_conn->fd, &expirations, sizeof(uint64_t)) == -1
+		&& ngx_errno != NGX_EAGAIN)
+	{
+		ngx_log_error(NGX_LOG_ALERT, rev->log, ngx_errno, "timerfd read() failed");
+	}
+
+	ngx_event_timerfd_armed = 0;
+
+	uint64_t now = ngx_event_timerfd_now();
+
+	for ( ;; )
+	{
+		ngx_rbtree_node_t *node = ngx_event_timerfd_rbtree.leftmost;
+		if (node == &ngx_event_timerfd_sentinel)
+			break;
+
+		if ((ngx_rbtree_key_int_t) (node->key - (ngx_rbtree_key_t) now) > 0)
+			break;
+
+		ngx_event_t *ev = (ngx_event_t *)((char *)node - offsetof(ngx_event_t, timer));
+
+		ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+					   "event timer del usec: %d: %uL",
+					   ngx_event_ident(ev->data), (uint64_t) ev->timer.key);
+
+		ngx_rbtree_delete(&ngx_event_timerfd_rbtree, node);
+
+		ngx_event_timer_unset(ev);
+		ev->timedout = 1;
+		ev->handler(ev);
+	}
+
+	ngx_event_timerfd_arm(ngx_event_timerfd_now());
+
+	if (ngx_handle_read_event(rev, 0) != NGX_OK)
+		ngx_log_error(NGX_LOG_ALERT, rev->log, 0, "timerfd read event failed");
+}
+
+static uint64_t ngx_event_timerfd_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif /* NGX_HAVE_TIMERFD */
@@ -65,6 +65,11 @@ ngx_signal_t  signals[] = {
 	  "",
 	  ngx_signal_handler },
 
+	{ ngx_signal_value(NGX_RADIX_DIFF_SIGNAL),
+	  "SIG" ngx_value(NGX_RADIX_DIFF_SIGNAL),
+	  "radix_diff",
+	  ngx_signal_handler },
+
 	{ SIGALRM, "SIGALRM", "", ngx_signal_handler },
 
 	{ SIGINT, "SIGINT", "", ngx_signal_handler },
@@ -348,6 +353,10 @@ static void ngx_signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
 			ngx_change_binary = 1;
 			action = ", changing binary";
 			break;
+		case ngx_signal_value(NGX_RADIX_DIFF_SIGNAL):
+			ngx_radix_diff = 1;
+			action = ", applying radix diff";
+			break;
 		case SIGALRM:
 			ngx_sigalrm = 1;
 			break;
@@ -382,6 +391,7 @@ static void ngx_signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
 			break;
 		case ngx_signal_value(NGX_RECONFIGURE_SIGNAL):
 		case ngx_signal_value(NGX_CHANGEBIN_SIGNAL):
+		case ngx_signal_value(NGX_RADIX_DIFF_SIGNAL):
 		case SIGIO:
 			action = ", ignoring";
 			break;
@@ -14,6 +14,8 @@ static void ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n, ngx_int_
 static void ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn);
 static void ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch);
 static void ngx_signal_worker_processes(ngx_cycle_t *cycle, int signo);
+static void ngx_pass_radix_diff(ngx_cycle_t *cycle);
+static ngx_int_t ngx_apply_radix_diff(ngx_cycle_t *cycle);
 static ngx_uint_t ngx_reap_children(ngx_cycle_t *cycle);
 static void ngx_master_process_exit(ngx_cycle_t *cycle);
 static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data);
@@ -39,6 +41,7 @@ sig_atomic_t  ngx_debug_quit;
 ngx_uint_t    ngx_exiting;
 sig_atomic_t  ngx_reconfigure;
 sig_atomic_t  ngx_reopen;
+sig_atomic_t  ngx_radix_diff;
 
 sig_atomic_t  ngx_change_binary;
 ngx_pid_t     ngx_new_binary;
@@ -80,6 +83,7 @@ void ngx_master_process_cycle(ngx_cycle_t *cycle)
 	sigaddset(&set, ngx_signal_value(NGX_TERMINATE_SIGNAL));
 	sigaddset(&set, ngx_signal_value(NGX_SHUTDOWN_SIGNAL));
 	sigaddset(&set, ngx_signal_value(NGX_CHANGEBIN_SIGNAL));
+	sigaddset(&set, ngx_signal_value(NGX_RADIX_DIFF_SIGNAL));
 
 	if (sigprocmask(SIG_BLOCK, &set, NULL) == -1)
 	{
@@ -256,6 +260,603 @@ void ngx_master_process_cycle(ngx_cycle_t *cycle)
 			ngx_signal_worker_processes(cycle, ngx_signal_value(NGX_REOPEN_SIGNAL));
 		}
 
+		if (ngx_radix_diff)
+		{
+			ngx_radix_diff = 0;
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "applying radix diff");
+			ngx_pass_radix_diff(cycle);
+		}
+
+		if (ngx_change_binary)
+		{
+			ngx_change_binary = 0;
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "changing binary");
+			ngx_new_binary = ngx_exec_new_binary(cycle, ngx_argv);
+		}
+
+		if (ngx_noaccept)
+		{
+			ngx_noaccept = 0;
+			ngx_noaccepting = 1;
+			ngx_signal_worker_processes(cycle, ngx_signal_value(NGX_SHUTDOWN_SIGNAL));
+		}
+	}
+}
+
+
+void
+ngx_single_process_cycle(ngx_cycle_t *cycle)
+{
+	ngx_uint_t  i;
+
+	if (ngx_set_environment(cycle, NULL) == NULL) {
+		/* fatal */
+		exit(2);
+	}
+
+	for (i = 0; cycle->modules[i]; i++) {
+		if (cycle->modules[i]->init_process) {
+			if (cycle->modules[i]->init_process(cycle) == NGX_ERROR) {
+				/* fatal */
+				exit(2);
+			}
+		}
+	}
+
+	for ( ;; ) {
+		ngx_log_debug0(NGX_LOG_DEBUG_EVENT, cycle->log, 0, "worker cycle");
+
+		ngx_process_events_and_timers(cycle);
+
+		if (ngx_terminate || ngx_quit) {
+
+			for (i = 0; cycle->modules[i]; i++) {
+				if (cycle->modules[i]->exit_process) {
+					cycle->modules[i]->exit_process(cycle);
+				}
+			}
+
+			ngx_master_process_exit(cycle);
+		}
+
+		if (ngx_reconfigure) {
+			ngx_reconfigure = 0;
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "reconfiguring");
+
+			cycle = ngx_init_cycle(cycle);
+			if (cycle == NULL) {
+				cycle = (ngx_cycle_t *) ngx_cycle;
+				continue;
+			}
+
+			ngx_cycle = cycle;
+		}
+
+		if (ngx_reopen) {
+			ngx_reopen = 0;
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "reopening logs");
+			ngx_reopen_files(cycle, (ngx_uid_t) -1);
+		}
+
+		if (ngx_radix_diff)
+		{
+			ngx_radix_diff = 0;
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "applying radix diff");
+			ngx_pass_radix_diff(cycle);
+		}
+	}
+}
+
+
+static void ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n, ngx_int_t type)
+{
+	ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "start worker processes");
+
+	ngx_channel_t  ch;
+	ngx_memzero(&ch, sizeof(ngx_channel_t));
+	ch.command = NGX_CMD_OPEN_CHANNEL;
+
+	for (ngx_int_t i = 0; i < n; i++)
+	{
+		ngx_spawn_process(cycle, ngx_worker_process_cycle,
+						  (void *)(intptr_t)i, "worker process", type);
+
+		ch.pid = ngx_processes[ngx_process_slot].pid;
+		ch.slot = ngx_process_slot;
+		ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+		ngx_pass_open_channel(cycle, &ch);
+	}
+}
+
+
+static void
+ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
+{
+	ngx_uint_t       i, manager, loader;
+	ngx_path_t     **path;
+	ngx_channel_t    ch;
+
+	manager = 0;
+	loader = 0;
+
+	path = ngx_cycle->paths.elts;
+	for (i = 0; i < ngx_cycle->paths.nelts; i++) {
+
+		if (path[i]->manager) {
+			manager = 1;
+		}
+
+		if (path[i]->loader) {
+			loader = 1;
+		}
+	}
+
+	if (manager == 0) {
+		return;
+	}
+
+	ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
+					  &ngx_cache_manager_ctx, "cache manager process",
+					  respawn ? NGX_PROCESS_JUST_RESPAWN : NGX_PROCESS_RESPAWN);
+
+	ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+	ch.command = NGX_CMD_OPEN_CHANNEL;
+	ch.pid = ngx_processes[ngx_process_slot].pid;
+	ch.slot = ngx_process_slot;
+	ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+	ngx_pass_open_channel(cycle, &ch);
+
+	if (loader == 0) {
+		return;
+	}
+
+	ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
+					  &ngx_cache_loader_ctx, "cache loader process",
+					  respawn ? NGX_PROCESS_JUST_SPAWN : NGX_PROCESS_NORESPAWN);
+
+	ch.command = NGX_CMD_OPEN_CHANNEL;
+	ch.pid = ngx_processes[ngx_process_slot].pid;
+	ch.slot = ngx_process_slot;
+	ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+	ngx_pass_open_channel(cycle, &ch);
+}
+
+
+static void
+ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch)
+{
+	ngx_int_t  i;
+
+	for (i = 0; i < ngx_last_process; i++) {
+
+		if (i == ngx_process_slot
+			|| ngx_processes[i].pid == -1
+			|| ngx_processes[i].channel[0] == -1)
+		{
+			continue;
+		}
+
+		ngx_log_debug6(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+					  "pass channel s:%i pid:%P fd:%d to s:%i pid:%P fd:%d",
+					  ch->slot, ch->pid, ch->fd,
+					  i, ngx_processes[i].pid,
+					  ngx_processes[i].channel[0]);
+
+		/* TODO: NGX_AGAIN */
+
+		ngx_write_channel(ngx_processes[i].channel[0],
+						  ch, sizeof(ngx_channel_t), cycle->log);
+	}
+}
+
+
+static void ngx_signal_worker_processes(ngx_cycle_t *cycle, int signo)
+{
+	ngx_channel_t  ch;
+	ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+	switch (signo)
+	{
+	case ngx_signal_value(NGX_SHUTDOWN_SIGNAL):
+		ch.command = NGX_CMD_QUIT;
+		break;
+	case ngx_signal_value(NGX_TERMINATE_SIGNAL):
+		ch.command = NGX_CMD_TERMINATE;
+		break;
+	case ngx_signal_value(NGX_REOPEN_SIGNAL):
+		ch.command = NGX_CMD_REOPEN;
+		break;
+	default:
+		ch.command = 0;
+	}
+
+	ch.fd = -1;
+
+	for (ngx_int_t i = 0; i < ngx_last_process; i++)
+	{
+		ngx_log_debug7(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+					   "child: %i %P e:%d t:%d d:%d r:%d j:%d",
+					   i,
+					   ngx_processes[i].pid,
+					   ngx_processes[i].exiting,
+					   ngx_processes[i].exited,
+					   ngx_processes[i].detached,
+					   ngx_processes[i].respawn,
+					   ngx_processes[i].just_spawn);
+
+		if (ngx_processes[i].detached || ngx_processes[i].pid == -1)
+			continue;
+
+		if (ngx_processes[i].just_spawn)
+		{
+			ngx_processes[i].just_spawn = 0;
+			continue;
+		}
+
+		if (ngx_processes[i].exiting && signo == ngx_signal_value(NGX_SHUTDOWN_SIGNAL))
+			continue;
+
+		if (ch.command)
+		{
+			if (ngx_write_channel(ngx_processes[i].channel[0],
+								  &ch, sizeof(ngx_channel_t), cycle->log)
+				== NGX_OK)
+			{
+				if (signo != ngx_signal_value(NGX_REOPEN_SIGNAL))
+					ngx_processes[i].exiting = 1;
+
+				continue;
+			}
+		}
+
+		ngx_log_debug2(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+					   "kill (%P, %d)", ngx_processes[i].pid, signo);
+
+		if (kill(ngx_processes[i].pid, signo) == -1)
+		{
+			ngx_err_t err = ngx_errno;
+			ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+						  "kill(%P, %d) failed", ngx_processes[i].pid, signo);
+
+			if (err == NGX_ESRCH)
+			{
+				ngx_processes[i].exited = 1;
+				ngx_processes[i].exiting = 0;
+				ngx_reap = 1;
+			}
+
+			continue;
+		}
+
+		if (signo != ngx_signal_value(NGX_REOPEN_SIGNAL))
+			ngx_processes[i].exiting = 1;
+	}
+}
+
+/*
+ * The master applies the diff to its own trees first, so that respawned
+ * workers inherit the update, then tells workers to apply it too.  The
+ * channel does not carry the descriptor: ngx_read_channel() accepts one
+ * for NGX_CMD_OPEN_CHANNEL only, so workers open the file by its path,
+ * which must stay in place until they have read it.
+ */
+
+static void ngx_pass_radix_diff(ngx_cycle_t *cycle)
+{
+	if (ngx_apply_radix_diff(cycle) != NGX_OK || ngx_process == NGX_PROCESS_SINGLE)
+		return;
+
+	ngx_channel_t  ch;
+	ngx_memzero(&ch, sizeof(ngx_channel_t));
+	ch.command = NGX_CMD_RADIX_DIFF;
+	ch.fd = -1;
+
+	for (ngx_int_t i = 0; i < ngx_last_process; i++)
+	{
+		if (ngx_processes[i].detached
+			|| ngx_processes[i].exiting
+			|| ngx_processes[i].pid == -1
+			|| ngx_processes[i].channel[0] == -1)
+		{
+			continue;
+		}
+
+		ngx_write_channel(ngx_processes[i].channel[0],
+						  &ch, sizeof(ngx_channel_t), cycle->log);
+	}
+}
+
+/* the full name is built in a pool of its own, signals may come often */
+
+static ngx_int_t ngx_apply_radix_diff(ngx_cycle_t *cycle)
+{
+	ngx_pool_t *pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+	if (pool == NULL)
+		return NGX_ERROR;
+
+	ngx_int_t rc = NGX_ERROR;
+
+	ngx_str_t name = ngx_string(NGX_RADIX_DIFF_PATH);
+	if (ngx_get_full_name(pool, &cycle->prefix, &name) != NGX_OK)
+		goto done;
+
+	ngx_fd_t fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+					  ngx_open_file_n " \"%s\" failed", name.data);
+		goto done;
+	}
+
+	rc = ngx_radix32tree_apply_diff(cycle, fd);
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+					  ngx_close_file_n " \"%s\" failed", name.data);
+	}
+
+done:
+
+	ngx_destroy_pool(pool);
+	return rc;
+}
+
+static ngx_uint_t ngx_reap_children(ngx_cycle_t *cycle);
+static void ngx_master_process_exit(ngx_cycle_t *cycle);
+static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data);
+static void ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker);
+static void ngx_worker_process_exit(ngx_cycle_t *cycle);
+static void ngx_channel_handler(ngx_event_t *ev);
+static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
+static void ngx_cache_manager_process_handler(ngx_event_t *ev);
+static void ngx_cache_loader_process_handler(ngx_event_t *ev);
+
+
+ngx_uint_t    ngx_process;
+ngx_uint_t    ngx_worker;
+ngx_pid_t     ngx_pid;
+ngx_pid_t     ngx_parent;
+
+sig_atomic_t  ngx_reap;
+sig_atomic_t  ngx_sigio;
+sig_atomic_t  ngx_sigalrm;
+sig_atomic_t  ngx_terminate;
+sig_atomic_t  ngx_quit;
+sig_atomic_t  ngx_debug_quit;
+ngx_uint_t    ngx_exiting;
+sig_atomic_t  ngx_reconfigure;
+sig_atomic_t  ngx_reopen;
+sig_atomic_t  ngx_radix_diff;
+
+sig_atomic_t  ngx_change_binary;
+ngx_pid_t     ngx_new_binary;
+ngx_uint_t    ngx_inherited;
+ngx_uint_t    ngx_daemonized;
+
+sig_atomic_t  ngx_noaccept;
+ngx_uint_t    ngx_noaccepting;
+ngx_uint_t    ngx_restart;
+
+
+static u_char  master_process[] = "master process";
+
+
+static ngx_cache_manager_ctx_t  ngx_cache_manager_ctx = {
+	ngx_cache_manager_process_handler, "cache manager process", 0
+};
+
+static ngx_cache_manager_ctx_t  ngx_cache_loader_ctx = {
+	ngx_cache_loader_process_handler, "cache loader process", 60000
+};
+
+
+static ngx_cycle_t      ngx_exit_cycle;
+static ngx_log_t        ngx_exit_log;
+static ngx_open_file_t  ngx_exit_log_file;
+
+void ngx_master_process_cycle(ngx_cycle_t *cycle)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGALRM);
+	sigaddset(&set, SIGIO);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, ngx_signal_value(NGX_RECONFIGURE_SIGNAL));
+	sigaddset(&set, ngx_signal_value(NGX_REOPEN_SIGNAL));
+	sigaddset(&set, ngx_signal_value(NGX_NOACCEPT_SIGNAL));
+	sigaddset(&set, ngx_signal_value(NGX_TERMINATE_SIGNAL));
+	sigaddset(&set, ngx_signal_value(NGX_SHUTDOWN_SIGNAL));
+	sigaddset(&set, ngx_signal_value(NGX_CHANGEBIN_SIGNAL));
+	sigaddset(&set, ngx_signal_value(NGX_RADIX_DIFF_SIGNAL));
+
+	if (sigprocmask(SIG_BLOCK, &set, NULL) == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+					  "sigprocmask() failed");
+	}
+
+	sigemptyset(&set);
+
+	// set process description displayed in htop/top/ps command
+	size_t size = sizeof(master_process);
+	for (ngx_int_t i = 0; i < ngx_argc; i++)
+	{
+		size += ngx_strlen(ngx_argv[i]) + 1;
+	}
+
+	char* title = ngx_pnalloc(cycle->pool, size);
+	if (title == NULL)
+	{
+		/* fatal */
+		exit(2);
+	}
+
+	u_char* p = ngx_cpymem(title, master_process, sizeof(master_process) - 1);
+	for (ngx_int_t i = 0; i < ngx_argc; i++) {
+		*p++ = ' ';
+		p = ngx_cpystrn(p, (u_char *) ngx_argv[i], size);
+	}
+
+	ngx_setproctitle(title);
+
+	// start workers and cache-related processes
+	ngx_core_conf_t* ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+	ngx_start_worker_processes(cycle, ccf->worker_processes, NGX_PROCESS_RESPAWN);
+	ngx_start_cache_manager_processes(cycle, 0);
+
+	ngx_new_binary = 0;
+	ngx_msec_t delay = 0;
+	ngx_uint_t sigio = 0;
+	ngx_uint_t live = 1;
+
+	for ( ;; )
+	{
+		if (delay)
+		{
+			if (ngx_sigalrm)
+			{
+				sigio = 0;
+				delay *= 2;
+				ngx_sigalrm = 0;
+			}
+
+			ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+						   "termination cycle: %M", delay);
+
+			struct itimerval   itv;
+			itv.it_interval.tv_sec = 0;
+			itv.it_interval.tv_usec = 0;
+			itv.it_value.tv_sec = delay / 1000;
+			itv.it_value.tv_usec = (delay % 1000 ) * 1000;
+			if (setitimer(ITIMER_REAL, &itv, NULL) == -1)
+			{
+				ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+							  "setitimer() failed");
+			}
+		}
+
+		ngx_log_debug0(NGX_LOG_DEBUG_EVENT, cycle->log, 0, "sigsuspend");
+
+		sigsuspend(&set);
+
+		ngx_time_update();
+
+		ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0, "wake up, sigio %i", sigio);
+
+		if (ngx_reap)
+		{
+			ngx_reap = 0;
+			ngx_log_debug0(NGX_LOG_DEBUG_EVENT, cycle->log, 0, "reap children");
+
+			live = ngx_reap_children(cycle);
+		}
+
+		if (!live && (ngx_terminate || ngx_quit))
+			ngx_master_process_exit(cycle);
+
+		if (ngx_terminate)
+		{
+			if (delay == 0)
+				delay = 50;
+
+			if (sigio)
+			{
+				sigio--;
+				continue;
+			}
+
+			sigio = ccf->worker_processes + 2 /* cache processes */;
+
+			if (delay > 1000)
+				ngx_signal_worker_processes(cycle, SIGKILL);
+			else
+				ngx_signal_worker_processes(cycle, ngx_signal_value(NGX_TERMINATE_SIGNAL));
+
+			continue;
+		}
+
+		if (ngx_quit)
+		{
+			ngx_signal_worker_processes(cycle, ngx_signal_value(NGX_SHUTDOWN_SIGNAL));
+
+			ngx_listening_t* ls = cycle->listening.elts;
+			for (ngx_uint_t n = 0; n < cycle->listening.nelts; n++)
+			{
+				if (ngx_close_socket(ls[n].fd) == -1)
+				{
+					ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+								  ngx_close_socket_n " %V failed",
+								  &ls[n].addr_text);
+				}
+			}
+			cycle->listening.nelts = 0;
+
+			continue;
+		}
+
+		if (ngx_reconfigure)
+		{
+			ngx_reconfigure = 0;
+
+			if (ngx_new_binary)
+			{
+				ngx_start_worker_processes(cycle, ccf->worker_processes, NGX_PROCESS_RESPAWN);
+				ngx_start_cache_manager_processes(cycle, 0);
+				ngx_noaccepting = 0;
+
+				continue;
+			}
+
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "reconfiguring");
+
+			cycle = ngx_init_cycle(cycle);
+			if (cycle == NULL)
+			{
+				cycle = (ngx_cycle_t *)ngx_cycle;
+				continue;
+			}
+
+			ngx_cycle = cycle;
+			ccf = (ngx_core_conf_t*)ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+			ngx_start_worker_processes(cycle, ccf->worker_processes, NGX_PROCESS_JUST_RESPAWN);
+			ngx_start_cache_manager_processes(cycle, 1);
+
+			/* allow new processes to start */
+			ngx_msleep(100);
+
+			live = 1;
+			ngx_signal_worker_processes(cycle, ngx_signal_value(NGX_SHUTDOWN_SIGNAL));
+		}
+
+		if (ngx_restart)
+		{
+			ngx_restart = 0;
+			ngx_start_worker_processes(cycle, ccf->worker_processes, dd);
+			ngx_start_cache_manager_processes(cycle, 0);
+			live = 1;
+		}
+
+		if (ngx_reopen)
+		{
+			ngx_reopen = 0;
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "reopening logs");
+			ngx_reopen_files(cycle, ccf->user);
+			ngx_signal_worker_processes(cycle, ngx_signal_value(NGX_REOPEN_SIGNAL));
+		}
+
+		if (ngx_radix_diff)
+		{
+			ngx_radix_diff = 0;
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "applying radix diff");
+			ngx_pass_radix_diff(cycle);
+		}
+
 		if (ngx_change_binary)
 		{
 			ngx_change_binary = 0;
@@ -326,6 +927,13 @@ ngx_single_process_cycle(ngx_cycle_t *cycle)
 			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "reopening logs");
 			ngx_reopen_files(cycle, (ngx_uid_t) -1);
 		}
+
+		if (ngx_radix_diff)
+		{
+			ngx_radix_diff = 0;
+			ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "applying radix diff");
+			ngx_pass_radix_diff(cycle);
+		}
 	}
 }
 
@@ -519,6 +1127,56 @@ static void ngx_signal_worker_processes(ngx_cycle_t *cycle, int signo)
 	}
 }
 
+/*
+ * The master applies the diff to its own trees first, so that respawned
+ * workers inherit the update, then passes the open diff file to workers.
+ */
+
+static void ngx_pass_radix_diff(ngx_cycle_t *cycle)
+{
+	ngx_str_t name = ngx_string(NGX_RADIX_DIFF_PATH);
+	if (ngx_get_full_name(cycle->pool, &cycle->prefix, &name) != NGX_OK)
+		return;
+
+	ngx_fd_t fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+					  ngx_open_file_n " \"%s\" failed", name.data);
+		return;
+	}
+
+	if (ngx_radix32tree_apply_diff(cycle, fd) != NGX_OK || ngx_process == NGX_PROCESS_SINGLE)
+		goto done;
+
+	ngx_channel_t  ch;
+	ngx_memzero(&ch, sizeof(ngx_channel_t));
+	ch.command = NGX_CMD_RADIX_DIFF;
+	ch.fd = fd;
+
+	for (ngx_int_t i = 0; i < ngx_last_process; i++)
+	{
+		if (ngx_processes[i].detached
+			|| ngx_processes[i].exiting
+			|| ngx_processes[i].pid == -1
+			|| ngx_processes[i].channel[0] == -1)
+		{
+			continue;
+		}
+
+		ngx_write_channel(ngx_processes[i].channel[0],
+						  &ch, sizeof(ngx_channel_t), cycle->log);
+	}
+
+done:
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+					  ngx_close_file_n " \"%s\" failed", name.data);
+	}
+}
+
 static ngx_uint_t ngx_reap_children(ngx_cycle_t *cycle)
 {
 	ngx_core_conf_t  *ccf;
@@ -886,6 +1544,10 @@ static void ngx_worker_process_exit(ngx_cycle_t *cycle)
 		}
 	}
 
+#if (NGX_HAVE_TIMERFD)
+	ngx_event_timerfd_done();
+#endif
+
 	if (ngx_exiting) {
 		ngx_connection_t* c = cycle->connections;
 		for (i = 0; i < cycle->connection_n; i++) {
@@ -994,6 +1656,10 @@ ngx_channel_handler(ngx_event_t *ev)
 			ngx_reopen = 1;
 			break;
 
+		case NGX_CMD_RADIX_DIFF:
+			(void) ngx_apply_radix_diff((ngx_cycle_t *) ngx_cycle);
+			break;
+
 		case NGX_CMD_OPEN_CHANNEL:
 
 			ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
@@ -18,6 +18,10 @@
 #define NGX_CMD_QUIT           3
 #define NGX_CMD_TERMINATE      4
 #define NGX_CMD_REOPEN         5
+#define NGX_CMD_RADIX_DIFF     6
+
+/* asks the master process to apply NGX_RADIX_DIFF_PATH to live radix trees */
+#define NGX_RADIX_DIFF_SIGNAL  URG
 
 
 #define NGX_PROCESS_SINGLE     0
@@ -55,6 +59,7 @@ extern sig_atomic_t    ngx_terminate;
 extern sig_atomic_t    ngx_noaccept;
 extern sig_atomic_t    ngx_reconfigure;
 extern sig_atomic_t    ngx_reopen;
+extern sig_atomic_t    ngx_radix_diff;
 extern sig_atomic_t    ngx_change_binary;
 
 
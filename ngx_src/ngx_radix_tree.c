@@ -9,7 +9,32 @@
 #include <ngx_core.h>
 
 
+#if (__GNUC__)
+#define ngx_radix_prefetch(p)  __builtin_prefetch(p)
+#else
+#define ngx_radix_prefetch(p)
+#endif
+
+
+typedef struct {
+    ngx_radix_tree_t  *tree;
+    uint32_t           key;
+    uint32_t           mask;
+    uintptr_t          value;
+    ngx_uint_t         add;
+} ngx_radix32_diff_t;
+
+
 static ngx_radix_node_t *ngx_radix_alloc(ngx_radix_tree_t *tree);
+static void ngx_radix_tree_count(ngx_radix_node_t *node, ngx_radix_tree_stat_t *stat, ngx_uint_t depth);
+static ngx_radix_node_t *ngx_radix_tree_copy(ngx_radix_node_t *node, ngx_radix_node_t *parent, ngx_radix_node_t **next);
+static ngx_int_t ngx_radix32tree_replace(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask, uintptr_t value);
+static ngx_uint_t ngx_radix32tree_missing(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask);
+static ngx_int_t ngx_radix_tree_reserve(ngx_radix_tree_t *tree, ngx_uint_t n);
+static ngx_int_t ngx_radix32_diff_parse(ngx_cycle_t *cycle, u_char *p, u_char *last, ngx_array_t *diff);
+static void ngx_radix32_stride_count(ngx_radix_node_t *node, ngx_uint_t depth, ngx_uint_t *ntables, ngx_uint_t *nvalues);
+static void ngx_radix32_stride_compile(ngx_radix_tree_t *tree, ngx_radix32_stride_t *st);
+static void ngx_radix32_stride_fill(ngx_radix32_stride_t *st, uint32_t *table, ngx_uint_t stride, ngx_radix_node_t *node, ngx_uint_t bits, uint32_t path, uint32_t value);
 
 
 ngx_radix_tree_t* ngx_radix_tree_create(ngx_pool_t *pool, ngx_int_t preallocate)
@@ -20,8 +45,11 @@ ngx_radix_tree_t* ngx_radix_tree_create(ngx_pool_t *pool, ngx_int_t preallocate)
 
     tree->pool = pool;
     tree->free_list = NULL;
+    tree->pages = NULL;
     tree->start = NULL;
     tree->size = 0;
+    tree->block = NULL;
+    tree->compacted = 0;
 
     tree->root = ngx_radix_alloc(tree);
     if (tree->root == NULL)
@@ -216,6 +244,994 @@ uintptr_t ngx_radix32tree_find(ngx_radix_tree_t *tree, uint32_t key)
     return value;
 }
 
+/*
+ * The targets are kept in the cycle, so they go away with the pool of
+ * the configuration the trees belong to, and a new cycle starts with none.
+ */
+
+ngx_int_t ngx_radix32tree_diff_target(ngx_cycle_t *cycle, ngx_str_t *name, ngx_radix_tree_t *tree)
+{
+    if (cycle->radix_diff_targets == NULL)
+	{
+        cycle->radix_diff_targets = ngx_array_create(cycle->pool, 4, sizeof(ngx_radix_diff_target_t));
+        if (cycle->radix_diff_targets == NULL)
+            return NGX_ERROR;
+    }
+
+    ngx_radix_diff_target_t* t = ngx_array_push(cycle->radix_diff_targets);
+    if (t == NULL)
+        return NGX_ERROR;
+
+    t->name = *name;
+    t->tree = tree;
+    return NGX_OK;
+}
+
+/*
+ * The whole diff is parsed, and the nodes its additions may need are
+ * reserved, before any change is made: a broken file or a failed
+ * allocation leaves the trees as they were, and the changes themselves
+ * cannot fail.
+ */
+
+ngx_int_t ngx_radix32tree_apply_diff(ngx_cycle_t *cycle, ngx_fd_t fd)
+{
+    if (cycle->radix_diff_targets == NULL || cycle->radix_diff_targets->nelts == 0)
+	{
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "radix diff ignored: no trees to update");
+        return NGX_DECLINED;
+    }
+
+    ngx_file_info_t fi;
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+	{
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_fd_info_n " radix diff failed");
+        return NGX_ERROR;
+    }
+
+    size_t size = (size_t) ngx_file_size(&fi);
+
+    ngx_pool_t* pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+    if (pool == NULL)
+        return NGX_ERROR;
+
+    ngx_int_t rc = NGX_ERROR;
+    ngx_array_t diff;
+
+    u_char* buf = ngx_pnalloc(pool, size + 1);
+    if (buf == NULL
+        || ngx_array_init(&diff, pool, 64, sizeof(ngx_radix32_diff_t)) != NGX_OK)
+	{
+        goto done;
+    }
+
+    for (size_t n = 0; n < size; )
+	{
+        ssize_t k = pread(fd, buf + n, size - n, (off_t) n);
+        if (k <= 0)
+		{
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "pread() radix diff failed");
+            goto done;
+        }
+
+        n += k;
+    }
+
+    if (ngx_radix32_diff_parse(cycle, buf, buf + size, &diff) != NGX_OK)
+        goto done;
+
+    ngx_radix32_diff_t* d = diff.elts;
+    ngx_radix_diff_target_t* t = cycle->radix_diff_targets->elts;
+
+    for (ngx_uint_t j = 0; j < cycle->radix_diff_targets->nelts; j++)
+	{
+        /* an upper bound: additions sharing new nodes count them twice */
+
+        ngx_uint_t missing = 0;
+        for (ngx_uint_t i = 0; i < diff.nelts; i++)
+		{
+            if (d[i].add && d[i].tree == t[j].tree)
+                missing += ngx_radix32tree_missing(d[i].tree, d[i].key, d[i].mask);
+        }
+
+        if (ngx_radix_tree_reserve(t[j].tree, missing) != NGX_OK)
+		{
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                          "radix diff: node allocation failed, nothing applied");
+            goto done;
+        }
+    }
+
+    for (ngx_uint_t i = 0; i < diff.nelts; i++)
+	{
+        if (d[i].add)
+		{
+            /* the prefix is there already, its value is replaced in place */
+            if (ngx_radix32tree_insert(d[i].tree, d[i].key, d[i].mask, d[i].value) == NGX_BUSY)
+                (void) ngx_radix32tree_replace(d[i].tree, d[i].key, d[i].mask, d[i].value);
+        }
+		else if (ngx_radix32tree_delete(d[i].tree, d[i].key, d[i].mask) != NGX_OK)
+		{
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "radix diff: no prefix to delete, skipped");
+        }
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                  "radix diff: %ui changes applied", diff.nelts);
+
+    rc = NGX_OK;
+
+done:
+
+    ngx_destroy_pool(pool);
+    return rc;
+}
+
+/*
+ * Unlike a delete and an insert, an in-place store never lets a lookup
+ * see the value of the parent prefix, nor frees and reallocates nodes.
+ */
+
+static ngx_int_t ngx_radix32tree_replace(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask, uintptr_t value)
+{
+    uint32_t bit = 0x80000000;
+    ngx_radix_node_t* node = tree->root;
+
+    while (node && (bit & mask))
+	{
+        node = (key & bit) ? node->right : node->left;
+        bit >>= 1;
+    }
+
+    if (node == NULL || node->value == NGX_RADIX_NO_VALUE)
+        return NGX_DECLINED;
+
+    node->value = value;
+    return NGX_OK;
+}
+
+/* the number of nodes an insert of the prefix would allocate */
+
+static ngx_uint_t ngx_radix32tree_missing(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask)
+{
+    uint32_t bit = 0x80000000;
+    ngx_radix_node_t* node = tree->root;
+
+    while (bit & mask)
+	{
+        node = (key & bit) ? node->right : node->left;
+        if (node == NULL)
+            break;
+
+        bit >>= 1;
+    }
+
+    ngx_uint_t n = 0;
+    for ( /* void */ ; bit & mask; bit >>= 1)
+        n++;
+
+    return n;
+}
+
+/*
+ * Tops up the free list to n nodes, which ngx_radix_alloc() hands out
+ * first.  The free list is set aside meanwhile, so that the allocations
+ * come from the pages.
+ */
+
+static ngx_int_t ngx_radix_tree_reserve(ngx_radix_tree_t *tree, ngx_uint_t n)
+{
+    ngx_radix_node_t* free = tree->free_list;
+
+    for (ngx_radix_node_t* node = free; node && n; node = node->right)
+        n--;
+
+    tree->free_list = NULL;
+
+    while (n--)
+	{
+        ngx_radix_node_t* node = ngx_radix_alloc(tree);
+        if (node == NULL)
+		{
+            tree->free_list = free;
+            return NGX_ERROR;
+        }
+
+        node->right = free;
+        free = node;
+    }
+
+    tree->free_list = free;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_radix32_diff_parse(ngx_cycle_t *cycle, u_char *p, u_char *last, ngx_array_t *diff)
+{
+    ngx_str_t word[4];
+    ngx_uint_t line = 1;
+
+    while (p < last)
+	{
+        /* split a statement ended by ";" into words */
+
+        ngx_uint_t n = 0;
+        for ( ;; )
+		{
+            while (p < last && (*p == ' ' || *p == '\t' || *p == CR || *p == LF))
+			{
+                if (*p++ == LF)
+                    line++;
+            }
+
+            if (p == last || *p == ';')
+                break;
+
+            if (n == 4)
+                goto invalid;
+
+            word[n].data = p;
+            while (p < last && *p != ' ' && *p != '\t' && *p != CR && *p != LF && *p != ';')
+                p++;
+
+            word[n].len = p - word[n].data;
+            n++;
+        }
+
+        if (p == last)
+		{
+            if (n == 0)
+                break;
+
+            goto invalid;
+        }
+
+        p++;
+
+        if (n == 0)
+            continue;
+
+        ngx_radix32_diff_t* d = ngx_array_push(diff);
+        if (d == NULL)
+            return NGX_ERROR;
+
+        if (n == 4 && word[0].len == 3 && ngx_strncmp(word[0].data, "add", 3) == 0)
+		{
+            ngx_int_t value = ngx_atoi(word[3].data, word[3].len);
+            if (value == NGX_ERROR)
+                goto invalid;
+
+            d->add = 1;
+            d->value = (uintptr_t) value;
+        }
+		else if (n == 3 && word[0].len == 6 && ngx_strncmp(word[0].data, "delete", 6) == 0)
+		{
+            d->add = 0;
+            d->value = NGX_RADIX_NO_VALUE;
+        }
+		else
+		{
+            goto invalid;
+        }
+
+        d->tree = NULL;
+
+        ngx_radix_diff_target_t* t = cycle->radix_diff_targets->elts;
+        for (ngx_uint_t i = 0; i < cycle->radix_diff_targets->nelts; i++)
+		{
+            if (t[i].name.len == word[1].len
+                && ngx_strncmp(t[i].name.data, word[1].data, word[1].len) == 0)
+			{
+                d->tree = t[i].tree;
+                break;
+            }
+        }
+
+        if (d->tree == NULL)
+		{
+            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                          "radix diff: unknown tree \"%V\" in line %ui",
+                          &word[1], line);
+            return NGX_ERROR;
+        }
+
+        ngx_cidr_t cidr;
+        ngx_int_t rc = ngx_ptocidr(&word[2], &cidr);
+
+        /* NGX_DONE means the address had bits set beyond the mask */
+        if (rc == NGX_ERROR || cidr.family != AF_INET)
+            goto invalid;
+
+        d->key = ntohl(cidr.u.in.addr);
+        d->mask = ntohl(cidr.u.in.mask);
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                  "radix diff: invalid statement in line %ui", line);
+    return NGX_ERROR;
+}
+
+/*
+ * Up to NGX_RADIX_BATCH lookups advance together one level per round:
+ * the next node of every key is prefetched before any of them is read,
+ * so the cache misses of the lookups overlap instead of being serialized.
+ * All keys are at the same depth in a round, hence they share the bit.
+ */
+
+void ngx_radix32tree_find_batch(ngx_radix_tree_t *tree, uint32_t *keys, ngx_uint_t n, uintptr_t *values)
+{
+    ngx_radix_node_t* node[NGX_RADIX_BATCH];
+
+    for (ngx_uint_t i = 0; i < n; i += NGX_RADIX_BATCH)
+	{
+        ngx_uint_t m = ngx_min(n - i, NGX_RADIX_BATCH);
+
+        for (ngx_uint_t j = 0; j < m; j++)
+		{
+            node[j] = tree->root;
+            values[i + j] = NGX_RADIX_NO_VALUE;
+        }
+
+        uint32_t bit = 0x80000000;
+        ngx_uint_t active = m;
+
+        while (active)
+		{
+            active = 0;
+
+            for (ngx_uint_t j = 0; j < m; j++)
+			{
+                if (node[j] == NULL)
+                    continue;
+
+                if (node[j]->value != NGX_RADIX_NO_VALUE)
+                    values[i + j] = node[j]->value;
+
+                if (keys[i + j] & bit)
+                    node[j] = node[j]->right;
+				else
+                    node[j] = node[j]->left;
+
+                if (node[j])
+				{
+                    ngx_radix_prefetch(node[j]);
+                    active++;
+                }
+            }
+
+            bit >>= 1;
+        }
+    }
+}
+
+ngx_radix32_stride_t* ngx_radix32_stride_build(ngx_radix_tree_t *tree, ngx_pool_t *pool)
+{
+    ngx_radix32_stride_t* st = ngx_palloc(pool, sizeof(ngx_radix32_stride_t));
+    if (st == NULL)
+        return NULL;
+
+    /* the value index 0 stands for no match */
+    ngx_uint_t ntables = 0;
+    ngx_uint_t nvalues = 1;
+    ngx_radix32_stride_count(tree->root, 0, &ntables, &nvalues);
+
+    size_t size = ngx_radix32_stride_tables_size(ntables);
+
+    /* tables and values are kept in one block, the tables size is a multiple of 8 */
+    u_char* p = ngx_pmemalign(pool, size + nvalues * sizeof(uintptr_t), ngx_pagesize);
+    if (p == NULL)
+        return NULL;
+
+    st->tables = (uint32_t *) p;
+    st->values = (uintptr_t *) (p + size);
+
+    ngx_radix32_stride_compile(tree, st);
+
+    return st;
+}
+
+/*
+ * The stride trie variant resolves a level for the whole batch at a time:
+ * all entries of a level are prefetched first, then read.
+ */
+
+void ngx_radix32_stride_find_batch(ngx_radix32_stride_t *st, uint32_t *keys, ngx_uint_t n, uintptr_t *values)
+{
+    uint32_t* level = st->tables + (1 << NGX_RADIX32_STRIDE_L1);
+    uint32_t* entry[NGX_RADIX_BATCH];
+    uint32_t e[NGX_RADIX_BATCH];
+
+    for (ngx_uint_t i = 0; i < n; i += NGX_RADIX_BATCH)
+	{
+        ngx_uint_t m = ngx_min(n - i, NGX_RADIX_BATCH);
+
+        for (ngx_uint_t j = 0; j < m; j++)
+		{
+            entry[j] = &st->tables[keys[i + j] >> 16];
+            ngx_radix_prefetch(entry[j]);
+        }
+
+        /* three table levels, the level 3 entries hold values only */
+
+        for (ngx_uint_t r = 0; r < 3; r++)
+		{
+            ngx_uint_t more = 0;
+
+            for (ngx_uint_t j = 0; j < m; j++)
+			{
+                e[j] = *entry[j];
+
+                if (r < 2 && (e[j] & NGX_RADIX32_STRIDE_CHILD))
+				{
+                    entry[j] = &level[((e[j] & ~NGX_RADIX32_STRIDE_CHILD) << 8)
+                                      + ((keys[i + j] >> (8 - 8 * r)) & 0xff)];
+                    ngx_radix_prefetch(entry[j]);
+                    more = 1;
+                }
+				else
+				{
+                    ngx_radix_prefetch(&st->values[e[j]]);
+                }
+            }
+
+            if (!more)
+                break;
+        }
+
+        for (ngx_uint_t j = 0; j < m; j++)
+		{
+            values[i + j] = st->values[e[j]];
+        }
+    }
+}
+
+/*
+ * Fill the tables and values the stride trie points to, they must have
+ * room for the number of tables and values the tree needs.
+ */
+
+static void ngx_radix32_stride_compile(ngx_radix_tree_t *tree, ngx_radix32_stride_t *st)
+{
+    st->ntables = 0;
+    st->nvalues = 1;
+    st->values[0] = NGX_RADIX_NO_VALUE;
+
+    ngx_radix_node_t* root = tree->root;
+    uint32_t value = 0;
+
+    if (root->value != NGX_RADIX_NO_VALUE)
+	{
+        st->values[st->nvalues] = root->value;
+        value = st->nvalues++;
+    }
+
+    ngx_radix32_stride_fill(st, st->tables, NGX_RADIX32_STRIDE_L1, root->left, 1, 0, value);
+    ngx_radix32_stride_fill(st, st->tables, NGX_RADIX32_STRIDE_L1, root->right, 1, 1, value);
+}
+
+/*
+ * The shared table keeps two snapshot slots one after another in a region
+ * mapped before workers are forked, e.g. a shared memory zone.  A snapshot
+ * is a header followed by the stride tables and values, the tables refer
+ * to each other by index, so the snapshot means the same in every process.
+ * The values themselves must be meaningful in every process too.
+ */
+
+#define ngx_radix32_shared_slot(sh, n)                                         \
+    ((ngx_radix32_snapshot_t *) ((u_char *) ((sh) + 1) + (n) * (sh)->slot_size))
+
+static ngx_inline size_t ngx_radix32_snapshot_size(ngx_uint_t ntables, ngx_uint_t nvalues)
+{
+    return sizeof(ngx_radix32_snapshot_t) + ngx_radix32_stride_tables_size(ntables)
+           + nvalues * sizeof(uintptr_t);
+}
+
+static ngx_inline void ngx_radix32_snapshot_view(ngx_radix32_snapshot_t *snap, ngx_uint_t ntables, ngx_radix32_stride_t *st)
+{
+    st->tables = (uint32_t *) (snap + 1);
+    st->values = (uintptr_t *) ((u_char *) st->tables + ngx_radix32_stride_tables_size(ntables));
+}
+
+ngx_radix32_shared_t* ngx_radix32_shared_init(u_char *addr, size_t size, ngx_shmtx_t *mutex)
+{
+    ngx_radix32_shared_t* sh = (ngx_radix32_shared_t *) addr;
+
+    if (size < sizeof(ngx_radix32_shared_t))
+        return NULL;
+
+    sh->mutex = mutex;
+
+    /* slots are rounded down to keep the values of the second one aligned */
+    sh->slot_size = ((size - sizeof(ngx_radix32_shared_t)) / 2) & ~(sizeof(uintptr_t) - 1);
+
+    if (sh->slot_size < ngx_radix32_snapshot_size(0, 1))
+        return NULL;
+
+    /* start with an empty table in the slot 0 */
+
+    ngx_radix32_snapshot_t* snap = ngx_radix32_shared_slot(sh, 0);
+    snap->seq = 0;
+    snap->ntables = 0;
+    snap->nvalues = 1;
+
+    ngx_radix32_stride_t st;
+    ngx_radix32_snapshot_view(snap, 0, &st);
+    ngx_memzero(st.tables, ngx_radix32_stride_tables_size(0));
+    st.values[0] = NGX_RADIX_NO_VALUE;
+
+    ngx_radix32_shared_slot(sh, 1)->seq = 0;
+    sh->active = 0;
+
+    return sh;
+}
+
+/*
+ * Compile the tree into the inactive slot and make it active.  Publishers
+ * are serialized by the table mutex, which is held over the compilation:
+ * when it is the slab mutex of the zone, ngx_unlock_mutexes() releases it
+ * if a publisher dies in the middle.  A reader still looking up in the
+ * slot being rewritten notices the odd sequence and restarts from the
+ * newly active slot.
+ */
+
+ngx_int_t ngx_radix32_shared_publish(ngx_radix32_shared_t *sh, ngx_radix_tree_t *tree)
+{
+    ngx_uint_t ntables = 0;
+    ngx_uint_t nvalues = 1;
+    ngx_radix32_stride_count(tree->root, 0, &ntables, &nvalues);
+
+    if (ngx_radix32_snapshot_size(ntables, nvalues) > sh->slot_size)
+        return NGX_DECLINED;
+
+    ngx_shmtx_lock(sh->mutex);
+
+    ngx_uint_t next = !sh->active;
+    ngx_radix32_snapshot_t* snap = ngx_radix32_shared_slot(sh, next);
+
+    /*
+     * an odd sequence here was left by a publisher which died in the middle,
+     * counting on from it would mark the rewrite done and leave the slot odd
+     * once it is active, so readers would spin on it forever
+     */
+
+    if (snap->seq & 1)
+        snap->seq++;
+
+    snap->seq++;
+    ngx_memory_barrier();
+
+    ngx_radix32_stride_t st;
+    ngx_radix32_snapshot_view(snap, ntables, &st);
+    ngx_radix32_stride_compile(tree, &st);
+
+    snap->ntables = ntables;
+    snap->nvalues = nvalues;
+
+    ngx_memory_barrier();
+    snap->seq++;
+
+    ngx_memory_barrier();
+    sh->active = next;
+
+    ngx_shmtx_unlock(sh->mutex);
+
+    return NGX_OK;
+}
+
+/*
+ * A lookup made while its slot is being rewritten may read torn entries,
+ * so every index is checked against the slot bounds before it is used,
+ * and the result is discarded if the slot sequence has moved.  Publishers
+ * only rewrite the inactive slot, so a reader which sees an odd sequence
+ * took a stale active index and finds the other slot on the next try;
+ * a dead publisher leaves only the inactive slot odd, and the next
+ * publish repairs it.  The spin is therefore bounded even then.
+ */
+
+uintptr_t ngx_radix32_shared_find(ngx_radix32_shared_t *sh, uint32_t key)
+{
+    ngx_uint_t max_tables = sh->slot_size >> (NGX_RADIX32_STRIDE_LN + 2);
+    ngx_uint_t max_values = sh->slot_size / sizeof(uintptr_t);
+
+    for ( ;; )
+	{
+        ngx_radix32_snapshot_t* snap = ngx_radix32_shared_slot(sh, sh->active);
+
+        ngx_atomic_uint_t seq = snap->seq;
+        if (seq & 1)
+		{
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        ngx_uint_t ntables = snap->ntables;
+        ngx_uint_t nvalues = snap->nvalues;
+        uintptr_t value = NGX_RADIX_NO_VALUE;
+        ngx_uint_t torn = 1;
+
+        if (ntables <= max_tables && nvalues <= max_values
+            && ngx_radix32_snapshot_size(ntables, nvalues) <= sh->slot_size)
+		{
+            ngx_radix32_stride_t st;
+            ngx_radix32_snapshot_view(snap, ntables, &st);
+
+            uint32_t* level = st.tables + (1 << NGX_RADIX32_STRIDE_L1);
+            uint32_t e = st.tables[key >> 16];
+
+            /* a child reference left unresolved is never a valid value index */
+
+            if (e & NGX_RADIX32_STRIDE_CHILD)
+			{
+                uint32_t n = e & ~NGX_RADIX32_STRIDE_CHILD;
+                if (n < ntables)
+                    e = level[(n << 8) + ((key >> 8) & 0xff)];
+
+                if (n < ntables && (e & NGX_RADIX32_STRIDE_CHILD))
+				{
+                    n = e & ~NGX_RADIX32_STRIDE_CHILD;
+                    if (n < ntables)
+                        e = level[(n << 8) + (key & 0xff)];
+                }
+            }
+
+            if (e < nvalues)
+			{
+                value = st.values[e];
+                torn = 0;
+            }
+        }
+
+        ngx_memory_barrier();
+
+        if (snap->seq == seq && !torn)
+            return value;
+    }
+}
+
+static void ngx_radix32_stride_count(ngx_radix_node_t *node, ngx_uint_t depth, ngx_uint_t *ntables, ngx_uint_t *nvalues)
+{
+    if (node == NULL)
+        return;
+
+    if (node->value != NGX_RADIX_NO_VALUE)
+        (*nvalues)++;
+
+    /* a node on a stride boundary with a subtree needs a deeper table */
+    if ((depth == NGX_RADIX32_STRIDE_L1 || depth == NGX_RADIX32_STRIDE_L1 + NGX_RADIX32_STRIDE_LN)
+        && (node->left || node->right))
+	{
+        (*ntables)++;
+    }
+
+    ngx_radix32_stride_count(node->left, depth + 1, ntables, nvalues);
+    ngx_radix32_stride_count(node->right, depth + 1, ntables, nvalues);
+}
+
+/*
+ * Fill the entries of a table covered by the node, which sits at the
+ * given number of bits below the table root.  The value is the index of
+ * the longest prefix matched above the node.
+ */
+
+static void ngx_radix32_stride_fill(ngx_radix32_stride_t *st, uint32_t *table, ngx_uint_t stride, ngx_radix_node_t *node, ngx_uint_t bits, uint32_t path, uint32_t value)
+{
+    if (node == NULL)
+	{
+        /* a missing subtree expands the inherited prefix */
+        ngx_uint_t n = (ngx_uint_t) 1 << (stride - bits);
+        uint32_t* e = table + (path << (stride - bits));
+        while (n--)
+            *e++ = value;
+
+        return;
+    }
+
+    if (node->value != NGX_RADIX_NO_VALUE)
+	{
+        st->values[st->nvalues] = node->value;
+        value = st->nvalues++;
+    }
+
+    if (bits < stride)
+	{
+        ngx_radix32_stride_fill(st, table, stride, node->left, bits + 1, path << 1, value);
+        ngx_radix32_stride_fill(st, table, stride, node->right, bits + 1, (path << 1) | 1, value);
+        return;
+    }
+
+    if (node->left == NULL && node->right == NULL)
+	{
+        table[path] = value;
+        return;
+    }
+
+    uint32_t n = st->ntables++;
+    uint32_t* next = st->tables + (1 << NGX_RADIX32_STRIDE_L1) + (n << NGX_RADIX32_STRIDE_LN);
+    table[path] = n | NGX_RADIX32_STRIDE_CHILD;
+
+    ngx_radix32_stride_fill(st, next, NGX_RADIX32_STRIDE_LN, node->left, 1, 0, value);
+    ngx_radix32_stride_fill(st, next, NGX_RADIX32_STRIDE_LN, node->right, 1, 1, value);
+}
+
+#if (NGX_HAVE_INET6)
+
+/*
+ * The 128-bit variants share the node allocator with the 32-bit ones,
+ * the key is walked a byte at a time, most significant bit first.
+ */
+
+ngx_int_t ngx_radix128tree_insert(ngx_radix_tree_t *tree, u_char *key, u_char *mask, uintptr_t value)
+{
+	ngx_uint_t i = 0;
+	u_char bit = 0x80;
+	ngx_radix_node_t* node = tree->root;
+	ngx_radix_node_t* next = tree->root;
+    while (bit & mask[i])
+	{
+        if (key[i] & bit)
+            next = node->right;
+		else
+            next = node->left;
+
+        if (next == NULL)
+            break;
+
+        bit >>= 1;
+        node = next;
+
+        if (bit == 0)
+		{
+            if (++i == 16)
+                break;
+
+            bit = 0x80;
+        }
+    }
+
+    if (next)
+	{
+        if (node->value != NGX_RADIX_NO_VALUE)
+            return NGX_BUSY;
+
+        node->value = value;
+        return NGX_OK;
+    }
+
+    while (bit & mask[i])
+	{
+        next = ngx_radix_alloc(tree);
+        if (next == NULL)
+            return NGX_ERROR;
+
+        next->right = NULL;
+        next->left = NULL;
+        next->parent = node;
+        next->value = NGX_RADIX_NO_VALUE;
+
+        if (key[i] & bit)
+            node->right = next;
+		else
+            node->left = next;
+
+        bit >>= 1;
+        node = next;
+
+        if (bit == 0)
+		{
+            if (++i == 16)
+                break;
+
+            bit = 0x80;
+        }
+    }
+    node->value = value;
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_radix128tree_delete(ngx_radix_tree_t *tree, u_char *key, u_char *mask)
+{
+	ngx_uint_t i = 0;
+	u_char bit = 0x80;
+	ngx_radix_node_t* node = tree->root;
+    while (node && (bit & mask[i]))
+	{
+        if (key[i] & bit)
+            node = node->right;
+        else
+            node = node->left;
+
+        bit >>= 1;
+
+        if (bit == 0)
+		{
+            if (++i == 16)
+                break;
+
+            bit = 0x80;
+        }
+    }
+
+    if (node == NULL) return NGX_ERROR;
+
+    if (node->right || node->left)
+	{
+        if (node->value != NGX_RADIX_NO_VALUE)
+		{
+            node->value = NGX_RADIX_NO_VALUE;
+            return NGX_OK;
+        }
+		else
+		{
+			return NGX_ERROR;
+		}
+    }
+
+    for ( ;; )
+	{
+        if (node->parent->right == node)
+            node->parent->right = NULL;
+        else
+            node->parent->left = NULL;
+
+        node->right = tree->free_list;
+        tree->free_list = node;
+
+        node = node->parent;
+        if (node->right || node->left)
+            break;
+
+        if (node->value != NGX_RADIX_NO_VALUE)
+            break;
+
+        if (node->parent == NULL)
+            break;
+    }
+    return NGX_OK;
+}
+
+uintptr_t ngx_radix128tree_find(ngx_radix_tree_t *tree, u_char *key)
+{
+	ngx_uint_t i = 0;
+	u_char bit = 0x80;
+	uintptr_t value = NGX_RADIX_NO_VALUE;
+	ngx_radix_node_t* node = tree->root;
+    while (node)
+	{
+        if (node->value != NGX_RADIX_NO_VALUE)
+            value = node->value;
+
+        /* a /128 node has no children, do not read past the key */
+        if (i == 16)
+            break;
+
+        if (key[i] & bit)
+            node = node->right;
+		else
+            node = node->left;
+
+        bit >>= 1;
+
+        if (bit == 0)
+		{
+            i++;
+            bit = 0x80;
+        }
+    }
+    return value;
+}
+
+#endif
+
+void ngx_radix_tree_stat(ngx_radix_tree_t *tree, ngx_radix_tree_stat_t *stat)
+{
+    ngx_memzero(stat, sizeof(ngx_radix_tree_stat_t));
+
+    ngx_radix_tree_count(tree->root, stat, 0);
+
+    for (ngx_radix_node_t* node = tree->free_list; node; node = node->right)
+	{
+        stat->free++;
+    }
+
+    for (void* page = tree->pages; page; page = *(void **) page)
+	{
+        stat->pages++;
+    }
+
+    stat->size = stat->pages * ngx_pagesize + tree->compacted;
+}
+
+/*
+ * Churn scatters live nodes over many pages, half-empty ones included.
+ * The compaction copies the live nodes in depth-first order into one
+ * contiguous block, so that a lookup path touches neighbouring memory,
+ * and releases the old pages and the free list with them.
+ */
+
+ngx_int_t ngx_radix_tree_compact(ngx_radix_tree_t *tree, ngx_log_t *log)
+{
+    ngx_radix_tree_stat_t before;
+    ngx_radix_tree_stat(tree, &before);
+
+    size_t size = before.nodes * sizeof(ngx_radix_node_t);
+
+    ngx_radix_node_t* block = ngx_pmemalign(tree->pool, size, ngx_pagesize);
+    if (block == NULL)
+        return NGX_ERROR;
+
+    ngx_radix_node_t* next = block;
+    ngx_radix_node_t* root = ngx_radix_tree_copy(tree->root, NULL, &next);
+
+    void* page = tree->pages;
+    while (page)
+	{
+        void* prev = *(void **) page;
+        (void) ngx_pfree(tree->pool, page);
+        page = prev;
+    }
+
+    if (tree->compacted)
+        (void) ngx_pfree(tree->pool, tree->block);
+
+    tree->root = root;
+    tree->free_list = NULL;
+    tree->pages = NULL;
+    tree->start = NULL;
+    tree->size = 0;
+    tree->block = block;
+    tree->compacted = size;
+
+    ngx_radix_tree_stat_t after;
+    ngx_radix_tree_stat(tree, &after);
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "radix tree compacted: %ui nodes, %ui free, "
+                  "%uz bytes in %ui pages -> %uz bytes",
+                  before.nodes, before.free, before.size, before.pages,
+                  after.size);
+
+    return NGX_OK;
+}
+
+static void ngx_radix_tree_count(ngx_radix_node_t *node, ngx_radix_tree_stat_t *stat, ngx_uint_t depth)
+{
+    if (node == NULL)
+        return;
+
+    stat->nodes++;
+
+    if (depth > stat->depth)
+        stat->depth = depth;
+
+    ngx_radix_tree_count(node->left, stat, depth + 1);
+    ngx_radix_tree_count(node->right, stat, depth + 1);
+}
+
+static ngx_radix_node_t* ngx_radix_tree_copy(ngx_radix_node_t *node, ngx_radix_node_t *parent, ngx_radix_node_t **next)
+{
+    if (node == NULL)
+        return NULL;
+
+    ngx_radix_node_t* copy = (*next)++;
+
+    copy->parent = parent;
+    copy->value = node->value;
+    copy->left = ngx_radix_tree_copy(node->left, copy, next);
+    copy->right = ngx_radix_tree_copy(node->right, copy, next);
+
+    return copy;
+}
+
 static ngx_radix_node_t* ngx_radix_alloc(ngx_radix_tree_t* tree)
 {
 	if (tree->free_list)
@@ -227,11 +1243,16 @@ static ngx_radix_node_t* ngx_radix_alloc(ngx_radix_tree_t* tree)
 
     if (tree->size < sizeof(ngx_radix_node_t))
 	{
-        tree->start = ngx_pmemalign(tree->pool, ngx_pagesize, ngx_pagesize);
-        if (tree->start == NULL)
+        char* page = ngx_pmemalign(tree->pool, ngx_pagesize, ngx_pagesize);
+        if (page == NULL)
             return NULL;
 
-        tree->size = ngx_pagesize;
+        /* pages are linked through their first slot, so they can be released */
+        *(void **) page = tree->pages;
+        tree->pages = page;
+
+        tree->start = page + sizeof(ngx_radix_node_t);
+        tree->size = ngx_pagesize - sizeof(ngx_radix_node_t);
     }
 
 	ngx_radix_node_t* p = (ngx_radix_node_t*)tree->start;
@@ -31,14 +31,140 @@ typedef struct {
 	// deleted node are reused in free_list
     ngx_radix_node_t  *free_list;
 
+    // allocated pages, linked through their first node slot
+    void              *pages;
+
     char              *start;
     size_t             size;
+
+    // the block of the last compaction and its size
+    void              *block;
+    size_t             compacted;
 } ngx_radix_tree_t;
 
+typedef struct {
+    ngx_uint_t         nodes;
+    ngx_uint_t         free;
+    ngx_uint_t         pages;
+    ngx_uint_t         depth;
+    size_t             size;
+} ngx_radix_tree_stat_t;
+
 ngx_radix_tree_t *ngx_radix_tree_create(ngx_pool_t *pool, ngx_int_t preallocate);
 
+void ngx_radix_tree_stat(ngx_radix_tree_t *tree, ngx_radix_tree_stat_t *stat);
+ngx_int_t ngx_radix_tree_compact(ngx_radix_tree_t *tree, ngx_log_t *log);
+
 ngx_int_t ngx_radix32tree_insert(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask, uintptr_t value);
 ngx_int_t ngx_radix32tree_delete(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask);
 uintptr_t ngx_radix32tree_find(ngx_radix_tree_t *tree, uint32_t key);
 
+/* number of lookups interleaved by the batch functions */
+#define NGX_RADIX_BATCH  16
+
+void ngx_radix32tree_find_batch(ngx_radix_tree_t *tree, uint32_t *keys, ngx_uint_t n, uintptr_t *values);
+
+/*
+ * Live updates: trees registered by name may be changed by a prefix diff
+ * file without a reload.  The master process applies the diff to its own
+ * copy and tells workers over the channel to reopen the file and apply it
+ * to their copies, so the file must stay until they have.  Lines of the
+ * file are
+ *
+ *     add <tree> <addr>/<bits> <value>;
+ *     delete <tree> <addr>/<bits>;
+ *
+ * values are numbers, as pointers of one process mean nothing in another.
+ */
+
+#define NGX_RADIX_DIFF_PATH  "logs/radix.diff"
+
+typedef struct {
+    ngx_str_t          name;
+    ngx_radix_tree_t  *tree;
+} ngx_radix_diff_target_t;
+
+ngx_int_t ngx_radix32tree_diff_target(ngx_cycle_t *cycle, ngx_str_t *name, ngx_radix_tree_t *tree);
+ngx_int_t ngx_radix32tree_apply_diff(ngx_cycle_t *cycle, ngx_fd_t fd);
+
+/*
+ * A multibit trie compiled from a 32-bit radix tree for longest-prefix
+ * match in at most three table reads plus one value read.  The strides are
+ * 16-8-8: the level 1 table is indexed by the high 16 bits of the key,
+ * every deeper table by the next 8 bits.  Prefixes are expanded into all
+ * entries they cover, so an entry either holds a value index or refers to
+ * the next level table.  Tables are referred to by index, not by pointer.
+ */
+
+#define NGX_RADIX32_STRIDE_L1     16
+#define NGX_RADIX32_STRIDE_LN     8
+#define NGX_RADIX32_STRIDE_CHILD  0x80000000
+
+typedef struct {
+    /* the level 1 table followed by the 256-entry deeper tables */
+    uint32_t          *tables;
+    uintptr_t         *values;
+    ngx_uint_t         ntables;
+    ngx_uint_t         nvalues;
+} ngx_radix32_stride_t;
+
+void ngx_radix32_stride_find_batch(ngx_radix32_stride_t *st, uint32_t *keys, ngx_uint_t n, uintptr_t *values);
+
+#define ngx_radix32_stride_tables_size(ntables)                               \
+    (((1 << NGX_RADIX32_STRIDE_L1) + ((ntables) << NGX_RADIX32_STRIDE_LN))      \
+     * sizeof(uint32_t))
+
+ngx_radix32_stride_t *ngx_radix32_stride_build(ngx_radix_tree_t *tree, ngx_pool_t *pool);
+
+static ngx_inline uintptr_t ngx_radix32_stride_find(ngx_radix32_stride_t *st, uint32_t key)
+{
+    uint32_t  *level = st->tables + (1 << NGX_RADIX32_STRIDE_L1);
+    uint32_t   e = st->tables[key >> 16];
+
+    if (e & NGX_RADIX32_STRIDE_CHILD) {
+        e = level[((e & ~NGX_RADIX32_STRIDE_CHILD) << 8) + ((key >> 8) & 0xff)];
+
+        if (e & NGX_RADIX32_STRIDE_CHILD) {
+            e = level[((e & ~NGX_RADIX32_STRIDE_CHILD) << 8) + (key & 0xff)];
+        }
+    }
+
+    return st->values[e];
+}
+
+/*
+ * A compiled stride trie shared read-only by workers: two snapshot slots
+ * live in one region mapped before fork, a new prefix table is compiled
+ * into the inactive slot and published by switching the active index,
+ * with no reload.  Lookups take no lock, publishers serialize on the
+ * mutex of the zone, which the master recovers if a publisher dies.
+ */
+
+typedef struct {
+    ngx_atomic_t       seq;      // odd while the slot is being rewritten
+    ngx_uint_t         ntables;
+    ngx_uint_t         nvalues;
+    /* the tables and values follow */
+} ngx_radix32_snapshot_t;
+
+typedef struct {
+    ngx_atomic_t       active;
+    size_t             slot_size;
+
+    // serializes publishers, usually &shpool->mutex of the zone
+    ngx_shmtx_t       *mutex;
+    /* two snapshot slots follow */
+} ngx_radix32_shared_t;
+
+ngx_radix32_shared_t *ngx_radix32_shared_init(u_char *addr, size_t size, ngx_shmtx_t *mutex);
+ngx_int_t ngx_radix32_shared_publish(ngx_radix32_shared_t *sh, ngx_radix_tree_t *tree);
+uintptr_t ngx_radix32_shared_find(ngx_radix32_shared_t *sh, uint32_t key);
+
+#if (NGX_HAVE_INET6)
+// key and mask are 16-byte addresses in network byte order
+ngx_int_t ngx_radix128tree_insert(ngx_radix_tree_t *tree, u_char *key, u_char *mask, uintptr_t value);
+ngx_int_t ngx_radix128tree_delete(ngx_radix_tree_t *tree, u_char *key, u_char *mask);
+uintptr_t ngx_radix128tree_find(ngx_radix_tree_t *tree, u_char *key);
+#endif
+
 #endif /* _NGX_RADIX_TREE_H_INCLUDED_ */
@@ -17,6 +17,7 @@
 
 static ngx_inline void ngx_rbtree_left_rotate(ngx_rbtree_node_t **root, ngx_rbtree_node_t *sentinel, ngx_rbtree_node_t *node);
 static ngx_inline void ngx_rbtree_right_rotate(ngx_rbtree_node_t **root, ngx_rbtree_node_t *sentinel, ngx_rbtree_node_t *node);
+static ngx_inline void ngx_rbtree_transplant(ngx_rbtree_t *tree, ngx_rbtree_node_t *u, ngx_rbtree_node_t *v);
 
 
 void ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
@@ -31,12 +32,21 @@ void ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
 		node->right = sentinel;
 		ngx_rbt_black(node);
 		*root = node;
+		tree->leftmost = node;
 		return;
 	}
 
 	/* a binary tree insert */
 	tree->insert(*root, node, sentinel);
 
+	/*
+	 * the new node is the minimum only if it was attached as the left child
+	 * of the old minimum, rotations below do not change the in-order sequence
+	 */
+
+	if (node->parent == tree->leftmost && node == tree->leftmost->left)
+		tree->leftmost = node;
+
 	/* re-balance tree */
 	while (node != *root && ngx_rbt_is_red(node->parent))
 	{
@@ -148,9 +158,12 @@ void ngx_rbtree_insert_timer_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *n
 	ngx_rbt_red(node);
 }
 
-static void ngx_rbtree_transplant(ngx_rbtree_t *tree, ngx_rbtree_t* u, ngx_rbtree_t* v)
+/* replace the subtree rooted at u with the one rooted at v, v may be the sentinel */
+
+static ngx_inline void ngx_rbtree_transplant(ngx_rbtree_t *tree, ngx_rbtree_node_t *u, ngx_rbtree_node_t *v)
 {
-	if (u->p == tree->sentinel)
+	/* the root is the only node without a parent */
+	if (u->parent == NULL)
 	{
 		tree->root = v;
 	}
@@ -175,6 +188,13 @@ void ngx_rbtree_delete(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
 	ngx_rbtree_node_t* y = node;
 	ngx_uint_t originColorIsRed = ngx_rbt_is_red(y);
 
+	if (node == tree->leftmost)
+	{
+		/* the minimum has no left child, its successor is found cheaply */
+		ngx_rbtree_node_t* next = ngx_rbtree_next(tree, node);
+		tree->leftmost = (next != NULL) ? next : sentinel;
+	}
+
 	if (node->left == sentinel)
 	{
 		x = node->right;
@@ -188,7 +208,7 @@ void ngx_rbtree_delete(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
 	else
 	{
 		y = ngx_rbtree_min(node->right, sentinel);
-		originColorIsRed = ngx_rbt_is_red(y->color);
+		originColorIsRed = ngx_rbt_is_red(y);
 		x = y->right;
 		if (y == node->right)
 		{
@@ -329,9 +349,11 @@ static ngx_inline void ngx_rbtree_right_rotate(ngx_rbtree_node_t **root, ngx_rbt
 
 	if (x->right != sentinel)
 	{
-		x->right->p = node;
+		x->right->parent = node;
 	}
 
+	x->parent = node->parent;
+
 	if (node == *root)
 	{
 		*root = x;
@@ -363,3 +385,541 @@ ngx_rbtree_node_t * ngx_rbtree_next(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
 	}
 	return parent;
 }
+
+ngx_rbtree_node_t * ngx_rbtree_prev(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
+{
+	ngx_rbtree_node_t *sentinel = tree->sentinel;
+	if (node->left != sentinel)
+		return ngx_rbtree_max(node->left, sentinel);
+
+	ngx_rbtree_node_t* parent = node->parent;
+	while (parent != NULL && node != parent->right)
+	{
+		node = parent;
+		parent = node->parent;
+	}
+	return parent;
+}
+
+/*
+ * Keys are compared the way the tree inserter orders them: timer trees
+ * use the wraparound-safe comparison of ngx_rbtree_insert_timer_value().
+ */
+
+static ngx_inline ngx_rbtree_key_int_t ngx_rbtree_key_cmp(ngx_rbtree_t *tree, ngx_rbtree_key_t k1, ngx_rbtree_key_t k2)
+{
+	if (tree->timer)
+		return (ngx_rbtree_key_int_t)(k1 - k2);
+
+	return (k1 < k2) ? -1 : (k1 > k2);
+}
+
+/*
+ * The split behind ngx_rbtree_extract_le() follows the join-based
+ * algorithms of Blelloch, Ferizovic and Sun, "Just Join for Parallel
+ * Ordered Sets".  Black heights below count the black nodes on a path
+ * down from the node, the node itself included and the sentinel not.
+ */
+
+typedef struct {
+	ngx_rbtree_t          *tree;
+	ngx_rbtree_key_t       key;
+	ngx_rbtree_node_t    **last;
+	ngx_uint_t             n;
+} ngx_rbtree_split_t;
+
+static ngx_inline void ngx_rbtree_link(ngx_rbtree_node_t *node, ngx_rbtree_node_t *left, ngx_rbtree_node_t *right, ngx_rbtree_node_t *sentinel)
+{
+	node->left = left;
+	node->right = right;
+
+	if (left != sentinel)
+		left->parent = node;
+
+	if (right != sentinel)
+		right->parent = node;
+}
+
+/*
+ * Hangs node and the tree r off the right spine of l, which is at least
+ * as high.  The result keeps the black height of l but may have a red
+ * root with a red right child, the caller fixes it.
+ */
+
+static ngx_rbtree_node_t *ngx_rbtree_join_right(ngx_rbtree_node_t *l, ngx_int_t lh, ngx_rbtree_node_t *node, ngx_rbtree_node_t *r, ngx_int_t rh, ngx_rbtree_node_t *sentinel)
+{
+	if (ngx_rbt_is_black(l) && lh == rh)
+	{
+		ngx_rbtree_link(node, l, r, sentinel);
+		ngx_rbt_red(node);
+		return node;
+	}
+
+	ngx_rbtree_node_t *t = ngx_rbtree_join_right(l->right, lh - ngx_rbt_is_black(l), node, r, rh, sentinel);
+
+	l->right = t;
+	t->parent = l;
+
+	if (ngx_rbt_is_black(l) && ngx_rbt_is_red(t) && ngx_rbt_is_red(t->right))
+	{
+		/* a red-red pair under a black node: recolor and rotate left */
+
+		ngx_rbt_black(t->right);
+
+		l->right = t->left;
+		if (t->left != sentinel)
+			t->left->parent = l;
+
+		t->left = l;
+		l->parent = t;
+
+		return t;
+	}
+
+	return l;
+}
+
+static ngx_rbtree_node_t *ngx_rbtree_join_left(ngx_rbtree_node_t *l, ngx_int_t lh, ngx_rbtree_node_t *node, ngx_rbtree_node_t *r, ngx_int_t rh, ngx_rbtree_node_t *sentinel)
+{
+	if (ngx_rbt_is_black(r) && lh == rh)
+	{
+		ngx_rbtree_link(node, l, r, sentinel);
+		ngx_rbt_red(node);
+		return node;
+	}
+
+	ngx_rbtree_node_t *t = ngx_rbtree_join_left(l, lh, node, r->left, rh - ngx_rbt_is_black(r), sentinel);
+
+	r->left = t;
+	t->parent = r;
+
+	if (ngx_rbt_is_black(r) && ngx_rbt_is_red(t) && ngx_rbt_is_red(t->left))
+	{
+		ngx_rbt_black(t->left);
+
+		r->left = t->right;
+		if (t->right != sentinel)
+			t->right->parent = r;
+
+		t->right = r;
+		r->parent = t;
+
+		return t;
+	}
+
+	return r;
+}
+
+/* joins l, node and r, all keys of l sort before node and those of r after */
+
+static ngx_rbtree_node_t *ngx_rbtree_join(ngx_rbtree_node_t *l, ngx_int_t lh, ngx_rbtree_node_t *node, ngx_rbtree_node_t *r, ngx_int_t rh, ngx_rbtree_node_t *sentinel, ngx_int_t *h)
+{
+	ngx_rbtree_node_t *t;
+
+	if (lh > rh)
+	{
+		t = ngx_rbtree_join_right(l, lh, node, r, rh, sentinel);
+		*h = lh;
+
+		if (ngx_rbt_is_red(t) && ngx_rbt_is_red(t->right))
+		{
+			ngx_rbt_black(t);
+			(*h)++;
+		}
+
+		return t;
+	}
+
+	if (lh < rh)
+	{
+		t = ngx_rbtree_join_left(l, lh, node, r, rh, sentinel);
+		*h = rh;
+
+		if (ngx_rbt_is_red(t) && ngx_rbt_is_red(t->left))
+		{
+			ngx_rbt_black(t);
+			(*h)++;
+		}
+
+		return t;
+	}
+
+	ngx_rbtree_link(node, l, r, sentinel);
+
+	if (ngx_rbt_is_black(l) && ngx_rbt_is_black(r))
+	{
+		ngx_rbt_red(node);
+		*h = lh;
+	}
+	else
+	{
+		ngx_rbt_black(node);
+		*h = lh + 1;
+	}
+
+	return node;
+}
+
+/* appends a detached subtree to the list in the key order */
+
+static void ngx_rbtree_split_collect(ngx_rbtree_split_t *s, ngx_rbtree_node_t *node)
+{
+	ngx_rbtree_node_t *sentinel = s->tree->sentinel;
+
+	while (node != sentinel)
+	{
+		ngx_rbtree_node_t *right = node->right;
+
+		ngx_rbtree_split_collect(s, node->left);
+
+		*s->last = node;
+		s->last = &node->left;
+		s->n++;
+
+		node = right;
+	}
+}
+
+/*
+ * Walks down one path: subtrees to the left of the bound are detached
+ * whole, those to the right are joined back on the way up.  Returns the
+ * tree of the greater keys and its black height in *rh.
+ */
+
+static ngx_rbtree_node_t *ngx_rbtree_split(ngx_rbtree_split_t *s, ngx_rbtree_node_t *node, ngx_int_t h, ngx_int_t *rh)
+{
+	ngx_rbtree_node_t *sentinel = s->tree->sentinel;
+
+	while (node != sentinel && ngx_rbtree_key_cmp(s->tree, node->key, s->key) <= 0)
+	{
+		ngx_rbtree_node_t *right = node->right;
+
+		ngx_rbtree_split_collect(s, node->left);
+
+		*s->last = node;
+		s->last = &node->left;
+		s->n++;
+
+		h -= ngx_rbt_is_black(node);
+		node = right;
+	}
+
+	if (node == sentinel)
+	{
+		*rh = 0;
+		return sentinel;
+	}
+
+	ngx_int_t ch = h - ngx_rbt_is_black(node);
+	ngx_rbtree_node_t *right = node->right;
+	ngx_int_t lh;
+
+	ngx_rbtree_node_t *l = ngx_rbtree_split(s, node->left, ch, &lh);
+
+	return ngx_rbtree_join(l, lh, node, right, ch, sentinel, rh);
+}
+
+/*
+ * The nodes up to the bound are split off in one pass, which costs
+ * O(log n) rebalancing for the whole batch instead of a delete per node,
+ * and are linked through their left pointers.  The handlers run only
+ * afterwards, so they are free to insert or delete other nodes.
+ */
+
+ngx_uint_t ngx_rbtree_extract_le(ngx_rbtree_t *tree, ngx_rbtree_key_t key, ngx_rbtree_extract_pt handler)
+{
+	ngx_rbtree_node_t *sentinel = tree->sentinel;
+	ngx_rbtree_node_t *list = NULL;
+	ngx_rbtree_split_t s;
+
+	if (tree->leftmost == sentinel || ngx_rbtree_key_cmp(tree, tree->leftmost->key, key) > 0)
+		return 0;
+
+	s.tree = tree;
+	s.key = key;
+	s.last = &list;
+	s.n = 0;
+
+	/* the black height of the root, down the left spine */
+
+	ngx_int_t h = 0;
+
+	for (ngx_rbtree_node_t *node = tree->root; node != sentinel; node = node->left)
+		h += ngx_rbt_is_black(node);
+
+	ngx_int_t rh;
+	ngx_rbtree_node_t *root = ngx_rbtree_split(&s, tree->root, h, &rh);
+
+	*s.last = NULL;
+
+	if (root != sentinel)
+	{
+		root->parent = NULL;
+		ngx_rbt_black(root);
+		tree->leftmost = ngx_rbtree_min(root, sentinel);
+	}
+	else
+	{
+		tree->leftmost = sentinel;
+	}
+
+	tree->root = root;
+
+	while (list)
+	{
+		ngx_rbtree_node_t *node = list;
+		list = list->left;
+
+		node->left = NULL;
+		node->right = NULL;
+		node->parent = NULL;
+
+		handler(node);
+	}
+
+	return s.n;
+}
+
+void ngx_rbtree_iter_init(ngx_rbtree_iter_t *it, ngx_rbtree_t *tree, ngx_rbtree_key_t start, ngx_rbtree_key_t end, ngx_uint_t backward)
+{
+	ngx_rbtree_node_t *sentinel = tree->sentinel;
+	ngx_rbtree_node_t *temp = tree->root;
+
+	it->tree = tree;
+	it->node = NULL;
+	it->start = start;
+	it->end = end;
+	it->backward = backward;
+
+	/* find the first node >= start, or the last node <= end if backward */
+
+	while (temp != sentinel)
+	{
+		if (backward)
+		{
+			if (ngx_rbtree_key_cmp(tree, temp->key, end) <= 0)
+			{
+				it->node = temp;
+				temp = temp->right;
+			}
+			else
+			{
+				temp = temp->left;
+			}
+		}
+		else
+		{
+			if (ngx_rbtree_key_cmp(tree, temp->key, start) >= 0)
+			{
+				it->node = temp;
+				temp = temp->left;
+			}
+			else
+			{
+				temp = temp->right;
+			}
+		}
+	}
+}
+
+ngx_rbtree_node_t * ngx_rbtree_iter_next(ngx_rbtree_iter_t *it)
+{
+	ngx_rbtree_node_t *node = it->node;
+	if (node == NULL)
+		return NULL;
+
+	if (it->backward)
+	{
+		if (ngx_rbtree_key_cmp(it->tree, node->key, it->start) < 0)
+		{
+			it->node = NULL;
+			return NULL;
+		}
+
+		it->node = ngx_rbtree_prev(it->tree, node);
+	}
+	else
+	{
+		if (ngx_rbtree_key_cmp(it->tree, node->key, it->end) > 0)
+		{
+			it->node = NULL;
+			return NULL;
+		}
+
+		it->node = ngx_rbtree_next(it->tree, node);
+	}
+
+	/* the neighbour is saved ahead, so the caller may delete the returned node */
+
+	return node;
+}
+
+#if (NGX_DEBUG)
+
+static ngx_int_t ngx_rbtree_verify_node(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
+{
+	ngx_rbtree_node_t *sentinel = tree->sentinel;
+	if (node == sentinel)
+		return 1;
+
+	if (ngx_rbt_is_red(node)
+		&& (ngx_rbt_is_red(node->left) || ngx_rbt_is_red(node->right)))
+	{
+		return NGX_ERROR;
+	}
+
+	if (node->left != sentinel
+		&& (node->left->parent != node
+			|| ngx_rbtree_key_cmp(tree, node->left->key, node->key) > 0))
+	{
+		return NGX_ERROR;
+	}
+
+	if (node->right != sentinel
+		&& (node->right->parent != node
+			|| ngx_rbtree_key_cmp(tree, node->right->key, node->key) < 0))
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_int_t lh = ngx_rbtree_verify_node(tree, node->left);
+	ngx_int_t rh = ngx_rbtree_verify_node(tree, node->right);
+	if (lh == NGX_ERROR || rh == NGX_ERROR || lh != rh)
+		return NGX_ERROR;
+
+	return lh + ngx_rbt_is_black(node);
+}
+
+/*
+ * Checks the red-black properties, parent links, key order,
+ * the equal black height of all paths and the cached minimum.
+ */
+
+ngx_int_t ngx_rbtree_verify(ngx_rbtree_t *tree)
+{
+	ngx_rbtree_node_t *root = tree->root;
+	ngx_rbtree_node_t *sentinel = tree->sentinel;
+
+	if (ngx_rbt_is_red(sentinel) || ngx_rbt_is_red(root))
+		return NGX_ERROR;
+
+	if (root == sentinel)
+		return (tree->leftmost == sentinel) ? 0 : NGX_ERROR;
+
+	if (root->parent != NULL || tree->leftmost != ngx_rbtree_min(root, sentinel))
+		return NGX_ERROR;
+
+	return ngx_rbtree_verify_node(tree, root);
+}
+
+#endif
+
+/*
+ * Writers hold the slab mutex, so an odd sequence seen under it was left
+ * by a writer that died mid-change, and the mutex was then recovered by
+ * ngx_shmtx_force_unlock().  Restore the parity, or every lookup falls back
+ * to the mutex from now on.
+ */
+
+void ngx_rbtree_seq_repair(ngx_rbtree_seq_t *tree)
+{
+	if (tree->seq & 1)
+	{
+		tree->seq++;
+		ngx_memory_barrier();
+	}
+}
+
+static ngx_inline void ngx_rbtree_seq_write_begin(ngx_rbtree_seq_t *tree)
+{
+	ngx_rbtree_seq_repair(tree);
+
+	/* odd sequence tells readers that a change is in progress */
+	tree->seq++;
+	ngx_memory_barrier();
+}
+
+static ngx_inline void ngx_rbtree_seq_write_end(ngx_rbtree_seq_t *tree)
+{
+	ngx_memory_barrier();
+	tree->seq++;
+}
+
+void ngx_rbtree_seq_insert(ngx_rbtree_seq_t *tree, ngx_rbtree_node_t *node)
+{
+	ngx_rbtree_seq_write_begin(tree);
+	ngx_rbtree_insert(&tree->rbtree, node);
+	ngx_rbtree_seq_write_end(tree);
+}
+
+void ngx_rbtree_seq_delete(ngx_rbtree_seq_t *tree, ngx_rbtree_node_t *node)
+{
+	ngx_rbtree_seq_write_begin(tree);
+	ngx_rbtree_delete(&tree->rbtree, node);
+	ngx_rbtree_seq_write_end(tree);
+}
+
+/*
+ * The lookup may run into a tree which is being rebalanced.  Nodes of
+ * a slab zone stay mapped after they are freed, so a torn walk reads stale
+ * but valid memory; the walk is bounded by the maximum tree height to
+ * escape a transient cycle, and the result is discarded if the sequence
+ * has changed in the meantime.  The retries are bounded: a writer that
+ * stays in the middle of a change, preempted or dead, makes the lookup
+ * return NGX_BUSY, and the caller looks up under the slab mutex instead.
+ * Keys are compared as plain values, as
+ * ngx_rbtree_insert_value() orders them; nodes of the same key, such as
+ * the hash collisions of a string-keyed tree, are told apart by compare.
+ */
+
+ngx_int_t ngx_rbtree_seq_lookup(ngx_rbtree_seq_t *tree, ngx_rbtree_key_t key, ngx_rbtree_compare_pt compare, ngx_rbtree_copy_pt copy, void *data)
+{
+	ngx_rbtree_node_t *sentinel = tree->rbtree.sentinel;
+
+	for (ngx_uint_t tries = 0; tries < NGX_RBTREE_SEQ_TRIES; tries++)
+	{
+		ngx_atomic_uint_t seq = tree->seq;
+		if (seq & 1)
+		{
+			ngx_cpu_pause();
+			continue;
+		}
+
+		ngx_memory_barrier();
+
+		ngx_int_t rc = NGX_DECLINED;
+		ngx_uint_t torn = 0;
+		ngx_rbtree_node_t *node = tree->rbtree.root;
+
+		for (ngx_uint_t n = 0; node != sentinel; n++)
+		{
+			if (node == NULL || n == NGX_RBTREE_MAX_HEIGHT)
+			{
+				torn = 1;
+				break;
+			}
+
+			if (key != node->key)
+			{
+				node = (key < node->key) ? node->left : node->right;
+				continue;
+			}
+
+			ngx_int_t cmp = (compare != NULL) ? compare(node, data) : 0;
+			if (cmp == 0)
+			{
+				rc = copy(node, data);
+				break;
+			}
+
+			node = (cmp < 0) ? node->left : node->right;
+		}
+
+		ngx_memory_barrier();
+
+		if (tree->seq == seq && !torn)
+			return rc;
+	}
+
+	return NGX_BUSY;
+}
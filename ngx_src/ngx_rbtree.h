@@ -32,22 +32,106 @@ typedef struct ngx_rbtree_s  ngx_rbtree_t;
 
 typedef void (*ngx_rbtree_insert_pt) (ngx_rbtree_node_t *root, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
+// invoked on every node detached by ngx_rbtree_extract_le()
+typedef void (*ngx_rbtree_extract_pt) (ngx_rbtree_node_t *node);
+
 struct ngx_rbtree_s
 {
 	ngx_rbtree_node_t     *root;
 	ngx_rbtree_node_t     *sentinel;
 	ngx_rbtree_insert_pt   insert;
+
+	// cached minimum node, sentinel if the tree is empty
+	ngx_rbtree_node_t     *leftmost;
+
+	// keys are timers compared modulo wraparound, see ngx_rbtree_timer_init()
+	ngx_uint_t             timer;
 };
 
 #define ngx_rbtree_init(tree, s, i)                                           \
 	ngx_rbtree_sentinel_init(s);                                              \
 	(tree)->root = s;                                                         \
 	(tree)->sentinel = s;                                                     \
-	(tree)->insert = i
+	(tree)->insert = i;                                                       \
+	(tree)->leftmost = s;                                                     \
+	(tree)->timer = 0
+
+/*
+ * a tree of ngx_msec_t deadlines: extraction and iteration bounds are
+ * compared as ngx_rbtree_insert_timer_value() orders the keys
+ */
+#define ngx_rbtree_timer_init(tree, s)                                        \
+	ngx_rbtree_init(tree, s, ngx_rbtree_insert_timer_value);                  \
+	(tree)->timer = 1
 
 void ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
 void ngx_rbtree_delete(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
 ngx_rbtree_node_t *ngx_rbtree_next(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
+ngx_rbtree_node_t *ngx_rbtree_prev(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
+
+/*
+ * bulk removal of all nodes whose key is less than or equal to the bound:
+ * the tree is split once, the handler is called in the key order
+ */
+ngx_uint_t ngx_rbtree_extract_le(ngx_rbtree_t *tree, ngx_rbtree_key_t key, ngx_rbtree_extract_pt handler);
+
+/* ordered iteration over the keys in [start, end] */
+typedef struct {
+	ngx_rbtree_t          *tree;
+	ngx_rbtree_node_t     *node;
+	ngx_rbtree_key_t       start;
+	ngx_rbtree_key_t       end;
+	ngx_uint_t             backward;
+} ngx_rbtree_iter_t;
+
+void ngx_rbtree_iter_init(ngx_rbtree_iter_t *it, ngx_rbtree_t *tree, ngx_rbtree_key_t start, ngx_rbtree_key_t end, ngx_uint_t backward);
+ngx_rbtree_node_t *ngx_rbtree_iter_next(ngx_rbtree_iter_t *it);
+
+/*
+ * A read-mostly tree for shared memory zones: writers still serialize on
+ * the slab mutex and bump the sequence around every change, readers take
+ * no lock and retry only if a writer ran during the lookup.
+ */
+
+#define NGX_RBTREE_MAX_HEIGHT  (2 * 8 * sizeof(ngx_rbtree_key_t))
+
+/* lookup attempts before ngx_rbtree_seq_lookup() gives up with NGX_BUSY */
+#define NGX_RBTREE_SEQ_TRIES   1024
+
+typedef struct {
+	ngx_rbtree_t           rbtree;
+	ngx_atomic_t           seq;
+} ngx_rbtree_seq_t;
+
+/* copies the data out of a node found, must not trust it beyond bounds checks */
+typedef ngx_int_t (*ngx_rbtree_copy_pt) (ngx_rbtree_node_t *node, void *data);
+
+/*
+ * breaks a tie between nodes of the same key, as ngx_str_rbtree_lookup()
+ * compares the strings: returns less than, equal to or greater than zero
+ * if the data looked up sorts before, matches or sorts after the node
+ */
+typedef ngx_int_t (*ngx_rbtree_compare_pt) (ngx_rbtree_node_t *node, void *data);
+
+#define ngx_rbtree_seq_init(tree, s, i)                                       \
+	ngx_rbtree_init(&(tree)->rbtree, s, i);                                   \
+	(tree)->seq = 0
+
+void ngx_rbtree_seq_insert(ngx_rbtree_seq_t *tree, ngx_rbtree_node_t *node);
+void ngx_rbtree_seq_delete(ngx_rbtree_seq_t *tree, ngx_rbtree_node_t *node);
+/*
+ * compare may be NULL if the keys are unique; NGX_BUSY means a writer kept
+ * the tree busy, the caller should take the slab mutex, call
+ * ngx_rbtree_seq_repair() and look up again
+ */
+ngx_int_t ngx_rbtree_seq_lookup(ngx_rbtree_seq_t *tree, ngx_rbtree_key_t key, ngx_rbtree_compare_pt compare, ngx_rbtree_copy_pt copy, void *data);
+/* called with the slab mutex held, fixes the sequence left by a dead writer */
+void ngx_rbtree_seq_repair(ngx_rbtree_seq_t *tree);
+
+#if (NGX_DEBUG)
+/* returns the black height, or NGX_ERROR if an invariant is broken */
+ngx_int_t ngx_rbtree_verify(ngx_rbtree_t *tree);
+#endif
 
 /* tree inserters*/
 void ngx_rbtree_insert_value(ngx_rbtree_node_t *root, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
@@ -70,4 +154,12 @@ static ngx_inline ngx_rbtree_node_t* ngx_rbtree_min(ngx_rbtree_node_t *node, ngx
 	return node;
 }
 
+static ngx_inline ngx_rbtree_node_t* ngx_rbtree_max(ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+	while (node->right != sentinel) {
+		node = node->right;
+	}
+	return node;
+}
+
 #endif /* _NGX_RBTREE_H_INCLUDED_ */
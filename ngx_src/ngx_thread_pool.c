@@ -9,6 +9,11 @@
 #include <ngx_core.h>
 #include <ngx_thread_pool.h>
 
+#if (NGX_LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 
 typedef struct {
     ngx_array_t               pools;
@@ -24,17 +29,132 @@ typedef struct {
     (q)->first = NULL;                                                        \
     (q)->last = &(q)->first
 
+/*
+ * A bounded lock-free MPMC ring (D. Vyukov): the sequence of a cell tells
+ * whether it is free for the enqueue position or holds a task for the
+ * dequeue position, so producers and consumers only contend with a CAS on
+ * their own index.  The indexes are kept on separate cache lines.
+ */
+
+typedef struct {
+    ngx_atomic_t              seq;
+    ngx_thread_task_t        *task;
+    ngx_msec_t                posted;
+} ngx_thread_pool_cell_t;
+
+typedef struct {
+    ngx_thread_pool_cell_t   *cells;
+    ngx_atomic_uint_t         mask;
+
+    u_char                    pad0[NGX_CPU_CACHE_LINE];
+    ngx_atomic_t              tail;
+    u_char                    pad1[NGX_CPU_CACHE_LINE];
+    ngx_atomic_t              head;
+    u_char                    pad2[NGX_CPU_CACHE_LINE];
+} ngx_thread_pool_ring_t;
+
+/*
+ * A Chase-Lev deque of a thread in the work-stealing mode.  The posting
+ * event loop thread is the owner that pushes at the bottom, while the
+ * thread itself and its idle peers take from the top with a CAS, so each
+ * deque is drained in FIFO order.  The deque is bounded, a post moves on
+ * to the next thread if it is full.
+ */
+
+typedef struct {
+    ngx_thread_task_t        *task;
+    ngx_msec_t                posted;
+} ngx_thread_pool_slot_t;
+
+typedef struct {
+    ngx_thread_pool_slot_t   *slots;
+    ngx_atomic_uint_t         mask;
+
+    u_char                    pad0[NGX_CPU_CACHE_LINE];
+    ngx_atomic_t              top;
+    u_char                    pad1[NGX_CPU_CACHE_LINE];
+    ngx_atomic_t              bottom;
+    u_char                    pad2[NGX_CPU_CACHE_LINE];
+} ngx_thread_pool_deque_t;
+
+typedef struct {
+    ngx_thread_pool_t        *tp;
+    ngx_uint_t                index;
+
+    ngx_thread_pool_deque_t   deques[NGX_THREAD_TASK_PRIORITIES];
+
+    /* cleared by the thread when it exits */
+    volatile ngx_uint_t       running;
+
+    /* ngx_current_msec when the thread went idle, 0 while it is busy */
+    volatile ngx_msec_t       idle;
+
+    /* updated by the thread only */
+    ngx_uint_t                tasks;
+    ngx_uint_t                steals;
+    ngx_uint_t                expired;
+} ngx_thread_pool_thread_t;
+
+#define NGX_THREAD_POOL_MUTEX  0
+#define NGX_THREAD_POOL_RING   1
+#define NGX_THREAD_POOL_STEAL  2
+
+/* pops an idle thread tries before it is parked */
+#define NGX_THREAD_POOL_SPIN   64
+
+/* the default wait after which a lower priority task is served first */
+#define NGX_THREAD_POOL_AGING  1000
+
+/* how long tasks have to be waiting before a thread is added */
+#define NGX_THREAD_POOL_BACKLOG       100
+
+/* the default idle time after which an added thread exits */
+#define NGX_THREAD_POOL_IDLE_TIMEOUT  60000
+
 struct ngx_thread_pool_s
 {
     ngx_thread_mutex_t        mtx;
     ngx_thread_cond_t         cond;
-    ngx_thread_pool_queue_t   queue;
+    ngx_thread_pool_queue_t   queues[NGX_THREAD_TASK_PRIORITIES];
     ngx_int_t                 waiting;
 
+    /* threads waiting on cond in the mutex mode */
+    ngx_uint_t                idle;
+
+    ngx_uint_t                mode;
+    ngx_thread_pool_ring_t    rings[NGX_THREAD_TASK_PRIORITIES];
+    ngx_msec_t                aging;
+
+    ngx_thread_pool_thread_t *workers;
+
+    /* the deque the next task is posted to */
+    ngx_uint_t                next;
+
+    /* idle threads of the lock-free modes are parked on the futex word */
+    volatile uint32_t         futex;
+    ngx_atomic_t              sleepers;
+
+    /*
+     * The pool runs from threads up to max_threads threads, the thread
+     * slots are allocated for max_threads.  The fields are updated by
+     * the event loop thread only.
+     */
+    ngx_uint_t                running;
+    ngx_msec_t                backlog;
+    ngx_msec_t                idle_timeout;
+    ngx_uint_t                exiting;
+    ngx_event_t               resize;
+    ngx_thread_task_t         retire;
+    volatile ngx_uint_t       retiring;
+
+    /* set by a thread which found the queue empty, starts the backlog over */
+    volatile ngx_uint_t       drained;
+
     ngx_log_t                *log;
 
     ngx_str_t                 name;
     ngx_uint_t                threads;
+    ngx_uint_t                max_threads;
     ngx_int_t                 max_queue;
 
     u_char                   *file;
@@ -45,8 +165,33 @@ struct ngx_thread_pool_s
 static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool);
 static void ngx_thread_pool_destroy(ngx_thread_pool_t *tp);
 static void ngx_thread_pool_exit_handler(void *data, ngx_log_t *log);
+static ngx_int_t ngx_thread_pool_spawn(ngx_thread_pool_t *tp, ngx_thread_pool_thread_t *thr);
+static void ngx_thread_pool_grow(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_resize_handler(ngx_event_t *ev);
+static ngx_int_t ngx_thread_pool_waiting(ngx_thread_pool_t *tp);
+
+static ngx_int_t ngx_thread_pool_ring_init(ngx_thread_pool_t *tp, ngx_pool_t *pool);
+static ngx_int_t ngx_thread_pool_ring_push(ngx_thread_pool_ring_t *ring, ngx_thread_task_t *task, ngx_msec_t posted);
+static ngx_thread_task_t *ngx_thread_pool_ring_pop(ngx_thread_pool_ring_t *ring);
+static ngx_int_t ngx_thread_pool_ring_posted(ngx_thread_pool_ring_t *ring, ngx_msec_t *posted);
+static ngx_int_t ngx_thread_pool_queue_post(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks, ngx_uint_t n);
+static ngx_int_t ngx_thread_pool_ring_post(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks, ngx_uint_t n);
+static ngx_int_t ngx_thread_pool_deque_init(ngx_thread_pool_t *tp, ngx_pool_t *pool);
+static ngx_int_t ngx_thread_pool_deque_push(ngx_thread_pool_deque_t *deque, ngx_thread_task_t *task, ngx_msec_t posted);
+static ngx_thread_task_t *ngx_thread_pool_deque_take(ngx_thread_pool_deque_t *deque);
+static ngx_int_t ngx_thread_pool_deque_posted(ngx_thread_pool_deque_t *deque, ngx_msec_t *posted);
+static ngx_int_t ngx_thread_pool_steal_post(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks, ngx_uint_t n);
+static void ngx_thread_pool_wake(ngx_thread_pool_t *tp, ngx_uint_t n);
+static ngx_thread_task_t *ngx_thread_pool_queue_get(ngx_thread_pool_thread_t *thr);
+static ngx_thread_task_t *ngx_thread_pool_lockfree_get(ngx_thread_pool_thread_t *thr);
+static ngx_thread_task_t *ngx_thread_pool_take(ngx_thread_pool_thread_t *thr);
+static ngx_thread_task_t *ngx_thread_pool_take_priority(ngx_thread_pool_thread_t *thr, ngx_uint_t c);
+static ngx_int_t ngx_thread_pool_posted(ngx_thread_pool_thread_t *thr, ngx_uint_t c, ngx_msec_t *posted);
+static void ngx_thread_pool_park(ngx_thread_pool_t *tp, uint32_t seq);
+static void ngx_thread_pool_unpark(ngx_thread_pool_t *tp, ngx_uint_t n);
 
 static void *ngx_thread_pool_cycle(void *data);
+static void ngx_thread_pool_complete(ngx_thread_task_t *task);
 static void ngx_thread_pool_handler(ngx_event_t *ev);
 
 static char *ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
@@ -61,7 +206,7 @@ static void ngx_thread_pool_exit_worker(ngx_cycle_t *cycle);
 static ngx_command_t  ngx_thread_pool_commands[] = {
 
     { ngx_string("thread_pool"),
-      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE23,
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_1MORE,
       ngx_thread_pool,
       0,
       0,
@@ -97,8 +242,13 @@ ngx_module_t  ngx_thread_pool_module = {
 static ngx_str_t  ngx_thread_pool_default = ngx_string("default");
 
 static ngx_uint_t               ngx_thread_pool_task_id;
-static ngx_atomic_t             ngx_thread_pool_done_lock;
-static ngx_thread_pool_queue_t  ngx_thread_pool_done;
+
+/*
+ * Completed tasks are pushed by the threads to a lock-free stack, which
+ * is taken as a whole by ngx_thread_pool_handler(), so the stack is
+ * a list of ngx_thread_task_t linked in the reverse order of completion.
+ */
+static ngx_atomic_t             ngx_thread_pool_done;
 
 static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool)
 {
@@ -109,7 +259,9 @@ static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx
         return NGX_ERROR;
     }
 
-    ngx_thread_pool_queue_init(&tp->queue);
+    for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++) {
+        ngx_thread_pool_queue_init(&tp->queues[c]);
+    }
 
     if (ngx_thread_mutex_create(&tp->mtx, log) != NGX_OK) {
         return NGX_ERROR;
@@ -120,36 +272,87 @@ static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx
         return NGX_ERROR;
     }
 
+    tp->workers = ngx_pcalloc(pool, tp->max_threads * sizeof(ngx_thread_pool_thread_t));
+    if (tp->workers == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (ngx_uint_t n = 0; n < tp->max_threads; n++)
+    {
+        tp->workers[n].tp = tp;
+        tp->workers[n].index = n;
+    }
+
+    if (tp->mode == NGX_THREAD_POOL_RING
+        && ngx_thread_pool_ring_init(tp, pool) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (tp->mode == NGX_THREAD_POOL_STEAL
+        && ngx_thread_pool_deque_init(tp, pool) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     tp->log = log;
 
+    tp->resize.handler = ngx_thread_pool_resize_handler;
+    tp->resize.data = tp;
+    tp->resize.log = log;
+    tp->resize.cancelable = 1;
+
+    tp->running = 0;
+    tp->backlog = 0;
+    tp->exiting = 0;
+    tp->retiring = 0;
+    tp->drained = 0;
+
+    for (ngx_uint_t n = 0; n < tp->threads; n++)
+    {
+        if (ngx_thread_pool_spawn(tp, &tp->workers[n]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_thread_pool_spawn(ngx_thread_pool_t *tp, ngx_thread_pool_thread_t *thr)
+{
     pthread_attr_t  attr;
     int err = pthread_attr_init(&attr);
     if (err) {
-        ngx_log_error(NGX_LOG_ALERT, log, err,
+        ngx_log_error(NGX_LOG_ALERT, tp->log, err,
                       "pthread_attr_init() failed");
         return NGX_ERROR;
     }
 
     err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     if (err) {
-        ngx_log_error(NGX_LOG_ALERT, log, err,
+        ngx_log_error(NGX_LOG_ALERT, tp->log, err,
                       "pthread_attr_setdetachstate() failed");
+        (void) pthread_attr_destroy(&attr);
         return NGX_ERROR;
     }
 
+    thr->running = 1;
+    thr->idle = 0;
+
     pthread_t       tid;
-    for (ngx_uint_t　n = 0; n < tp->threads; n++)
-    {
-        err = pthread_create(&tid, &attr, ngx_thread_pool_cycle, tp);
-        if (err) {
-            ngx_log_error(NGX_LOG_ALERT, log, err,
-                          "pthread_create() failed");
-            return NGX_ERROR;
-        }
-    }
+    err = pthread_create(&tid, &attr, ngx_thread_pool_cycle, thr);
 
     (void) pthread_attr_destroy(&attr);
 
+    if (err) {
+        thr->running = 0;
+        ngx_log_error(NGX_LOG_ALERT, tp->log, err,
+                      "pthread_create() failed");
+        return NGX_ERROR;
+    }
+
+    tp->running++;
+
     return NGX_OK;
 }
 
@@ -160,9 +363,26 @@ static void ngx_thread_pool_destroy(ngx_thread_pool_t *tp)
 
     task.handler = ngx_thread_pool_exit_handler;
 
+    /* the threads exit after the tasks already posted */
+    task.priority = NGX_THREAD_TASK_LOW;
+
+    /* the exit tasks must neither grow the pool nor arm the resize timer */
+    tp->exiting = 1;
+
+    if (tp->resize.timer_set) {
+        ngx_del_timer(&tp->resize);
+    }
+
+    /* a retiring thread is already gone from tp->running */
+
+    while (tp->retiring)
+    {
+        ngx_sched_yield();
+    }
+
     volatile ngx_uint_t  lock;
     task.ctx = (void *) &lock;
-    for (ngx_uint_t n = 0; n < tp->threads; n++)
+    for (ngx_uint_t n = 0; n < tp->running; n++)
     {
         lock = 1;
 
@@ -188,234 +408,1131 @@ static void ngx_thread_pool_exit_handler(void *data, ngx_log_t *log)
     pthread_exit(0);
 }
 
-ngx_thread_task_t* ngx_thread_task_alloc(ngx_pool_t *pool, size_t size)
-{
-    ngx_thread_task_t* task = ngx_pcalloc(pool, sizeof(ngx_thread_task_t) + size);
-    if (task == NULL)
-        return NULL;
-
-    task->ctx = task + 1;
-    return task;
-}
+/*
+ * A thread is added when tasks have been waiting for NGX_THREAD_POOL_BACKLOG,
+ * one at a time, checked on each post.  The wait must be uninterrupted: a
+ * thread that finds the queue empty in between starts the backlog over,
+ * however busy the pool is at the posts.
+ */
 
-ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+static void ngx_thread_pool_grow(ngx_thread_pool_t *tp)
 {
-    if (task->event.active)
-    {
-        ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
-                      "task #%ui already active", task->id);
-        return NGX_ERROR;
+    if (tp->exiting) {
+        return;
     }
 
-    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
-        return NGX_ERROR;
+    if (tp->drained)
+    {
+        tp->drained = 0;
+        tp->backlog = 0;
     }
 
-    if (tp->waiting >= tp->max_queue)
+    if (ngx_thread_pool_waiting(tp) <= 0)
     {
-        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+        tp->backlog = 0;
+        return;
+    }
 
-        ngx_log_error(NGX_LOG_ERR, tp->log, 0,
-                      "thread pool \"%V\" queue overflow: %i tasks waiting",
-                      &tp->name, tp->waiting);
-        return NGX_ERROR;
+    ngx_msec_t now = ngx_current_msec;
+
+    if (tp->backlog == 0)
+    {
+        tp->backlog = now;
+        return;
     }
 
-    task->event.active = 1;
+    if ((ngx_msec_int_t) (now - tp->backlog) < NGX_THREAD_POOL_BACKLOG) {
+        return;
+    }
 
-    task->id = ngx_thread_pool_task_id++;
-    task->next = NULL;
+    tp->backlog = now;
 
-    if (ngx_thread_cond_signal(&tp->cond, tp->log) != NGX_OK)
+    for (ngx_uint_t n = 0; n < tp->max_threads; n++)
     {
-        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
-        return NGX_ERROR;
-    }
+        ngx_thread_pool_thread_t *thr = &tp->workers[n];
 
-    // build a singly linked list
-    *tp->queue.last = task;
-    tp->queue.last = &task->next;
+        if (thr->running) {
+            continue;
+        }
 
-    tp->waiting++;
+        if (ngx_thread_pool_spawn(tp, thr) != NGX_OK) {
+            return;
+        }
 
-    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+        ngx_log_error(NGX_LOG_INFO, tp->log, 0,
+                      "thread pool \"%V\" grows to %ui threads",
+                      &tp->name, tp->running);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
-                   "task #%ui added to thread pool \"%V\"",
-                   task->id, &tp->name);
+        if (!tp->resize.timer_set) {
+            ngx_add_timer(&tp->resize, tp->idle_timeout);
+        }
 
-    return NGX_OK;
+        return;
+    }
 }
 
+/*
+ * Threads over the minimum that have been idle for idle_timeout exit
+ * one at a time through an exit task, as on pool destruction.
+ */
 
-static void* ngx_thread_pool_cycle(void *data)
+static void ngx_thread_pool_resize_handler(ngx_event_t *ev)
 {
-    ngx_thread_pool_t *tp = data;
-    ngx_log_debug1(NGX_LOG_DEBUG_CORE, tp->log, 0,
-                   "thread in pool \"%V\" started", &tp->name);
+    ngx_thread_pool_t *tp = ev->data;
 
-    sigset_t set;
-    sigfillset(&set);
-    sigdelset(&set, SIGILL);
-    sigdelset(&set, SIGFPE);
-    sigdelset(&set, SIGSEGV);
-    sigdelset(&set, SIGBUS);
+    if (tp->running <= tp->threads) {
+        return;
+    }
 
-    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+    if (tp->retiring)
     {
-        ngx_log_error(NGX_LOG_ALERT, tp->log, err, "pthread_sigmask() failed");
-        return NULL;
+        ngx_add_timer(ev, NGX_THREAD_POOL_BACKLOG);
+        return;
     }
 
-    for ( ;; )
-    {
-        if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
-            return NULL;
-        }
+    ngx_msec_t now = ngx_current_msec;
+    ngx_msec_t timer = tp->idle_timeout;
 
-        /* the number may become negative */
-        tp->waiting--;
+    for (ngx_uint_t n = 0; n < tp->max_threads; n++)
+    {
+        ngx_thread_pool_thread_t *thr = &tp->workers[n];
+        ngx_msec_t idle = thr->idle;
 
-        while (tp->queue.first == NULL)
+        if (!thr->running || idle == 0
+            || (ngx_msec_int_t) (now - idle) < (ngx_msec_int_t) tp->idle_timeout)
         {
-            if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log)
-                != NGX_OK)
-            {
-                (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
-                return NULL;
-            }
-        }
-
-        ngx_thread_task_t* task = tp->queue.first;
-        tp->queue.first = task->next;
-
-        if (tp->queue.first == NULL) {
-            tp->queue.last = &tp->queue.first;
-        }
-
-        if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
-            return NULL;
+            continue;
         }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
-                       "run task #%ui in thread pool \"%V\"",
-                       task->id, &tp->name);
-
-        // handler set by callers
-        task->handler(task->ctx, tp->log);
+        ngx_thread_task_t *task = &tp->retire;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
-                       "complete task #%ui in thread pool \"%V\"",
-                       task->id, &tp->name);
+        ngx_memzero(task, sizeof(ngx_thread_task_t));
 
-        task->next = NULL;
+        task->handler = ngx_thread_pool_exit_handler;
+        task->ctx = (void *) &tp->retiring;
+        task->priority = NGX_THREAD_TASK_NORMAL;
 
-        ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+        tp->retiring = 1;
 
-        *ngx_thread_pool_done.last = task;
-        ngx_thread_pool_done.last = &task->next;
+        if (ngx_thread_task_post(tp, task) != NGX_OK)
+        {
+            tp->retiring = 0;
+            break;
+        }
 
-        ngx_memory_barrier();
+        tp->running--;
 
-        ngx_unlock(&ngx_thread_pool_done_lock);
+        ngx_log_error(NGX_LOG_INFO, tp->log, 0,
+                      "thread pool \"%V\" shrinks to %ui threads",
+                      &tp->name, tp->running);
 
-        (void) ngx_notify(ngx_thread_pool_handler);
+        /* the next idle thread is looked for soon */
+        timer = NGX_THREAD_POOL_BACKLOG;
+        break;
     }
-}
-
-static void ngx_thread_pool_handler(ngx_event_t *ev)
-{
-    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "thread pool handler");
-
-    ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
 
-    ngx_thread_task_t* task = ngx_thread_pool_done.first;
-    ngx_thread_pool_done.first = NULL;
-    ngx_thread_pool_done.last = &ngx_thread_pool_done.first;
+    ngx_add_timer(ev, timer);
+}
 
-    ngx_memory_barrier();
+/* tasks not taken by a thread yet, negative if there are idle threads */
 
-    ngx_unlock(&ngx_thread_pool_done_lock);
+static ngx_int_t ngx_thread_pool_waiting(ngx_thread_pool_t *tp)
+{
+    ngx_int_t waiting = 0;
 
-    while (task)
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
-                       "run completion handler for task #%ui", task->id);
+    switch (tp->mode) {
 
-        ngx_event_t* event = &task->event;
-        task = task->next;
+    case NGX_THREAD_POOL_RING:
+        for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++) {
+            waiting += tp->rings[c].tail - tp->rings[c].head;
+        }
+        break;
 
-        event->complete = 1;
-        event->active = 0;
+    case NGX_THREAD_POOL_STEAL:
+        for (ngx_uint_t n = 0; n < tp->max_threads; n++)
+        {
+            for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++) {
+                waiting += tp->workers[n].deques[c].bottom - tp->workers[n].deques[c].top;
+            }
+        }
+        break;
 
-        event->handler(event);
+    default: /* NGX_THREAD_POOL_MUTEX */
+        return tp->waiting;
     }
+
+    return waiting - (ngx_int_t) tp->sleepers;
 }
 
-static void* ngx_thread_pool_create_conf(ngx_cycle_t *cycle)
+ngx_thread_task_t* ngx_thread_task_alloc(ngx_pool_t *pool, size_t size)
 {
-    ngx_thread_pool_conf_t* tcf = ngx_pcalloc(cycle->pool, sizeof(ngx_thread_pool_conf_t));
-    if (tcf == NULL)
-        return NULL;
-
-    if (ngx_array_init(&tcf->pools, cycle->pool, 4,
-        sizeof(ngx_thread_pool_t*))
-        != NGX_OK)
-    {
+    ngx_thread_task_t* task = ngx_pcalloc(pool, sizeof(ngx_thread_task_t) + size);
+    if (task == NULL)
         return NULL;
-    }
 
-    return tcf;
+    task->ctx = task + 1;
+    task->priority = NGX_THREAD_TASK_NORMAL;
+    return task;
 }
 
-static char* ngx_thread_pool_init_conf(ngx_cycle_t *cycle, void *conf)
+ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
 {
-    ngx_thread_pool_conf_t *tcf = conf;
-    ngx_thread_pool_t  **tpp = tcf->pools.elts;
+    return ngx_thread_task_post_n(tp, &task, 1);
+}
 
-    for (ngx_uint_t i = 0; i < tcf->pools.nelts; i++)
-    {
-        if (tpp[i]->threads)
-            continue;
+/*
+ * Posts a batch of tasks at once: the queue is locked or checked for room
+ * once, and at most n idle threads are woken up.  Either all the tasks
+ * are posted or none of them.
+ */
 
-        if (tpp[i]->name.len == ngx_thread_pool_default.len
-            && ngx_strncmp(tpp[i]->name.data, ngx_thread_pool_default.data,
-                           ngx_thread_pool_default.len) == 0)
+ngx_int_t ngx_thread_task_post_n(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks, ngx_uint_t n)
+{
+    for (ngx_uint_t i = 0; i < n; i++)
+    {
+        if (tasks[i]->event.active)
         {
-            tpp[i]->threads = 32;
-            tpp[i]->max_queue = 65536;
-            continue;
+            ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
+                          "task #%ui already active", tasks[i]->id);
+            return NGX_ERROR;
         }
 
-        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
-                      "unknown thread pool \"%V\" in %s:%ui",
-                      &tpp[i]->name, tpp[i]->file, tpp[i]->line);
+        if (tasks[i]->priority >= NGX_THREAD_TASK_PRIORITIES)
+        {
+            ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
+                          "task #%ui has invalid priority %ui",
+                          tasks[i]->id, tasks[i]->priority);
+            return NGX_ERROR;
+        }
+    }
 
-        return NGX_CONF_ERROR;
+    if (n == 0) {
+        return NGX_OK;
     }
 
-    return NGX_CONF_OK;
-}
+    ngx_int_t rc;
 
+    switch (tp->mode) {
 
-static char* ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_str_t* value = cf->args->elts;
-    ngx_thread_pool_t* tp = ngx_thread_pool_add(cf, &value[1]);
-    if (tp == NULL) {
-        return NGX_CONF_ERROR;
+    case NGX_THREAD_POOL_RING:
+        rc = ngx_thread_pool_ring_post(tp, tasks, n);
+        break;
+
+    case NGX_THREAD_POOL_STEAL:
+        rc = ngx_thread_pool_steal_post(tp, tasks, n);
+        break;
+
+    default: /* NGX_THREAD_POOL_MUTEX */
+        rc = ngx_thread_pool_queue_post(tp, tasks, n);
     }
 
-    if (tp->threads)
-    {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "duplicate thread pool \"%V\"", &tp->name);
-        return NGX_CONF_ERROR;
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    tp->max_queue = 65536;
+    if (tp->running < tp->max_threads) {
+        ngx_thread_pool_grow(tp);
+    }
 
-    for (ngx_uint_t i = 2; i < cf->args->nelts; i++)
+#if (NGX_DEBUG)
+    for (ngx_uint_t i = 0; i < n; i++)
+    {
+        ngx_log_debug3(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                       "task #%ui added to thread pool \"%V\" with priority %ui",
+                       tasks[i]->id, &tp->name, tasks[i]->priority);
+    }
+#endif
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_thread_pool_queue_post(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks, ngx_uint_t n)
+{
+    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (tp->waiting + (ngx_int_t) n > tp->max_queue)
+    {
+        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+
+        ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+                      "thread pool \"%V\" queue overflow: %i tasks waiting",
+                      &tp->name, tp->waiting);
+        return NGX_ERROR;
+    }
+
+    /* a single signal or a broadcast, for as many threads as wait */
+
+    ngx_int_t rc = NGX_OK;
+
+    if (tp->idle > n)
+    {
+        for (ngx_uint_t i = 0; i < n && rc == NGX_OK; i++) {
+            rc = ngx_thread_cond_signal(&tp->cond, tp->log);
+        }
+    }
+    else if (tp->idle)
+    {
+        rc = ngx_thread_cond_broadcast(&tp->cond, tp->log);
+    }
+
+    if (rc != NGX_OK)
+    {
+        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+        return NGX_ERROR;
+    }
+
+    // build a singly linked list per priority
+    for (ngx_uint_t i = 0; i < n; i++)
+    {
+        ngx_thread_task_t *task = tasks[i];
+        ngx_thread_pool_queue_t *queue = &tp->queues[task->priority];
+
+        task->event.active = 1;
+        task->event.timedout = 0;
+
+        task->id = ngx_thread_pool_task_id++;
+        task->next = NULL;
+        task->posted = ngx_current_msec;
+
+        *queue->last = task;
+        queue->last = &task->next;
+    }
+
+    tp->waiting += n;
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+
+    return NGX_OK;
+}
+
+/*
+ * The lock-free post: a ring per priority is bounded by max_queue rounded
+ * up to a power of two, and parked threads are woken up only if there are any.
+ */
+
+static ngx_int_t ngx_thread_pool_ring_post(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks, ngx_uint_t n)
+{
+    ngx_uint_t count[NGX_THREAD_TASK_PRIORITIES];
+
+    ngx_memzero(count, sizeof(count));
+
+    for (ngx_uint_t i = 0; i < n; i++) {
+        count[tasks[i]->priority]++;
+    }
+
+    for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++)
+    {
+        ngx_thread_pool_ring_t *ring = &tp->rings[c];
+        ngx_atomic_uint_t waiting = ring->tail - ring->head;
+
+        if (waiting + count[c] > ring->mask + 1)
+        {
+            ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+                          "thread pool \"%V\" queue overflow: %i tasks waiting",
+                          &tp->name, (ngx_int_t) waiting);
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_msec_t posted = ngx_current_msec;
+
+    for (ngx_uint_t i = 0; i < n; i++)
+    {
+        ngx_thread_task_t *task = tasks[i];
+
+        task->event.active = 1;
+        task->event.timedout = 0;
+        task->id = ngx_thread_pool_task_id++;
+
+        /*
+         * there is room for the batch, a push may only fail for a cell
+         * whose task has been taken but is not yet released by the thread
+         */
+
+        while (ngx_thread_pool_ring_push(&tp->rings[task->priority], task, posted) != NGX_OK) {
+            ngx_cpu_pause();
+        }
+    }
+
+    ngx_thread_pool_wake(tp, n);
+
+    return NGX_OK;
+}
+
+/* tasks are spread round-robin over the deques of the threads */
+
+static ngx_int_t ngx_thread_pool_steal_post(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks, ngx_uint_t n)
+{
+    ngx_uint_t count[NGX_THREAD_TASK_PRIORITIES];
+    ngx_uint_t room[NGX_THREAD_TASK_PRIORITIES];
+    ngx_int_t waiting = 0;
+
+    ngx_memzero(count, sizeof(count));
+    ngx_memzero(room, sizeof(room));
+
+    for (ngx_uint_t i = 0; i < n; i++) {
+        count[tasks[i]->priority]++;
+    }
+
+    for (ngx_uint_t i = 0; i < tp->max_threads; i++)
+    {
+        for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++)
+        {
+            ngx_thread_pool_deque_t *deque = &tp->workers[i].deques[c];
+            ngx_atomic_uint_t depth = deque->bottom - deque->top;
+
+            room[c] += deque->mask + 1 - depth;
+            waiting += depth;
+        }
+    }
+
+    for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++)
+    {
+        if (count[c] > room[c])
+        {
+            ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+                          "thread pool \"%V\" queue overflow: %i tasks waiting",
+                          &tp->name, waiting);
+            return NGX_ERROR;
+        }
+    }
+
+    /* the deques only drain meanwhile, so each task finds a deque with room */
+
+    ngx_msec_t posted = ngx_current_msec;
+
+    for (ngx_uint_t i = 0; i < n; i++)
+    {
+        ngx_thread_task_t *task = tasks[i];
+
+        task->event.active = 1;
+        task->event.timedout = 0;
+        task->id = ngx_thread_pool_task_id++;
+
+        /*
+         * the deques of the exited threads are skipped while there
+         * is room elsewhere, the tasks left there are stolen anyway
+         */
+
+        for (ngx_uint_t k = 0; /* void */; k++)
+        {
+            ngx_thread_pool_thread_t *thr = &tp->workers[tp->next];
+
+            if (++tp->next == tp->max_threads) {
+                tp->next = 0;
+            }
+
+            if (!thr->running && k < tp->max_threads) {
+                continue;
+            }
+
+            if (ngx_thread_pool_deque_push(&thr->deques[task->priority], task, posted) == NGX_OK) {
+                break;
+            }
+        }
+    }
+
+    ngx_thread_pool_wake(tp, n);
+
+    return NGX_OK;
+}
+
+/*
+ * A locked read of sleepers orders it after the push, a thread going
+ * to be parked either sees the tasks or is counted here.
+ */
+
+static void ngx_thread_pool_wake(ngx_thread_pool_t *tp, ngx_uint_t n)
+{
+    ngx_atomic_uint_t sleepers = ngx_atomic_fetch_add(&tp->sleepers, 0);
+
+    if (sleepers) {
+        ngx_thread_pool_unpark(tp, ngx_min(n, sleepers));
+    }
+}
+
+static ngx_int_t ngx_thread_pool_ring_init(ngx_thread_pool_t *tp, ngx_pool_t *pool)
+{
+    ngx_uint_t size = 1;
+    while (size < (ngx_uint_t) tp->max_queue || size < tp->max_threads) {
+        size <<= 1;
+    }
+
+    for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++)
+    {
+        ngx_thread_pool_ring_t *ring = &tp->rings[c];
+
+        ring->cells = ngx_palloc(pool, size * sizeof(ngx_thread_pool_cell_t));
+        if (ring->cells == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (ngx_uint_t i = 0; i < size; i++)
+        {
+            ring->cells[i].seq = i;
+            ring->cells[i].task = NULL;
+        }
+
+        ring->mask = size - 1;
+        ring->tail = 0;
+        ring->head = 0;
+    }
+
+    tp->futex = 0;
+    tp->sleepers = 0;
+
+    return NGX_OK;
+}
+
+/* the deques of a priority together keep about max_queue tasks */
+
+static ngx_int_t ngx_thread_pool_deque_init(ngx_thread_pool_t *tp, ngx_pool_t *pool)
+{
+    ngx_uint_t size = 64;
+    while (size * tp->threads < (ngx_uint_t) tp->max_queue) {
+        size <<= 1;
+    }
+
+    for (ngx_uint_t n = 0; n < tp->max_threads; n++)
+    {
+        for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++)
+        {
+            ngx_thread_pool_deque_t *deque = &tp->workers[n].deques[c];
+
+            deque->slots = ngx_palloc(pool, size * sizeof(ngx_thread_pool_slot_t));
+            if (deque->slots == NULL) {
+                return NGX_ERROR;
+            }
+
+            deque->mask = size - 1;
+            deque->top = 0;
+            deque->bottom = 0;
+        }
+    }
+
+    tp->next = 0;
+    tp->futex = 0;
+    tp->sleepers = 0;
+
+    return NGX_OK;
+}
+
+/* called by the posting thread only, returns NGX_AGAIN if the deque is full */
+
+static ngx_int_t ngx_thread_pool_deque_push(ngx_thread_pool_deque_t *deque, ngx_thread_task_t *task, ngx_msec_t posted)
+{
+    ngx_atomic_uint_t b = deque->bottom;
+
+    if (b - deque->top > deque->mask) {
+        return NGX_AGAIN;
+    }
+
+    deque->slots[b & deque->mask].task = task;
+    deque->slots[b & deque->mask].posted = posted;
+    ngx_memory_barrier();
+    deque->bottom = b + 1;
+
+    return NGX_OK;
+}
+
+/*
+ * The steal operation of the deque, used by the owning thread as well:
+ * the slot at top cannot be reused by a push until top moves past it,
+ * so the task read is valid if the CAS succeeds.
+ */
+
+static ngx_thread_task_t *ngx_thread_pool_deque_take(ngx_thread_pool_deque_t *deque)
+{
+    for ( ;; )
+    {
+        ngx_atomic_uint_t t = deque->top;
+        ngx_memory_barrier();
+        ngx_atomic_uint_t b = deque->bottom;
+
+        if ((ngx_atomic_int_t) (b - t) <= 0) {
+            return NULL;
+        }
+
+        ngx_thread_task_t *task = deque->slots[t & deque->mask].task;
+
+        if (ngx_atomic_cmp_set(&deque->top, t, t + 1)) {
+            return task;
+        }
+
+        ngx_cpu_pause();
+    }
+}
+
+/*
+ * The post time of the oldest task, for aging only: it may be stale
+ * if the task is being taken meanwhile, but the slot is always readable.
+ */
+
+static ngx_int_t ngx_thread_pool_deque_posted(ngx_thread_pool_deque_t *deque, ngx_msec_t *posted)
+{
+    ngx_atomic_uint_t t = deque->top;
+    ngx_memory_barrier();
+
+    if ((ngx_atomic_int_t) (deque->bottom - t) <= 0) {
+        return NGX_DECLINED;
+    }
+
+    *posted = deque->slots[t & deque->mask].posted;
+
+    return NGX_OK;
+}
+
+/* returns NGX_AGAIN if the ring is full */
+
+static ngx_int_t ngx_thread_pool_ring_push(ngx_thread_pool_ring_t *ring, ngx_thread_task_t *task, ngx_msec_t posted)
+{
+    for ( ;; )
+    {
+        ngx_atomic_uint_t pos = ring->tail;
+        ngx_thread_pool_cell_t *cell = &ring->cells[pos & ring->mask];
+
+        ngx_atomic_int_t diff = (ngx_atomic_int_t) (cell->seq - pos);
+
+        if (diff == 0)
+        {
+            if (ngx_atomic_cmp_set(&ring->tail, pos, pos + 1))
+            {
+                cell->task = task;
+                cell->posted = posted;
+                ngx_memory_barrier();
+                cell->seq = pos + 1;
+                return NGX_OK;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* the cell still keeps a task from the previous round */
+            return NGX_AGAIN;
+        }
+
+        ngx_cpu_pause();
+    }
+}
+
+static ngx_thread_task_t *ngx_thread_pool_ring_pop(ngx_thread_pool_ring_t *ring)
+{
+    for ( ;; )
+    {
+        ngx_atomic_uint_t pos = ring->head;
+        ngx_thread_pool_cell_t *cell = &ring->cells[pos & ring->mask];
+
+        ngx_atomic_int_t diff = (ngx_atomic_int_t) (cell->seq - (pos + 1));
+
+        if (diff == 0)
+        {
+            if (ngx_atomic_cmp_set(&ring->head, pos, pos + 1))
+            {
+                ngx_thread_task_t *task = cell->task;
+                ngx_memory_barrier();
+                cell->seq = pos + ring->mask + 1;
+                return task;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* empty */
+            return NULL;
+        }
+
+        ngx_cpu_pause();
+    }
+}
+
+/* as ngx_thread_pool_deque_posted() */
+
+static ngx_int_t ngx_thread_pool_ring_posted(ngx_thread_pool_ring_t *ring, ngx_msec_t *posted)
+{
+    ngx_atomic_uint_t pos = ring->head;
+    ngx_thread_pool_cell_t *cell = &ring->cells[pos & ring->mask];
+
+    if (cell->seq != pos + 1) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memory_barrier();
+    *posted = cell->posted;
+
+    return NGX_OK;
+}
+
+static void* ngx_thread_pool_cycle(void *data)
+{
+    ngx_thread_pool_thread_t *thr = data;
+    ngx_thread_pool_t *tp = thr->tp;
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                   "thread in pool \"%V\" started", &tp->name);
+
+    sigset_t set;
+    sigfillset(&set);
+    sigdelset(&set, SIGILL);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+
+    int err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err)
+    {
+        ngx_log_error(NGX_LOG_ALERT, tp->log, err, "pthread_sigmask() failed");
+        return NULL;
+    }
+
+    for ( ;; )
+    {
+        ngx_thread_task_t* task = (tp->mode == NGX_THREAD_POOL_MUTEX) ? ngx_thread_pool_queue_get(thr)
+                                                                      : ngx_thread_pool_lockfree_get(thr);
+        if (task == NULL) {
+            thr->running = 0;
+            return NULL;
+        }
+
+        /* the slot may be reused as soon as the thread is about to exit */
+
+        if (task->handler == ngx_thread_pool_exit_handler) {
+            thr->running = 0;
+        }
+
+        /*
+         * a task whose deadline has passed before it started is not run,
+         * its completion handler sees event->timedout set
+         */
+
+        if (task->deadline
+            && (ngx_msec_int_t) (ngx_current_msec - task->deadline) >= 0)
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                           "cancel expired task #%ui in thread pool \"%V\"",
+                           task->id, &tp->name);
+
+            thr->expired++;
+            task->event.timedout = 1;
+
+            ngx_thread_pool_complete(task);
+            continue;
+        }
+
+        thr->tasks++;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                       "run task #%ui in thread pool \"%V\"",
+                       task->id, &tp->name);
+
+        // handler set by callers
+        task->handler(task->ctx, tp->log);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                       "complete task #%ui in thread pool \"%V\"",
+                       task->id, &tp->name);
+
+        ngx_thread_pool_complete(task);
+    }
+}
+
+static ngx_thread_task_t *ngx_thread_pool_queue_get(ngx_thread_pool_thread_t *thr)
+{
+    ngx_thread_pool_t *tp = thr->tp;
+
+    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+        return NULL;
+    }
+
+    /* the number may become negative */
+    tp->waiting--;
+
+    ngx_thread_task_t* task;
+
+    while ((task = ngx_thread_pool_take(thr)) == NULL)
+    {
+        tp->idle++;
+
+        if (thr->idle == 0) {
+            thr->idle = ngx_current_msec;
+            tp->drained = 1;
+        }
+
+        if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log)
+            != NGX_OK)
+        {
+            tp->idle--;
+            (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+            return NULL;
+        }
+
+        tp->idle--;
+    }
+
+    thr->idle = 0;
+
+    if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
+        return NULL;
+    }
+
+    return task;
+}
+
+/*
+ * An idle thread spins on the queues for a while, then registers itself
+ * in sleepers and checks the queues once more before it is parked, so
+ * a post either is seen here or sees the sleeper.
+ */
+
+static ngx_thread_task_t *ngx_thread_pool_lockfree_get(ngx_thread_pool_thread_t *thr)
+{
+    ngx_thread_pool_t *tp = thr->tp;
+
+    for ( ;; )
+    {
+        for (ngx_uint_t n = 0; n < NGX_THREAD_POOL_SPIN; n++)
+        {
+            ngx_thread_task_t *task = ngx_thread_pool_take(thr);
+            if (task)
+            {
+                thr->idle = 0;
+                return task;
+            }
+
+            ngx_cpu_pause();
+        }
+
+        uint32_t seq = tp->futex;
+
+        (void) ngx_atomic_fetch_add(&tp->sleepers, 1);
+
+        ngx_thread_task_t *task = ngx_thread_pool_take(thr);
+        if (task == NULL)
+        {
+            if (thr->idle == 0) {
+                thr->idle = ngx_current_msec;
+                tp->drained = 1;
+            }
+
+            ngx_thread_pool_park(tp, seq);
+        }
+
+        (void) ngx_atomic_fetch_add(&tp->sleepers, -1);
+
+        if (task)
+        {
+            thr->idle = 0;
+            return task;
+        }
+    }
+}
+
+/*
+ * Strict priority with aging: a lower priority whose oldest task has
+ * waited for tp->aging is served first, otherwise the highest non-empty
+ * priority is.  The mutex queues are taken under the pool mutex.
+ */
+
+static ngx_thread_task_t *ngx_thread_pool_take(ngx_thread_pool_thread_t *thr)
+{
+    ngx_thread_pool_t *tp = thr->tp;
+    ngx_thread_task_t *task;
+    ngx_uint_t c;
+
+    if (tp->aging)
+    {
+        ngx_msec_t now = ngx_current_msec;
+        ngx_msec_t posted;
+
+        for (c = NGX_THREAD_TASK_PRIORITIES - 1; c > 0; c--)
+        {
+            if (ngx_thread_pool_posted(thr, c, &posted) == NGX_OK
+                && (ngx_msec_int_t) (now - posted) >= (ngx_msec_int_t) tp->aging)
+            {
+                task = ngx_thread_pool_take_priority(thr, c);
+                if (task) {
+                    return task;
+                }
+            }
+        }
+    }
+
+    for (c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++)
+    {
+        task = ngx_thread_pool_take_priority(thr, c);
+        if (task) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+/* a thread takes from its own deque first, then from its peers in turn */
+
+static ngx_thread_task_t *ngx_thread_pool_take_priority(ngx_thread_pool_thread_t *thr, ngx_uint_t c)
+{
+    ngx_thread_pool_t *tp = thr->tp;
+    ngx_thread_task_t *task;
+
+    switch (tp->mode) {
+
+    case NGX_THREAD_POOL_RING:
+        return ngx_thread_pool_ring_pop(&tp->rings[c]);
+
+    case NGX_THREAD_POOL_STEAL:
+        break;
+
+    default: /* NGX_THREAD_POOL_MUTEX */
+
+        task = tp->queues[c].first;
+        if (task == NULL) {
+            return NULL;
+        }
+
+        tp->queues[c].first = task->next;
+
+        if (tp->queues[c].first == NULL) {
+            tp->queues[c].last = &tp->queues[c].first;
+        }
+
+        return task;
+    }
+
+    task = ngx_thread_pool_deque_take(&thr->deques[c]);
+    if (task) {
+        return task;
+    }
+
+    for (ngx_uint_t n = 1; n < tp->max_threads; n++)
+    {
+        ngx_uint_t i = thr->index + n;
+        if (i >= tp->max_threads) {
+            i -= tp->max_threads;
+        }
+
+        task = ngx_thread_pool_deque_take(&tp->workers[i].deques[c]);
+        if (task)
+        {
+            thr->steals++;
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * The post time of the oldest task of a priority.  The work-stealing mode
+ * looks at the own deque of the thread only, as the tasks are spread evenly.
+ */
+
+static ngx_int_t ngx_thread_pool_posted(ngx_thread_pool_thread_t *thr, ngx_uint_t c, ngx_msec_t *posted)
+{
+    ngx_thread_pool_t *tp = thr->tp;
+
+    switch (tp->mode) {
+
+    case NGX_THREAD_POOL_RING:
+        return ngx_thread_pool_ring_posted(&tp->rings[c], posted);
+
+    case NGX_THREAD_POOL_STEAL:
+        return ngx_thread_pool_deque_posted(&thr->deques[c], posted);
+
+    default: /* NGX_THREAD_POOL_MUTEX */
+
+        if (tp->queues[c].first == NULL) {
+            return NGX_DECLINED;
+        }
+
+        *posted = tp->queues[c].first->posted;
+
+        return NGX_OK;
+    }
+}
+
+/*
+ * The futex word is bumped by the posting thread on every wake up, a thread
+ * is parked only if it has not changed since the thread found the ring empty.
+ * Tasks are posted from the event loop thread only, as task ids are.  Other
+ * platforms park on the pool condition variable.
+ */
+
+static void ngx_thread_pool_park(ngx_thread_pool_t *tp, uint32_t seq)
+{
+#if (NGX_LINUX)
+
+    (void) syscall(SYS_futex, &tp->futex, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+
+#else
+
+    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+        return;
+    }
+
+    while (tp->futex == seq)
+    {
+        if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log) != NGX_OK) {
+            break;
+        }
+    }
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+
+#endif
+}
+
+static void ngx_thread_pool_unpark(ngx_thread_pool_t *tp, ngx_uint_t n)
+{
+#if (NGX_LINUX)
+
+    tp->futex++;
+    (void) syscall(SYS_futex, &tp->futex, FUTEX_WAKE_PRIVATE, (int) n, NULL, NULL, 0);
+
+#else
+
+    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+        return;
+    }
+
+    tp->futex++;
+
+    while (n--) {
+        (void) ngx_thread_cond_signal(&tp->cond, tp->log);
+    }
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+
+#endif
+}
+
+/*
+ * Only the first completion after the handler has taken the stack needs
+ * to notify the event loop, the later ones are taken along with it.
+ */
+
+static void ngx_thread_pool_complete(ngx_thread_task_t *task)
+{
+    ngx_atomic_uint_t head;
+
+    do {
+        head = ngx_thread_pool_done;
+        task->next = (ngx_thread_task_t *) head;
+
+    } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done, head, (ngx_atomic_uint_t) task));
+
+    if (head == 0) {
+        (void) ngx_notify(ngx_thread_pool_handler);
+    }
+}
+
+static void ngx_thread_pool_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "thread pool handler");
+
+    ngx_atomic_uint_t head;
+
+    do {
+        head = ngx_thread_pool_done;
+
+    } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done, head, 0));
+
+    /* the completion handlers are run in the order of completion */
+
+    ngx_thread_task_t *task = NULL;
+    ngx_thread_task_t *next = (ngx_thread_task_t *) head;
+
+    while (next)
+    {
+        ngx_thread_task_t *t = next;
+        next = t->next;
+        t->next = task;
+        task = t;
+    }
+
+    while (task)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                       "run completion handler for task #%ui", task->id);
+
+        ngx_event_t* event = &task->event;
+        task = task->next;
+
+        event->complete = 1;
+        event->active = 0;
+
+        event->handler(event);
+    }
+}
+
+static void* ngx_thread_pool_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_thread_pool_conf_t* tcf = ngx_pcalloc(cycle->pool, sizeof(ngx_thread_pool_conf_t));
+    if (tcf == NULL)
+        return NULL;
+
+    if (ngx_array_init(&tcf->pools, cycle->pool, 4,
+        sizeof(ngx_thread_pool_t*))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return tcf;
+}
+
+static char* ngx_thread_pool_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_thread_pool_conf_t *tcf = conf;
+    ngx_thread_pool_t  **tpp = tcf->pools.elts;
+
+    for (ngx_uint_t i = 0; i < tcf->pools.nelts; i++)
+    {
+        if (tpp[i]->threads)
+            continue;
+
+        if (tpp[i]->name.len == ngx_thread_pool_default.len
+            && ngx_strncmp(tpp[i]->name.data, ngx_thread_pool_default.data,
+                           ngx_thread_pool_default.len) == 0)
+        {
+            tpp[i]->threads = 32;
+            tpp[i]->max_threads = 32;
+            tpp[i]->max_queue = 65536;
+            tpp[i]->aging = NGX_THREAD_POOL_AGING;
+            tpp[i]->idle_timeout = NGX_THREAD_POOL_IDLE_TIMEOUT;
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "unknown thread pool \"%V\" in %s:%ui",
+                      &tpp[i]->name, tpp[i]->file, tpp[i]->line);
+
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char* ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t* value = cf->args->elts;
+    ngx_thread_pool_t* tp = ngx_thread_pool_add(cf, &value[1]);
+    if (tp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (tp->threads)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate thread pool \"%V\"", &tp->name);
+        return NGX_CONF_ERROR;
+    }
+
+    tp->max_queue = 65536;
+    tp->mode = NGX_THREAD_POOL_MUTEX;
+    tp->aging = NGX_THREAD_POOL_AGING;
+    tp->idle_timeout = NGX_THREAD_POOL_IDLE_TIMEOUT;
+
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++)
     {
         if (ngx_strncmp(value[i].data, "threads=", 8) == 0)
         {
@@ -430,6 +1547,38 @@ static char* ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "max_threads=", 12) == 0)
+        {
+            tp->max_threads = ngx_atoi(value[i].data + 12, value[i].len - 12);
+            if (tp->max_threads == (ngx_uint_t) NGX_ERROR || tp->max_threads == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_threads value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "idle_timeout=", 13) == 0)
+        {
+            ngx_str_t s;
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            ngx_int_t timeout = ngx_parse_time(&s, 0);
+            if (timeout == NGX_ERROR || timeout == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid idle_timeout value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            tp->idle_timeout = (ngx_msec_t) timeout;
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "max_queue=", 10) == 0)
         {
             tp->max_queue = ngx_atoi(value[i].data + 10, value[i].len - 10);
@@ -442,6 +1591,43 @@ static char* ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
             continue;
         }
+
+        if (ngx_strncmp(value[i].data, "aging=", 6) == 0)
+        {
+            ngx_str_t s;
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            ngx_int_t aging = ngx_parse_time(&s, 0);
+            if (aging == NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid aging value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            tp->aging = (ngx_msec_t) aging;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "queue=mutex") == 0)
+        {
+            tp->mode = NGX_THREAD_POOL_MUTEX;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "queue=ring") == 0)
+        {
+            tp->mode = NGX_THREAD_POOL_RING;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "queue=steal") == 0)
+        {
+            tp->mode = NGX_THREAD_POOL_STEAL;
+            continue;
+        }
     }
 
     if (tp->threads == 0)
@@ -452,6 +1638,17 @@ static char* ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (tp->max_threads == 0) {
+        tp->max_threads = tp->threads;
+    }
+
+    if (tp->max_threads < tp->threads)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"max_threads\" must not be less than \"threads\"");
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -487,6 +1684,42 @@ ngx_thread_pool_t* ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name)
     return tp;
 }
 
+/*
+ * Fills the counters of the thread slots of a running pool, up to
+ * max_threads, returns the number of entries filled.  The depth is the
+ * number of tasks waiting in the deques of a thread in the work-stealing
+ * mode, and 0 otherwise.
+ */
+
+ngx_uint_t ngx_thread_pool_stat(ngx_thread_pool_t *tp, ngx_thread_pool_stat_t *stat, ngx_uint_t n)
+{
+    if (tp->workers == NULL) {
+        return 0;
+    }
+
+    n = ngx_min(n, tp->max_threads);
+
+    for (ngx_uint_t i = 0; i < n; i++)
+    {
+        ngx_thread_pool_thread_t *thr = &tp->workers[i];
+
+        stat[i].depth = 0;
+
+        for (ngx_uint_t c = 0; tp->mode == NGX_THREAD_POOL_STEAL && c < NGX_THREAD_TASK_PRIORITIES; c++)
+        {
+            ngx_atomic_int_t depth = thr->deques[c].bottom - thr->deques[c].top;
+            stat[i].depth += depth > 0 ? depth : 0;
+        }
+
+        stat[i].running = thr->running;
+        stat[i].tasks = thr->tasks;
+        stat[i].steals = thr->steals;
+        stat[i].expired = thr->expired;
+    }
+
+    return n;
+}
+
 ngx_thread_pool_t* ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
 {
     ngx_thread_pool_conf_t* tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
@@ -519,7 +1752,7 @@ static ngx_int_t ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
         return NGX_OK;
     }
 
-    ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+    ngx_thread_pool_done = 0;
 
     ngx_thread_pool_t** tpp = tcf->pools.elts;
     for (ngx_uint_t i = 0; i < tcf->pools.nelts; i++)
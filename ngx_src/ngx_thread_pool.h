@@ -17,16 +17,46 @@ struct ngx_thread_task_s
     void                *ctx;
     void               (*handler)(void *data, ngx_log_t *log);
     ngx_event_t          event;
+
+    // one of NGX_THREAD_TASK_HIGH/NORMAL/LOW, NORMAL after ngx_thread_task_alloc()
+    ngx_uint_t           priority;
+
+    // ngx_current_msec past which the task is cancelled if not yet started,
+    // 0 for none; a cancelled task completes with event.timedout set
+    ngx_msec_t           deadline;
+
+    // set on post, for the aging of priorities
+    ngx_msec_t           posted;
 };
 
+#define NGX_THREAD_TASK_HIGH        0
+#define NGX_THREAD_TASK_NORMAL      1
+#define NGX_THREAD_TASK_LOW         2
+#define NGX_THREAD_TASK_PRIORITIES  3
+
 typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
+
+// per-thread counters, see ngx_thread_pool_stat()
+typedef struct {
+    ngx_uint_t           running;    // the slot has a running thread
+    ngx_uint_t           depth;      // tasks waiting in the thread deques
+    ngx_uint_t           tasks;      // tasks run by the thread
+    ngx_uint_t           steals;     // tasks taken from the peer deques
+    ngx_uint_t           expired;    // tasks cancelled past their deadline
+} ngx_thread_pool_stat_t;
+
 ngx_thread_task_t *ngx_thread_task_alloc(ngx_pool_t *pool, size_t size);
 
 // add one task to thread pool
 ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
 
+// add a batch of tasks with a single queue lock, all or none are added
+ngx_int_t ngx_thread_task_post_n(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks, ngx_uint_t n);
+
 // thread pool getter/setter
 ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
 ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
 
+ngx_uint_t ngx_thread_pool_stat(ngx_thread_pool_t *tp, ngx_thread_pool_stat_t *stat, ngx_uint_t n);
+
 #endif /* _NGX_THREAD_POOL_H_INCLUDED_ */
@@ -0,0 +1,279 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * A randomized test of ngx_btree_t against a bitmap of the keys, and a
+ * benchmark against ngx_rbtree_t for the same random keys.
+ *
+ *     ngx_btree_test fuzz [ops [seed]]
+ *     ngx_btree_test bench [keys]
+ */
+
+
+#define NGX_TEST_FUZZ_KEYS  5000
+
+
+static ngx_int_t ngx_test_check(ngx_btree_t *tree, u_char *present, ngx_uint_t count)
+{
+	ngx_btree_cursor_t c;
+	ngx_uint_t n = 0;
+	ngx_int_t prev = -1;
+
+	for (ngx_int_t rc = ngx_btree_min(tree, &c); rc == NGX_OK; rc = ngx_btree_next(&c))
+	{
+		ngx_int_t key = ngx_btree_cursor_key(&c);
+
+		if (key <= prev || !present[key] || ngx_btree_cursor_value(&c) != &present[key])
+		{
+			fprintf(stderr, "iteration broken at key %ld\n", (long) key);
+			return NGX_ERROR;
+		}
+
+		prev = key;
+		n++;
+	}
+
+	if (n != count || tree->count != count)
+	{
+		fprintf(stderr, "%lu keys iterated, %lu expected\n", (unsigned long) n, (unsigned long) count);
+		return NGX_ERROR;
+	}
+
+	for (ngx_uint_t key = 0; key < NGX_TEST_FUZZ_KEYS; key++)
+	{
+		if ((ngx_btree_find(tree, key) != NULL) != present[key])
+		{
+			fprintf(stderr, "find of key %lu is wrong\n", (unsigned long) key);
+			return NGX_ERROR;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_test_fuzz(ngx_uint_t ops, uint64_t seed)
+{
+	u_char present[NGX_TEST_FUZZ_KEYS];
+	ngx_uint_t count = 0;
+	uint64_t rnd = seed;
+
+	ngx_btree_t *tree = ngx_btree_create(NULL);
+	if (tree == NULL)
+		return NGX_ERROR;
+
+	ngx_memzero(present, sizeof(present));
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_uint_t key = ngx_test_random(&rnd) % NGX_TEST_FUZZ_KEYS;
+
+		if (ngx_test_random(&rnd) & 1)
+		{
+			ngx_int_t rc = ngx_btree_insert(tree, key, &present[key]);
+
+			if (rc != (present[key] ? NGX_BUSY : NGX_OK))
+			{
+				fprintf(stderr, "insert of key %lu returned %ld\n", (unsigned long) key, (long) rc);
+				return NGX_ERROR;
+			}
+
+			if (!present[key])
+				count++;
+
+			present[key] = 1;
+		}
+		else
+		{
+			ngx_int_t rc = ngx_btree_delete(tree, key);
+
+			if (rc != (present[key] ? NGX_OK : NGX_DECLINED))
+			{
+				fprintf(stderr, "delete of key %lu returned %ld\n", (unsigned long) key, (long) rc);
+				return NGX_ERROR;
+			}
+
+			if (present[key])
+				count--;
+
+			present[key] = 0;
+		}
+
+		if ((op % 1009 == 0 || op == ops - 1) && ngx_test_check(tree, present, count) != NGX_OK)
+		{
+			fprintf(stderr, "failed at operation %lu, seed %llu\n",
+					(unsigned long) op, (unsigned long long) seed);
+			return NGX_ERROR;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_rbtree_node_t *ngx_test_rbtree_find(ngx_rbtree_t *tree, ngx_rbtree_key_t key)
+{
+	ngx_rbtree_node_t *node = tree->root;
+	ngx_rbtree_node_t *sentinel = tree->sentinel;
+
+	while (node != sentinel)
+	{
+		if (key == node->key)
+			return node;
+
+		node = (key < node->key) ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+static void ngx_test_report(const char *name, ngx_uint_t ops, uint64_t ns)
+{
+	printf("%-28s %10lu ops %8.1f ns/op\n", name, (unsigned long) ops, (double) ns / ops);
+}
+
+/*
+ * The same n random unique keys go into both trees, and are then looked
+ * up in another random order, iterated in order and deleted.  The rbtree
+ * nodes are allocated one by one, as the users of ngx_rbtree_t do.
+ */
+
+static ngx_int_t ngx_test_bench(ngx_uint_t n)
+{
+	uint64_t rnd = 1;
+
+	ngx_btree_key_t *keys = malloc(n * sizeof(ngx_btree_key_t));
+	ngx_rbtree_node_t **nodes = malloc(n * sizeof(ngx_rbtree_node_t *));
+	if (keys == NULL || nodes == NULL)
+		return NGX_ERROR;
+
+	/* distinct keys: an odd multiplier is a bijection */
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		keys[i] = (i + 1) * 0x9E3779B97F4A7C15ULL;
+
+	ngx_btree_t *btree = ngx_btree_create(NULL);
+	if (btree == NULL)
+		return NGX_ERROR;
+
+	ngx_rbtree_t rbtree;
+	ngx_rbtree_node_t sentinel;
+	ngx_rbtree_init(&rbtree, &sentinel, ngx_rbtree_insert_value);
+
+	uint64_t start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		if (ngx_btree_insert(btree, keys[i], &keys[i]) != NGX_OK)
+			return NGX_ERROR;
+	}
+
+	ngx_test_report("btree insert", n, ngx_test_nsec() - start);
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		nodes[i] = malloc(sizeof(ngx_rbtree_node_t));
+		if (nodes[i] == NULL)
+			return NGX_ERROR;
+
+		nodes[i]->key = keys[i];
+		ngx_rbtree_insert(&rbtree, nodes[i]);
+	}
+
+	ngx_test_report("rbtree insert", n, ngx_test_nsec() - start);
+
+	/* shuffle the lookup order */
+
+	for (ngx_uint_t i = n - 1; i > 0; i--)
+	{
+		ngx_uint_t j = ngx_test_random(&rnd) % (i + 1);
+		ngx_btree_key_t k = keys[i];
+		keys[i] = keys[j];
+		keys[j] = k;
+	}
+
+	ngx_uint_t found = 0;
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		found += (ngx_btree_find(btree, keys[i]) != NULL);
+
+	ngx_test_report("btree find", n, ngx_test_nsec() - start);
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		found += (ngx_test_rbtree_find(&rbtree, keys[i]) != NULL);
+
+	ngx_test_report("rbtree find", n, ngx_test_nsec() - start);
+
+	ngx_btree_cursor_t c;
+
+	start = ngx_test_nsec();
+
+	for (ngx_int_t rc = ngx_btree_min(btree, &c); rc == NGX_OK; rc = ngx_btree_next(&c))
+		found++;
+
+	ngx_test_report("btree in-order walk", n, ngx_test_nsec() - start);
+
+	start = ngx_test_nsec();
+
+	for (ngx_rbtree_node_t *node = rbtree.leftmost; node != NULL && node != &sentinel; node = ngx_rbtree_next(&rbtree, node))
+		found++;
+
+	ngx_test_report("rbtree in-order walk", n, ngx_test_nsec() - start);
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		found += (ngx_btree_delete(btree, keys[i]) == NGX_OK);
+
+	ngx_test_report("btree delete", n, ngx_test_nsec() - start);
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		ngx_rbtree_node_t *node = ngx_test_rbtree_find(&rbtree, keys[i]);
+		ngx_rbtree_delete(&rbtree, node);
+		found++;
+	}
+
+	ngx_test_report("rbtree find+delete", n, ngx_test_nsec() - start);
+
+	if (found != 6 * n || btree->count != 0 || rbtree.root != &sentinel)
+	{
+		fprintf(stderr, "benchmark lost keys\n");
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		ngx_uint_t n = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1000000;
+
+		return (n && ngx_test_bench(n) == NGX_OK) ? 0 : 1;
+	}
+
+	ngx_uint_t ops = (argc > 2) ? strtoul(argv[2], NULL, 10) : 2000000;
+	uint64_t seed = (argc > 3) ? strtoull(argv[3], NULL, 10) : 1;
+
+	if (ngx_test_fuzz(ops, seed ? seed : 1) != NGX_OK)
+		return 1;
+
+	printf("btree fuzz: %lu operations ok\n", (unsigned long) ops);
+
+	return 0;
+}
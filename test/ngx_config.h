@@ -0,0 +1,62 @@
+
+/*
+ * A minimal stand-in for the generated ngx_config.h, just enough to build
+ * the sources under ngx_src/ outside of the nginx tree.
+ */
+
+
+#ifndef _NGX_CONFIG_H_INCLUDED_
+#define _NGX_CONFIG_H_INCLUDED_
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+
+
+#define NGX_DEBUG            1
+
+#if (__linux__)
+#define NGX_LINUX            1
+#endif
+
+#define NGX_HAVE_INET6       1
+
+#define NGX_CPU_CACHE_LINE   64
+
+#define ngx_inline           inline
+
+typedef intptr_t             ngx_int_t;
+typedef uintptr_t            ngx_uint_t;
+typedef unsigned char        u_char;
+
+typedef ngx_uint_t           ngx_msec_t;
+typedef ngx_int_t            ngx_msec_int_t;
+
+typedef volatile ngx_uint_t  ngx_atomic_t;
+typedef ngx_uint_t           ngx_atomic_uint_t;
+typedef ngx_int_t            ngx_atomic_int_t;
+
+#define ngx_memory_barrier()             __sync_synchronize()
+#define ngx_cpu_pause()                  __builtin_ia32_pause()
+#define ngx_atomic_cmp_set(lock, old, set)                                    \
+	__sync_bool_compare_and_swap(lock, old, set)
+#define ngx_atomic_fetch_add(value, add) __sync_fetch_and_add(value, add)
+
+#define ngx_sched_yield()                sched_yield()
+
+
+#endif /* _NGX_CONFIG_H_INCLUDED_ */
@@ -0,0 +1,497 @@
+
+/*
+ * A minimal stand-in for ngx_core.h: the status codes and the memory
+ * helpers used by the sources under test, with the pool functions
+ * mapped onto malloc().
+ */
+
+
+#ifndef _NGX_CORE_H_INCLUDED_
+#define _NGX_CORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+
+
+#define NGX_OK          0
+#define NGX_ERROR      -1
+#define NGX_AGAIN      -2
+#define NGX_BUSY       -3
+#define NGX_DECLINED   -5
+
+#define ngx_align(d, a)      (((d) + (a - 1)) & ~(a - 1))
+#define ngx_abs(value)       (((value) >= 0) ? (value) : - (value))
+#define ngx_min(val1, val2)  ((val1 > val2) ? (val2) : (val1))
+#define ngx_max(val1, val2)  ((val1 < val2) ? (val2) : (val1))
+
+#define ngx_memzero(buf, n)       (void) memset(buf, 0, n)
+#define ngx_memcpy(dst, src, n)   (void) memcpy(dst, src, n)
+#define ngx_memmove(dst, src, n)  (void) memmove(dst, src, n)
+#define ngx_memcmp(s1, s2, n)     memcmp(s1, s2, n)
+
+/* pools are not freed in the tests, allocations simply leak */
+
+typedef struct ngx_pool_s  ngx_pool_t;
+
+#define ngx_pagesize              4096
+#define ngx_cacheline_size        64
+
+#define ngx_palloc(pool, size)    malloc(size)
+#define ngx_pnalloc(pool, size)   malloc(size)
+#define ngx_pcalloc(pool, size)   calloc(1, size)
+#define ngx_pfree(pool, p)        (free(p), NGX_OK)
+
+static ngx_inline void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
+{
+	void *p;
+
+	return (posix_memalign(&p, alignment, size) == 0) ? p : NULL;
+}
+
+typedef struct {
+	size_t      len;
+	u_char     *data;
+} ngx_str_t;
+
+#define ngx_string(str)     { sizeof(str) - 1, (u_char *) str }
+
+#define ngx_null_string     { 0, NULL }
+
+#define ngx_strcmp(s1, s2)      strcmp((const char *) s1, (const char *) s2)
+#define ngx_strncmp(s1, s2, n)  strncmp((const char *) s1, (const char *) s2, n)
+
+#define CR     (u_char) '\r'
+#define LF     (u_char) '\n'
+
+static ngx_inline ngx_int_t ngx_atoi(u_char *line, size_t n)
+{
+	ngx_int_t value = 0;
+
+	if (n == 0)
+		return NGX_ERROR;
+
+	for ( ; n--; line++)
+	{
+		if (*line < '0' || *line > '9')
+			return NGX_ERROR;
+
+		value = value * 10 + (*line - '0');
+	}
+
+	return value;
+}
+
+/* milliseconds, with the "ms" and "s" units only */
+
+static ngx_inline ngx_int_t ngx_parse_time(ngx_str_t *line, ngx_uint_t is_sec)
+{
+	size_t len = line->len;
+	ngx_int_t scale = 1000;
+
+	if (len > 2 && ngx_strncmp(line->data + len - 2, "ms", 2) == 0)
+	{
+		len -= 2;
+		scale = 1;
+	}
+	else if (len > 1 && line->data[len - 1] == 's')
+	{
+		len--;
+	}
+
+	ngx_int_t value = ngx_atoi(line->data, len);
+
+	return (value == NGX_ERROR) ? NGX_ERROR : value * scale;
+}
+
+/*
+ * The log prints the format of warnings and errors only, the nginx
+ * conversions are not supported.
+ */
+
+typedef struct ngx_log_s  ngx_log_t;
+
+#define NGX_LOG_EMERG   1
+#define NGX_LOG_ALERT   2
+#define NGX_LOG_ERR     4
+#define NGX_LOG_WARN    5
+#define NGX_LOG_NOTICE  6
+#define NGX_LOG_INFO    7
+
+#define ngx_log_error(level, log, err, fmt, ...)                              \
+	(void) ((level) <= NGX_LOG_WARN && fprintf(stderr, "%s\n", fmt))
+
+#define ngx_conf_log_error(level, cf, err, fmt, ...)                          \
+	ngx_log_error(level, NULL, err, fmt)
+
+#define NGX_LOG_DEBUG_CORE  0x010
+#define NGX_LOG_DEBUG_EVENT 0x080
+
+#define ngx_log_debug0(level, log, err, fmt)
+#define ngx_log_debug1(level, log, err, fmt, arg1)
+#define ngx_log_debug2(level, log, err, fmt, arg1, arg2)
+#define ngx_log_debug3(level, log, err, fmt, arg1, arg2, arg3)
+
+typedef int                 ngx_err_t;
+
+#define ngx_errno                 errno
+#define NGX_EAGAIN                EAGAIN
+
+#define ngx_free                  free
+
+/* defined by the tests which use it, so that a test may make it fail */
+void *ngx_memalign(size_t alignment, size_t size, ngx_log_t *log);
+
+typedef struct {
+	void       *elts;
+	ngx_uint_t  nelts;
+	size_t      size;
+	ngx_uint_t  nalloc;
+	ngx_pool_t *pool;
+} ngx_array_t;
+
+static ngx_inline ngx_int_t ngx_array_init(ngx_array_t *array, ngx_pool_t *pool, ngx_uint_t n, size_t size)
+{
+	array->nelts = 0;
+	array->size = size;
+	array->nalloc = n;
+	array->pool = pool;
+	array->elts = malloc(n * size);
+
+	return (array->elts == NULL) ? NGX_ERROR : NGX_OK;
+}
+
+static ngx_inline ngx_array_t *ngx_array_create(ngx_pool_t *pool, ngx_uint_t n, size_t size)
+{
+	ngx_array_t *a = malloc(sizeof(ngx_array_t));
+
+	return (a == NULL || ngx_array_init(a, pool, n, size) != NGX_OK) ? NULL : a;
+}
+
+static ngx_inline void *ngx_array_push(ngx_array_t *a)
+{
+	if (a->nelts == a->nalloc)
+	{
+		void *elts = realloc(a->elts, 2 * a->nalloc * a->size);
+		if (elts == NULL)
+			return NULL;
+
+		a->elts = elts;
+		a->nalloc *= 2;
+	}
+
+	return (u_char *) a->elts + a->size * a->nelts++;
+}
+
+typedef struct ngx_list_part_s  ngx_list_part_t;
+
+struct ngx_list_part_s {
+	void            *elts;
+	ngx_uint_t       nelts;
+	ngx_list_part_t *next;
+};
+
+typedef struct {
+	ngx_list_part_t *last;
+	ngx_list_part_t  part;
+	size_t           size;
+	ngx_uint_t       nalloc;
+	ngx_pool_t      *pool;
+} ngx_list_t;
+
+/*
+ * Shared memory zones are plain memory set up by the test, as
+ * ngx_init_cycle() does: it allocates shm.addr and calls the init of the
+ * zone.  The slab pool only keeps the data pointer, the slab allocations
+ * leak as the pool ones do.
+ */
+
+typedef struct {
+	u_char      *addr;
+	size_t       size;
+	ngx_str_t    name;
+	ngx_log_t   *log;
+	ngx_uint_t   exists;
+} ngx_shm_t;
+
+typedef struct ngx_shm_zone_s  ngx_shm_zone_t;
+
+typedef ngx_int_t (*ngx_shm_zone_init_pt) (ngx_shm_zone_t *zone, void *data);
+
+struct ngx_shm_zone_s {
+	void                  *data;
+	ngx_shm_t              shm;
+	ngx_shm_zone_init_pt   init;
+	void                  *tag;
+};
+
+typedef struct {
+	void        *data;
+} ngx_slab_pool_t;
+
+#define ngx_slab_calloc(pool, size)  calloc(1, size)
+
+typedef struct {
+	void       **conf_ctx;
+	ngx_pool_t  *pool;
+	ngx_log_t   *log;
+	ngx_list_t   shared_memory;
+	ngx_uint_t   connection_n;
+	ngx_array_t *radix_diff_targets;
+} ngx_cycle_t;
+
+/* the tests which use it define the cycle */
+
+extern volatile ngx_cycle_t  *ngx_cycle;
+
+#define NGX_DEFAULT_POOL_SIZE     16384
+
+/* the event loop of the tests defines the current time and the process */
+
+extern volatile ngx_msec_t  ngx_current_msec;
+extern ngx_uint_t           ngx_process;
+
+#define NGX_PROCESS_SINGLE     0
+#define NGX_PROCESS_MASTER     1
+#define NGX_PROCESS_SIGNALLER  2
+#define NGX_PROCESS_WORKER     3
+#define NGX_PROCESS_HELPER     4
+
+#define NGX_MAX_PROCESSES      1024
+
+extern ngx_uint_t           ngx_worker;
+
+/* the configuration is read from the "args" set up by a test */
+
+typedef struct {
+	ngx_str_t   name;
+} ngx_file_t;
+
+typedef struct {
+	ngx_file_t  file;
+	ngx_uint_t  line;
+} ngx_conf_file_t;
+
+typedef struct {
+	ngx_str_t       *name;
+	ngx_array_t     *args;
+	ngx_cycle_t     *cycle;
+	ngx_pool_t      *pool;
+	ngx_conf_file_t *conf_file;
+	ngx_log_t       *log;
+} ngx_conf_t;
+
+typedef struct ngx_command_s  ngx_command_t;
+
+struct ngx_command_s {
+	ngx_str_t    name;
+	ngx_uint_t   type;
+	char      *(*set)(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+	ngx_uint_t   conf;
+	ngx_uint_t   offset;
+	void        *post;
+};
+
+#define ngx_null_command  { ngx_null_string, 0, NULL, 0, 0, NULL }
+
+#define NGX_CONF_OK          NULL
+#define NGX_CONF_ERROR       (void *) -1
+
+#define NGX_CONF_1MORE       0x00000800
+#define NGX_DIRECT_CONF      0x00010000
+#define NGX_MAIN_CONF        0x01000000
+
+typedef struct {
+	ngx_str_t    name;
+	void      *(*create_conf)(ngx_cycle_t *cycle);
+	char      *(*init_conf)(ngx_cycle_t *cycle, void *conf);
+} ngx_core_module_t;
+
+typedef struct {
+	ngx_uint_t      ctx_index;
+	ngx_uint_t      index;
+	void           *ctx;
+	ngx_command_t  *commands;
+	ngx_uint_t      type;
+	ngx_int_t     (*init_master)(ngx_log_t *log);
+	ngx_int_t     (*init_module)(ngx_cycle_t *cycle);
+	ngx_int_t     (*init_process)(ngx_cycle_t *cycle);
+	ngx_int_t     (*init_thread)(ngx_cycle_t *cycle);
+	void          (*exit_thread)(ngx_cycle_t *cycle);
+	void          (*exit_process)(ngx_cycle_t *cycle);
+	void          (*exit_master)(ngx_cycle_t *cycle);
+} ngx_module_t;
+
+#define NGX_MODULE_V1          0, 0
+#define NGX_MODULE_V1_PADDING
+#define NGX_CORE_MODULE        0x45524F43
+
+#define ngx_get_conf(conf_ctx, module)  conf_ctx[module.index]
+
+/* the zones live in a single part list of at most 8 */
+
+static ngx_inline ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
+{
+	ngx_list_part_t *part = &cf->cycle->shared_memory.part;
+
+	if (part->elts == NULL)
+		part->elts = calloc(8, sizeof(ngx_shm_zone_t));
+
+	if (part->elts == NULL || part->nelts == 8)
+		return NULL;
+
+	ngx_shm_zone_t *shm_zone = (ngx_shm_zone_t *) part->elts + part->nelts++;
+
+	ngx_memzero(shm_zone, sizeof(ngx_shm_zone_t));
+
+	shm_zone->shm.size = size;
+	shm_zone->shm.name = *name;
+	shm_zone->tag = tag;
+
+	return shm_zone;
+}
+
+/* the threads are plain pthreads, the errors are logged by the callers */
+
+typedef struct ngx_thread_task_s  ngx_thread_task_t;
+
+typedef pthread_mutex_t  ngx_thread_mutex_t;
+typedef pthread_cond_t   ngx_thread_cond_t;
+
+#define ngx_thread_mutex_create(mtx, log)                                     \
+	(pthread_mutex_init(mtx, NULL) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_mutex_destroy(mtx, log)                                    \
+	(pthread_mutex_destroy(mtx) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_mutex_lock(mtx, log)                                       \
+	(pthread_mutex_lock(mtx) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_mutex_unlock(mtx, log)                                     \
+	(pthread_mutex_unlock(mtx) ? NGX_ERROR : NGX_OK)
+
+#define ngx_thread_cond_create(cond, log)                                     \
+	(pthread_cond_init(cond, NULL) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_cond_destroy(cond, log)                                    \
+	(pthread_cond_destroy(cond) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_cond_signal(cond, log)                                     \
+	(pthread_cond_signal(cond) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_cond_broadcast(cond, log)                                  \
+	(pthread_cond_broadcast(cond) ? NGX_ERROR : NGX_OK)
+#define ngx_thread_cond_wait(cond, mtx, log)                                  \
+	(pthread_cond_wait(cond, mtx) ? NGX_ERROR : NGX_OK)
+
+/*
+ * The shared memory mutex: a lock word holding the pid of the owner, as
+ * ngx_shmtx.c does with atomics, spinning with sched_yield() instead of
+ * waiting on a semaphore.
+ */
+
+typedef pid_t  ngx_pid_t;
+
+extern ngx_pid_t  ngx_pid;
+
+typedef struct {
+	ngx_atomic_t    lock;
+} ngx_shmtx_sh_t;
+
+typedef struct {
+	ngx_atomic_t   *lock;
+} ngx_shmtx_t;
+
+static ngx_inline ngx_int_t ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
+{
+	mtx->lock = &addr->lock;
+	return NGX_OK;
+}
+
+#define ngx_shmtx_trylock(mtx)                                                \
+	(*(mtx)->lock == 0 && ngx_atomic_cmp_set((mtx)->lock, 0, ngx_pid))
+
+static ngx_inline void ngx_shmtx_lock(ngx_shmtx_t *mtx)
+{
+	while (!ngx_shmtx_trylock(mtx))
+		ngx_sched_yield();
+}
+
+#define ngx_shmtx_unlock(mtx)         (void) ngx_atomic_cmp_set((mtx)->lock, ngx_pid, 0)
+#define ngx_shmtx_force_unlock(mtx, pid)  ngx_atomic_cmp_set((mtx)->lock, pid, 0)
+
+#define ngx_create_pool(size, log)  ((ngx_pool_t *) malloc(1))
+#define ngx_destroy_pool(pool)      free(pool)
+
+typedef int                 ngx_fd_t;
+typedef struct stat         ngx_file_info_t;
+
+#define NGX_FILE_ERROR      -1
+#define ngx_fd_info(fd, sb)  fstat(fd, sb)
+#define ngx_fd_info_n       "fstat()"
+#define ngx_file_size(sb)   (sb)->st_size
+
+typedef struct {
+	in_addr_t   addr;
+	in_addr_t   mask;
+} ngx_in_cidr_t;
+
+typedef struct {
+	ngx_uint_t  family;
+	union {
+		ngx_in_cidr_t  in;
+	} u;
+} ngx_cidr_t;
+
+static ngx_inline ngx_int_t ngx_ptocidr(ngx_str_t *text, ngx_cidr_t *cidr)
+{
+	char addr[INET_ADDRSTRLEN + 4];
+
+	if (text->len >= sizeof(addr))
+		return NGX_ERROR;
+
+	ngx_memcpy(addr, text->data, text->len);
+	addr[text->len] = '\0';
+
+	char *slash = strchr(addr, '/');
+	if (slash == NULL)
+		return NGX_ERROR;
+
+	*slash = '\0';
+
+	ngx_int_t bits = ngx_atoi((u_char *) slash + 1, strlen(slash + 1));
+	if (bits == NGX_ERROR || bits > 32 || inet_pton(AF_INET, addr, &cidr->u.in.addr) != 1)
+		return NGX_ERROR;
+
+	cidr->family = AF_INET;
+	cidr->u.in.mask = bits ? htonl((uint32_t) 0xffffffff << (32 - bits)) : 0;
+	cidr->u.in.addr &= cidr->u.in.mask;
+
+	return NGX_OK;
+}
+
+#include <ngx_rbtree.h>
+#include <ngx_btree.h>
+#include <ngx_radix_tree.h>
+
+
+/* wall clock in nanoseconds for the benchmarks */
+
+static ngx_inline uint64_t ngx_test_nsec(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, the tests are reproducible for a given seed */
+
+static ngx_inline uint64_t ngx_test_random(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+#endif /* _NGX_CORE_H_INCLUDED_ */
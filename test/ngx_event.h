@@ -0,0 +1,61 @@
+
+/*
+ * A minimal stand-in for ngx_event.h: the event fields used by the sources
+ * under test, with the real timers of ngx_event_timer.h.  The connection
+ * functions and ngx_notify() are provided by the test, which runs its own
+ * event loop.
+ */
+
+
+#ifndef _NGX_EVENT_H_INCLUDED_
+#define _NGX_EVENT_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+typedef struct ngx_event_s       ngx_event_t;
+typedef struct ngx_connection_s  ngx_connection_t;
+
+typedef void (*ngx_event_handler_pt)(ngx_event_t *ev);
+
+struct ngx_event_s {
+	void                 *data;
+
+	unsigned              active:1;
+	unsigned              complete:1;
+	unsigned              timedout:1;
+	unsigned              timer_set:1;
+	unsigned              cancelable:1;
+
+	ngx_event_handler_pt  handler;
+	ngx_log_t            *log;
+
+	ngx_rbtree_node_t     timer;
+};
+
+struct ngx_connection_s {
+	void                 *data;
+	ngx_event_t          *read;
+	ngx_event_t          *write;
+	int                   fd;
+	ngx_log_t            *log;
+};
+
+#define ngx_event_ident(p)  ((ngx_connection_t *) (p))->fd
+
+ngx_connection_t *ngx_get_connection(int s, ngx_log_t *log);
+void ngx_close_connection(ngx_connection_t *c);
+ngx_int_t ngx_handle_read_event(ngx_event_t *rev, ngx_uint_t flags);
+
+#define ngx_add_timer        ngx_event_add_timer
+#define ngx_del_timer        ngx_event_del_timer
+
+extern ngx_int_t (*ngx_notify)(ngx_event_handler_pt handler);
+
+
+#include <ngx_event_timer.h>
+
+
+#endif /* _NGX_EVENT_H_INCLUDED_ */
@@ -0,0 +1,933 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * A randomized test and a benchmark of the event timers, built once per
+ * backend: ngx_event_timer_test for the rbtree, ngx_event_timer_wheel_test
+ * for the timing wheel and ngx_event_timer_heap_test for the heap, so the
+ * rows of "make bench" compare them.
+ *
+ * The fuzzer arms, re-arms and deletes the timers of a set of events with
+ * timeouts from below a millisecond to beyond the range of the wheel, with
+ * the keys around the wraparound of ngx_msec_t, and moves the time forward.
+ * Against a brute force walk of the events it checks that no timer expires
+ * before its deadline or stays armed after it, that ngx_event_find_timer()
+ * never sleeps past the nearest deadline, and the armed and noncancelable
+ * counts.  The handlers re-arm their own timers and delete others, some of
+ * which may have expired in the same pass.  With ngx_memalign() failing,
+ * the timers the heap has no room for must be left unset and uncounted.
+ * A graceful shutdown drains 500k timers, checking ngx_event_no_timers_left()
+ * against the noncancelable timers left on every iteration.  The height is
+ * sampled into the slot of a timer stats zone, and not without one.
+ *
+ * The microsecond timers of ngx_event_timerfd.c are run by an event loop
+ * polling the timerfd with the timeout of ngx_event_find_timer(), mixed
+ * with millisecond timers, replaced by them and deleted.  Their benchmark
+ * is the accuracy: how late a timer fires against its deadline, compared
+ * with a millisecond timer rounded up from it.
+ *
+ *     ngx_event_timer_test fuzz [ops [seed [timers to drain]]]
+ *     ngx_event_timer_test bench [timers [ops]]
+ */
+
+
+#if (NGX_EVENT_TIMER_WHEEL)
+#define NGX_TEST_BACKEND       "wheel"
+#elif (NGX_EVENT_TIMER_HEAP)
+#define NGX_TEST_BACKEND       "heap"
+#else
+#define NGX_TEST_BACKEND       "rbtree"
+#endif
+
+#define NGX_TEST_FUZZ_TIMERS   1024
+
+
+typedef struct {
+	ngx_event_t            ev;
+
+	/* the deadline of the armed timer, read back after ngx_add_timer() */
+	ngx_msec_t             deadline;
+} ngx_test_timer_t;
+
+
+volatile ngx_msec_t    ngx_current_msec;
+ngx_uint_t             ngx_process = NGX_PROCESS_WORKER;
+ngx_uint_t             ngx_worker;
+ngx_pid_t              ngx_pid;
+
+static ngx_cycle_t     ngx_test_cycle;
+volatile ngx_cycle_t  *ngx_cycle = &ngx_test_cycle;
+
+static ngx_test_timer_t  *ngx_test_timers;
+static ngx_uint_t         ngx_test_ntimers;
+static uint64_t           ngx_test_rnd;
+static ngx_uint_t         ngx_test_failed;
+static ngx_uint_t         ngx_test_expired;
+static ngx_uint_t         ngx_test_alloc_fail;
+
+
+void *ngx_memalign(size_t alignment, size_t size, ngx_log_t *log)
+{
+	void *p;
+
+	if (ngx_test_alloc_fail)
+		return NULL;
+
+	return (posix_memalign(&p, alignment, size) == 0) ? p : NULL;
+}
+
+/* timeouts from 0 to past the 2^26 ms range of the wheel */
+
+static ngx_msec_t ngx_test_timeout(uint64_t *rnd)
+{
+	switch (ngx_test_random(rnd) % 8)
+	{
+	case 0:
+		return ngx_test_random(rnd) % 4;
+
+	case 1:
+		return ngx_test_random(rnd) % 100000;
+
+	case 2:
+		return ngx_test_random(rnd) % 200000000;
+
+	default:
+		return ngx_test_random(rnd) % 600;
+	}
+}
+
+static void ngx_test_arm(ngx_test_timer_t *t, uint64_t *rnd)
+{
+	static ngx_uint_t precisions[] = { NGX_TIMER_EXACT, NGX_TIMER_COARSE, NGX_TIMER_IDLE };
+
+	ngx_event_add_timer_precision(&t->ev, ngx_test_timeout(rnd), precisions[ngx_test_random(rnd) % 3]);
+
+	t->deadline = t->ev.timer.key;
+}
+
+static void ngx_test_fuzz_handler(ngx_event_t *ev)
+{
+	ngx_test_timer_t *t = (ngx_test_timer_t *) ev;
+
+	if (ev->timer_set || (ngx_msec_int_t) (ngx_current_msec - t->deadline) < 0)
+	{
+		fprintf(stderr, "timer %lu expired at %lu\n", (unsigned long) t->deadline,
+				(unsigned long) ngx_current_msec);
+		ngx_test_failed++;
+	}
+
+	ngx_test_expired++;
+
+	switch (ngx_test_random(&ngx_test_rnd) % 4)
+	{
+	case 0:
+		ngx_test_arm(t, &ngx_test_rnd);
+		break;
+
+	case 1:
+		/* possibly one expired in this pass and not handled yet */
+
+		t = &ngx_test_timers[ngx_test_random(&ngx_test_rnd) % ngx_test_ntimers];
+		if (t->ev.timer_set)
+			ngx_del_timer(&t->ev);
+
+		break;
+	}
+}
+
+static ngx_int_t ngx_test_check(void)
+{
+	ngx_uint_t armed = 0, noncancelable = 0;
+	ngx_msec_t nearest = NGX_TIMER_INFINITE;
+
+	for (ngx_uint_t i = 0; i < ngx_test_ntimers; i++)
+	{
+		ngx_test_timer_t *t = &ngx_test_timers[i];
+
+		if (!t->ev.timer_set)
+			continue;
+
+		ngx_msec_int_t left = (ngx_msec_int_t) (t->deadline - ngx_current_msec);
+		if (left <= 0)
+		{
+			fprintf(stderr, "timer %lu not expired at %lu\n", (unsigned long) t->deadline,
+					(unsigned long) ngx_current_msec);
+			return NGX_ERROR;
+		}
+
+		nearest = ngx_min(nearest, (ngx_msec_t) left);
+		armed++;
+		noncancelable += !t->ev.cancelable;
+	}
+
+	ngx_msec_t timer = ngx_event_find_timer();
+
+	if ((nearest == NGX_TIMER_INFINITE) != (timer == NGX_TIMER_INFINITE) || timer > nearest)
+	{
+		fprintf(stderr, "nearest timer in %lu ms, found %lu ms\n", (unsigned long) nearest,
+				(unsigned long) timer);
+		return NGX_ERROR;
+	}
+
+	if (armed != ngx_event_timer_stat->armed || noncancelable != ngx_event_timer_noncancelable)
+	{
+		fprintf(stderr, "%lu armed, %lu noncancelable, counted %lu and %lu\n",
+				(unsigned long) armed, (unsigned long) noncancelable,
+				(unsigned long) ngx_event_timer_stat->armed,
+				(unsigned long) ngx_event_timer_noncancelable);
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_test_fuzz(ngx_uint_t ops, uint64_t seed)
+{
+	ngx_test_rnd = seed;
+	ngx_test_failed = 0;
+	ngx_test_expired = 0;
+
+	/* the keys wrap around in a few seconds */
+
+	ngx_current_msec = (ngx_msec_t) -5000;
+
+	if (ngx_event_timer_init(NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	ngx_test_ntimers = NGX_TEST_FUZZ_TIMERS;
+	ngx_test_timers = calloc(ngx_test_ntimers, sizeof(ngx_test_timer_t));
+	if (ngx_test_timers == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < ngx_test_ntimers; i++)
+	{
+		ngx_test_timers[i].ev.handler = ngx_test_fuzz_handler;
+		ngx_test_timers[i].ev.cancelable = i % 2;
+	}
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_uint_t r = ngx_test_random(&ngx_test_rnd) % 16;
+		ngx_test_timer_t *t = &ngx_test_timers[ngx_test_random(&ngx_test_rnd) % ngx_test_ntimers];
+
+		if (r < 8)
+		{
+			ngx_test_arm(t, &ngx_test_rnd);
+			continue;
+		}
+
+		if (r < 10)
+		{
+			if (t->ev.timer_set)
+				ngx_del_timer(&t->ev);
+
+			continue;
+		}
+
+		/* mostly a few ticks, sometimes a long sleep of the event loop */
+
+		ngx_current_msec += (r == 15) ? ngx_test_random(&ngx_test_rnd) % 20000
+									  : ngx_test_random(&ngx_test_rnd) % 40;
+
+		ngx_event_expire_timers();
+
+		if (ngx_test_failed || ngx_test_check() != NGX_OK)
+		{
+			fprintf(stderr, NGX_TEST_BACKEND " fuzz failed at op %lu\n", (unsigned long) op);
+			return NGX_ERROR;
+		}
+	}
+
+	for (ngx_uint_t i = 0; i < ngx_test_ntimers; i++)
+	{
+		if (ngx_test_timers[i].ev.timer_set)
+			ngx_del_timer(&ngx_test_timers[i].ev);
+	}
+
+	if (ngx_test_check() != NGX_OK || ngx_event_find_timer() != NGX_TIMER_INFINITE)
+		return NGX_ERROR;
+
+	printf(NGX_TEST_BACKEND " fuzz: %lu operations, %lu timers expired ok\n",
+		   (unsigned long) ops, (unsigned long) ngx_test_expired);
+
+	free(ngx_test_timers);
+
+	return NGX_OK;
+}
+
+/*
+ * The heap starts with room for 2 * connection_n timers: the ones armed
+ * past that while it cannot grow are not set, the alerts are expected.
+ */
+
+static ngx_int_t ngx_test_full(void)
+{
+	ngx_test_rnd = 1;
+
+	ngx_current_msec = 0;
+
+	if (ngx_event_timer_init(NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	ngx_test_ntimers = 2 * ngx_cycle->connection_n + 4;
+	ngx_test_timers = calloc(ngx_test_ntimers, sizeof(ngx_test_timer_t));
+	if (ngx_test_timers == NULL)
+		return NGX_ERROR;
+
+	ngx_test_alloc_fail = 1;
+
+	for (ngx_uint_t i = 0; i < ngx_test_ntimers; i++)
+	{
+		ngx_test_timer_t *t = &ngx_test_timers[i];
+
+		t->ev.handler = ngx_test_fuzz_handler;
+		t->ev.cancelable = i % 2;
+
+		ngx_add_timer(&t->ev, 1000 + i);
+		t->deadline = t->ev.timer.key;
+	}
+
+	ngx_test_alloc_fail = 0;
+
+	ngx_uint_t armed = ngx_event_timer_stat->armed;
+
+	if (ngx_test_check() != NGX_OK || armed < 2 * ngx_cycle->connection_n)
+		return NGX_ERROR;
+
+	/* the lost ones are armed once the heap may grow */
+
+	for (ngx_uint_t i = 0; i < ngx_test_ntimers; i++)
+	{
+		ngx_test_timer_t *t = &ngx_test_timers[i];
+
+		if (!t->ev.timer_set)
+		{
+			ngx_add_timer(&t->ev, 1000 + i);
+			t->deadline = t->ev.timer.key;
+		}
+	}
+
+	if (ngx_test_check() != NGX_OK || ngx_event_timer_stat->armed != ngx_test_ntimers)
+		return NGX_ERROR;
+
+	ngx_current_msec += 2000;
+	ngx_event_expire_timers();
+
+	if (ngx_test_failed || ngx_test_check() != NGX_OK)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < ngx_test_ntimers; i++)
+	{
+		if (ngx_test_timers[i].ev.timer_set)
+			ngx_del_timer(&ngx_test_timers[i].ev);
+	}
+
+	printf(NGX_TEST_BACKEND " full: %lu of %lu timers armed without memory ok\n",
+		   (unsigned long) armed, (unsigned long) ngx_test_ntimers);
+
+	free(ngx_test_timers);
+
+	return NGX_OK;
+}
+
+#if !(NGX_EVENT_TIMER_WHEEL) && !(NGX_EVENT_TIMER_HEAP)
+
+static ngx_uint_t ngx_test_depth(ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+	if (node == sentinel)
+		return 0;
+
+	return 1 + ngx_max(ngx_test_depth(node->left, sentinel), ngx_test_depth(node->right, sentinel));
+}
+
+#endif
+
+/* the height sampled after a second of timers expiring, as a worker does */
+
+static ngx_uint_t ngx_test_height(ngx_uint_t n)
+{
+	ngx_current_msec = 0;
+
+	ngx_test_timer_t *timers = calloc(n, sizeof(ngx_test_timer_t));
+	if (timers == NULL || ngx_event_timer_init(NULL) != NGX_OK)
+		return (ngx_uint_t) -1;
+
+	/* none is due within the second */
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		timers[i].ev.handler = ngx_test_fuzz_handler;
+		timers[i].ev.cancelable = 1;
+		ngx_add_timer(&timers[i].ev, 2000 + ngx_test_random(&ngx_test_rnd) % 60000);
+	}
+
+	ngx_event_expire_timers();
+
+	ngx_current_msec += 1000;
+	ngx_event_expire_timers();
+
+	ngx_uint_t height = ngx_event_timer_stat->height;
+
+#if !(NGX_EVENT_TIMER_WHEEL) && !(NGX_EVENT_TIMER_HEAP)
+
+	ngx_uint_t depth = ngx_test_depth(ngx_event_timer_rbtree.root, ngx_event_timer_rbtree.sentinel);
+
+	if (height && (height < depth || depth < height / 2))
+	{
+		fprintf(stderr, "rbtree of height %lu sampled as %lu\n", (unsigned long) depth,
+				(unsigned long) height);
+		height = (ngx_uint_t) -1;
+	}
+
+#endif
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		ngx_del_timer(&timers[i].ev);
+
+	free(timers);
+
+	return height;
+}
+
+/* the zone is set up as ngx_init_cycle() does */
+
+static ngx_int_t ngx_test_stat(void)
+{
+	ngx_str_t value[2] = { ngx_string("timer_stat_zone"), ngx_string("timers") };
+	ngx_array_t args = { value, 2, sizeof(ngx_str_t), 2, NULL };
+	ngx_conf_t cf;
+
+	ngx_test_rnd = 1;
+
+	if (ngx_test_height(10000) != 0)
+	{
+		fprintf(stderr, NGX_TEST_BACKEND " height sampled without a stats zone\n");
+		return NGX_ERROR;
+	}
+
+	ngx_memzero(&cf, sizeof(ngx_conf_t));
+	cf.args = &args;
+	cf.cycle = &ngx_test_cycle;
+
+	if (ngx_event_timer_stat_zone(&cf, NULL, NULL) != NGX_CONF_OK)
+		return NGX_ERROR;
+
+	ngx_shm_zone_t *shm_zone = ngx_test_cycle.shared_memory.part.elts;
+
+	shm_zone->shm.addr = calloc(1, shm_zone->shm.size);
+	if (shm_zone->shm.addr == NULL || shm_zone->init(shm_zone, NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	ngx_worker = 1;
+
+	ngx_uint_t height = ngx_test_height(10000);
+
+	ngx_event_timer_stat_t *slots = shm_zone->data;
+
+	if (height == 0 || height == (ngx_uint_t) -1 || ngx_event_timer_stat != &slots[1])
+	{
+		fprintf(stderr, NGX_TEST_BACKEND " height not sampled into the stats zone\n");
+		return NGX_ERROR;
+	}
+
+	printf(NGX_TEST_BACKEND " stats: height %lu of 10000 timers in a %lu byte zone ok\n",
+		   (unsigned long) height, (unsigned long) shm_zone->shm.size);
+
+	/* the other tests count into the static counters */
+
+	ngx_test_cycle.shared_memory.part.nelts = 0;
+	ngx_worker = 0;
+
+	return NGX_OK;
+}
+
+/* some noncancelable handlers arm a short timer again, as lingering close does */
+
+static void ngx_test_drain_handler(ngx_event_t *ev)
+{
+	ngx_test_expired++;
+
+	if (!ev->cancelable && ngx_test_random(&ngx_test_rnd) % 8 == 0)
+		ngx_add_timer(ev, 50);
+}
+
+/*
+ * An exiting worker with n connections: half of the timers cannot be
+ * cancelled and are due within 10 seconds, the cancelable ones within 20.
+ * The worker loops until ngx_event_no_timers_left() says only cancelable
+ * timers are left, which must be exactly when the last noncancelable one
+ * is gone.
+ */
+
+static ngx_int_t ngx_test_drain(ngx_uint_t n)
+{
+	ngx_test_rnd = 1;
+	ngx_test_expired = 0;
+
+	ngx_current_msec = 0;
+
+	if (ngx_event_timer_init(NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	ngx_test_timer_t *timers = calloc(n, sizeof(ngx_test_timer_t));
+	if (timers == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		ngx_event_t *ev = &timers[i].ev;
+
+		ev->handler = ngx_test_drain_handler;
+		ev->cancelable = i % 2;
+
+		ngx_add_timer(ev, 1 + ngx_test_random(&ngx_test_rnd) % (ev->cancelable ? 20000 : 10000));
+	}
+
+	ngx_uint_t iterations = 0;
+	uint64_t ns = 0;
+
+	for ( ;; )
+	{
+		uint64_t start = ngx_test_nsec();
+		ngx_int_t rc = ngx_event_no_timers_left();
+		ns += ngx_test_nsec() - start;
+
+		iterations++;
+
+		ngx_uint_t left = 0;
+		for (ngx_uint_t i = 0; i < n; i++)
+			left += (timers[i].ev.timer_set && !timers[i].ev.cancelable);
+
+		if ((rc == NGX_OK) != (left == 0))
+		{
+			fprintf(stderr, NGX_TEST_BACKEND " drain: %lu noncancelable timers left at %lu ms, "
+					"ngx_event_no_timers_left() returned %ld\n", (unsigned long) left,
+					(unsigned long) ngx_current_msec, (long) rc);
+			return NGX_ERROR;
+		}
+
+		if (rc == NGX_OK)
+			break;
+
+		ngx_current_msec += 100;
+		ngx_event_expire_timers();
+	}
+
+	/* the cancelable timers are still there, the worker just exits */
+
+	if (ngx_event_timer_stat->armed == 0 || ngx_event_timer_noncancelable != 0)
+		return NGX_ERROR;
+
+	printf(NGX_TEST_BACKEND " drain: %lu timers, %lu expired, %lu cancelable left, %.1f ns per check ok\n",
+		   (unsigned long) n, (unsigned long) ngx_test_expired,
+		   (unsigned long) ngx_event_timer_stat->armed, (double) ns / iterations);
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		if (timers[i].ev.timer_set)
+			ngx_del_timer(&timers[i].ev);
+	}
+
+	free(timers);
+
+	return NGX_OK;
+}
+
+static void ngx_test_report(const char *name, ngx_uint_t ops, uint64_t ns)
+{
+	char buf[64];
+
+	(void) snprintf(buf, sizeof(buf), "%s, %s", NGX_TEST_BACKEND, name);
+
+	printf("%-28s %10lu ops %8.1f ns/op %8.2f Mops/s\n", buf, (unsigned long) ops,
+		   (double) ns / ops, ops * 1000.0 / ns);
+}
+
+/* keepalive connections: the timeouts are spread over a minute */
+
+static void ngx_test_bench_handler(ngx_event_t *ev)
+{
+	ngx_test_expired++;
+	ngx_add_timer(ev, 1 + ngx_test_random(&ngx_test_rnd) % 60000);
+}
+
+static void ngx_test_churn_handler(ngx_event_t *ev)
+{
+	ngx_test_expired++;
+}
+
+/*
+ * The timers of n idle connections: a read timeout is replaced by a new
+ * one far enough not to be kept by the lazy window, and the connections
+ * time out and are armed again as the time goes on 1 ms per iteration.
+ */
+
+static ngx_int_t ngx_test_bench(ngx_uint_t n, ngx_uint_t ops)
+{
+	ngx_test_rnd = 1;
+
+	ngx_current_msec = 1000000;
+
+	if (ngx_event_timer_init(NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	ngx_test_timer_t *timers = calloc(n, sizeof(ngx_test_timer_t));
+	if (timers == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		timers[i].ev.handler = ngx_test_bench_handler;
+		timers[i].ev.cancelable = 1;
+		ngx_add_timer(&timers[i].ev, 1 + ngx_test_random(&ngx_test_rnd) % 60000);
+	}
+
+	uint64_t start = ngx_test_nsec();
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_event_t *ev = &timers[ngx_test_random(&ngx_test_rnd) % n].ev;
+
+		ngx_del_timer(ev);
+		ngx_add_timer(ev, 1 + ngx_test_random(&ngx_test_rnd) % 60000);
+	}
+
+	ngx_test_report("delete+add", ops, ngx_test_nsec() - start);
+
+	ngx_test_expired = 0;
+	start = ngx_test_nsec();
+
+	while (ngx_test_expired < ops)
+	{
+		ngx_current_msec++;
+		ngx_event_expire_timers();
+	}
+
+	ngx_test_report("expire 1ms ticks", ngx_test_expired, ngx_test_nsec() - start);
+
+	/*
+	 * The churn of busy connections: a request re-arms the read timeout,
+	 * which the lazy window mostly keeps, a response cancels it, and an
+	 * idle connection gets a keepalive timeout; the time goes on 1 ms per
+	 * 64 operations, and the connections which time out are closed.
+	 */
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		timers[i].ev.handler = ngx_test_churn_handler;
+
+	ngx_test_expired = 0;
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_event_t *ev = &timers[ngx_test_random(&ngx_test_rnd) % n].ev;
+		ngx_uint_t r = ngx_test_random(&ngx_test_rnd) % 8;
+
+		if (!ev->timer_set)
+			ngx_add_timer(ev, (r < 4) ? 5000 : 60000);
+		else if (r < 6)
+			ngx_add_timer(ev, 60000);
+		else
+			ngx_del_timer(ev);
+
+		if (op % 64 == 0)
+		{
+			ngx_current_msec++;
+			ngx_event_expire_timers();
+		}
+	}
+
+	ngx_test_report("churn", ops, ngx_test_nsec() - start);
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		if (timers[i].ev.timer_set)
+			ngx_del_timer(&timers[i].ev);
+	}
+
+	ngx_test_report("delete all", n, ngx_test_nsec() - start);
+
+	if (ngx_event_timer_stat->armed != 0 || ngx_event_find_timer() != NGX_TIMER_INFINITE)
+	{
+		fprintf(stderr, "timers left after delete\n");
+		return NGX_ERROR;
+	}
+
+	free(timers);
+
+	return NGX_OK;
+}
+
+#if (NGX_HAVE_TIMERFD)
+
+typedef struct {
+	ngx_event_t            ev;
+
+	/* CLOCK_MONOTONIC microseconds */
+	uint64_t               due;
+	uint64_t               fired;
+} ngx_test_usec_timer_t;
+
+
+static ngx_connection_t  ngx_test_conn = { NULL, NULL, NULL, -1, NULL };
+static ngx_event_t       ngx_test_rev;
+
+
+/* the timerfd is the only connection */
+
+ngx_connection_t *ngx_get_connection(int s, ngx_log_t *log)
+{
+	ngx_test_conn.fd = s;
+	ngx_test_conn.read = &ngx_test_rev;
+
+	return &ngx_test_conn;
+}
+
+void ngx_close_connection(ngx_connection_t *c)
+{
+	(void) close(c->fd);
+	c->fd = -1;
+}
+
+ngx_int_t ngx_handle_read_event(ngx_event_t *rev, ngx_uint_t flags)
+{
+	return NGX_OK;
+}
+
+/* poll() has the millisecond timeout of epoll_wait() */
+
+static void ngx_test_process_events(void)
+{
+	struct pollfd pfd;
+
+	ngx_msec_t timer = ngx_event_find_timer();
+
+	pfd.fd = ngx_test_conn.fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	int n = poll(&pfd, 1, (timer == NGX_TIMER_INFINITE) ? -1 : (int) timer);
+
+	ngx_current_msec = (ngx_msec_t) (ngx_test_nsec() / 1000000);
+
+	if (n > 0 && (pfd.revents & POLLIN))
+		ngx_test_conn.read->handler(ngx_test_conn.read);
+
+	ngx_event_expire_timers();
+}
+
+static void ngx_test_usec_handler(ngx_event_t *ev)
+{
+	ngx_test_usec_timer_t *t = (ngx_test_usec_timer_t *) ev;
+
+	t->fired = ngx_test_nsec() / 1000;
+	ngx_test_expired++;
+}
+
+/* the millisecond timers are due when ngx_current_msec reaches the key */
+
+static void ngx_test_usec_arm(ngx_test_usec_timer_t *t, uint64_t *rnd)
+{
+	uint64_t usec = 50 + ngx_test_random(rnd) % 3000;
+
+	if (ngx_test_random(rnd) % 2)
+	{
+		t->due = ngx_test_nsec() / 1000 + usec;
+		ngx_event_add_timer_usec(&t->ev, usec);
+	}
+	else
+	{
+		ngx_add_timer(&t->ev, usec / 1000);
+		t->due = (uint64_t) t->ev.timer.key * 1000;
+	}
+}
+
+static ngx_int_t ngx_test_timerfd(void)
+{
+	ngx_test_usec_timer_t timers[64];
+	uint64_t rnd = 1;
+
+	ngx_memzero(timers, sizeof(timers));
+
+	ngx_test_expired = 0;
+	ngx_current_msec = (ngx_msec_t) (ngx_test_nsec() / 1000000);
+
+	if (ngx_event_timer_init(NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < 64; i++)
+	{
+		timers[i].ev.handler = ngx_test_usec_handler;
+		timers[i].ev.cancelable = i % 2;
+		ngx_test_usec_arm(&timers[i], &rnd);
+	}
+
+	if (ngx_test_conn.fd == -1)
+	{
+		fprintf(stderr, "timerfd not created\n");
+		return NGX_ERROR;
+	}
+
+	/* a quarter is deleted, a quarter replaced by a timer of either kind */
+
+	ngx_uint_t deleted = 0;
+
+	for (ngx_uint_t i = 0; i < 64; i++)
+	{
+		switch (ngx_test_random(&rnd) % 4)
+		{
+		case 0:
+			ngx_del_timer(&timers[i].ev);
+			deleted++;
+			break;
+
+		case 1:
+			ngx_test_usec_arm(&timers[i], &rnd);
+			break;
+		}
+	}
+
+	uint64_t start = ngx_test_nsec();
+
+	while (ngx_event_timer_stat->armed && ngx_test_nsec() - start < 1000000000)
+		ngx_test_process_events();
+
+	for (ngx_uint_t i = 0; i < 64; i++)
+	{
+		ngx_test_usec_timer_t *t = &timers[i];
+
+		if (t->fired && t->fired < t->due)
+		{
+			fprintf(stderr, "timer due at %lu us fired at %lu us\n", (unsigned long) t->due,
+					(unsigned long) t->fired);
+			return NGX_ERROR;
+		}
+	}
+
+	if (ngx_event_timer_stat->armed || ngx_event_timer_noncancelable
+		|| ngx_test_expired + deleted != 64)
+	{
+		fprintf(stderr, "%lu timers armed, %lu noncancelable, %lu expired\n",
+				(unsigned long) ngx_event_timer_stat->armed,
+				(unsigned long) ngx_event_timer_noncancelable,
+				(unsigned long) ngx_test_expired);
+		return NGX_ERROR;
+	}
+
+	ngx_event_timerfd_done();
+
+	printf(NGX_TEST_BACKEND " timerfd: %lu timers expired, %lu deleted ok\n",
+		   (unsigned long) ngx_test_expired, (unsigned long) deleted);
+
+	return ngx_test_conn.fd == -1 ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * A single timer at a time, so each wakeup is for it: a microsecond timer
+ * against a millisecond one rounded up from the same deadline, which the
+ * event loop sleeps for in whole milliseconds from ngx_current_msec.
+ */
+
+static ngx_int_t ngx_test_timerfd_bench(ngx_uint_t samples)
+{
+	static uint64_t delays[] = { 100, 250, 500, 1000 };
+
+	ngx_test_usec_timer_t t;
+	char name[64];
+
+	ngx_memzero(&t, sizeof(ngx_test_usec_timer_t));
+	t.ev.handler = ngx_test_usec_handler;
+
+	for (ngx_uint_t d = 0; d < sizeof(delays) / sizeof(delays[0]); d++)
+	{
+		for (ngx_uint_t usec = 0; usec < 2; usec++)
+		{
+			double sum = 0, min = 1e9, max = -1e9;
+
+			for (ngx_uint_t i = 0; i < samples; i++)
+			{
+				ngx_current_msec = (ngx_msec_t) (ngx_test_nsec() / 1000000);
+
+				uint64_t start = ngx_test_nsec() / 1000;
+
+				if (usec)
+					ngx_event_add_timer_usec(&t.ev, delays[d]);
+				else
+					ngx_add_timer(&t.ev, (delays[d] + 999) / 1000);
+
+				while (t.ev.timer_set)
+					ngx_test_process_events();
+
+				double late = (double) t.fired - (double) (start + delays[d]);
+
+				sum += late;
+				min = ngx_min(min, late);
+				max = ngx_max(max, late);
+			}
+
+			(void) snprintf(name, sizeof(name), "%s, %lu us", usec ? "timerfd" : NGX_TEST_BACKEND,
+							(unsigned long) delays[d]);
+
+			printf("%-28s %10lu timers %8.1f us late %8.1f us min %8.1f us max\n", name,
+				   (unsigned long) samples, sum / samples, min, max);
+		}
+	}
+
+	ngx_event_timerfd_done();
+
+	return NGX_OK;
+}
+
+#endif
+
+int main(int argc, char *argv[])
+{
+	ngx_test_cycle.connection_n = 64;
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		ngx_uint_t n = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1000000;
+		ngx_uint_t ops = (argc > 3) ? strtoul(argv[3], NULL, 10) : 2000000;
+
+		if (n == 0 || ops == 0 || ngx_test_bench(n, ops) != NGX_OK)
+			return 1;
+
+#if (NGX_HAVE_TIMERFD)
+		if (ngx_test_timerfd_bench(200) != NGX_OK)
+			return 1;
+#endif
+
+		return 0;
+	}
+
+	ngx_uint_t ops = (argc > 2) ? strtoul(argv[2], NULL, 10) : 200000;
+	uint64_t seed = (argc > 3) ? strtoull(argv[3], NULL, 10) : 1;
+
+	ngx_uint_t drain = (argc > 4) ? strtoul(argv[4], NULL, 10) : 500000;
+
+	if (seed == 0)
+		seed = 1;
+
+	if (ngx_test_fuzz(ops, seed) != NGX_OK || ngx_test_full() != NGX_OK
+		|| ngx_test_drain(drain) != NGX_OK || ngx_test_stat() != NGX_OK)
+	{
+		return 1;
+	}
+
+#if (NGX_HAVE_TIMERFD)
+	if (ngx_test_timerfd() != NGX_OK)
+		return 1;
+#endif
+
+	return 0;
+}
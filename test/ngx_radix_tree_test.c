@@ -0,0 +1,861 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * A randomized test of the 32-bit and 128-bit radix trees against
+ * a brute-force longest-prefix match, with compactions in between, and
+ * of the stride trie compiled from the 32-bit tree against the tree, of
+ * the batch lookups against single ones, and of the shared table against
+ * publishers and readers in other threads.  The benchmarks time lookups
+ * in a churned tree before and after ngx_radix_tree_compact(), in the
+ * stride trie compiled from it, one by one and in batches, and in an
+ * IPv6 table of the size of the global BGP table.
+ *
+ *     ngx_radix_tree_test fuzz [ops [seed]]
+ *     ngx_radix_tree_test bench [prefixes [churn]]
+ */
+
+
+#define NGX_TEST_FUZZ_PREFIXES  256
+
+/* the shared table test: keys looked up, publishes per thread, threads */
+#define NGX_TEST_SHARED_KEYS     1024
+#define NGX_TEST_SHARED_ROUNDS   64
+#define NGX_TEST_SHARED_THREADS  2
+
+/* the IPv6 routes of a full BGP feed, and the allocations they fall in */
+#define NGX_TEST_BGP6_PREFIXES  200000
+#define NGX_TEST_BGP6_BLOCKS    30000
+
+
+typedef struct {
+	uint32_t               key;
+	uint32_t               mask;
+	uintptr_t              value;
+	ngx_uint_t             present;
+} ngx_test_prefix_t;
+
+typedef struct {
+	ngx_radix32_shared_t  *sh;
+	ngx_radix_tree_t      *tree[2];
+	uint32_t               keys[NGX_TEST_SHARED_KEYS];
+	uintptr_t              expected[2][NGX_TEST_SHARED_KEYS];
+	volatile ngx_uint_t    publishers;
+	ngx_uint_t             errors;
+} ngx_test_shared_t;
+
+typedef struct {
+	u_char                 addr[16];
+	u_char                 key[16];
+	u_char                 mask[16];
+	ngx_uint_t             bits;
+	uintptr_t              value;
+	ngx_uint_t             present;
+} ngx_test_prefix6_t;
+
+
+/* keys are drawn from a few short prefixes, so that the inserted ones nest */
+
+static uint32_t ngx_test_key(uint64_t *rnd)
+{
+	uint64_t r = ngx_test_random(rnd);
+
+	return ((uint32_t) (r >> 40) & 0x030f0000) | ((uint32_t) r & 0x0000ffff) | 0x0a000000;
+}
+
+static uintptr_t ngx_test_match(ngx_test_prefix_t *prefixes, ngx_uint_t n, uint32_t key)
+{
+	uintptr_t value = NGX_RADIX_NO_VALUE;
+	uint32_t best = 0;
+	ngx_uint_t found = 0;
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		if (prefixes[i].present && (key & prefixes[i].mask) == prefixes[i].key
+			&& (!found || prefixes[i].mask > best))
+		{
+			value = prefixes[i].value;
+			best = prefixes[i].mask;
+			found = 1;
+		}
+	}
+
+	return value;
+}
+
+static ngx_int_t ngx_test_check(ngx_radix_tree_t *tree, ngx_test_prefix_t *prefixes, uint64_t *rnd)
+{
+	for (ngx_uint_t i = 0; i < 64; i++)
+	{
+		uint32_t key = ngx_test_key(rnd);
+
+		if (ngx_radix32tree_find(tree, key) != ngx_test_match(prefixes, NGX_TEST_FUZZ_PREFIXES, key))
+		{
+			fprintf(stderr, "lookup of %08x is wrong\n", key);
+			return NGX_ERROR;
+		}
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * The stride trie compiled from the tree must agree with the tree on
+ * the keys around the prefixes and on random ones, including the keys
+ * of the edges of the 16-8-8 levels, and so must the batch lookups of
+ * both.
+ */
+
+static ngx_int_t ngx_test_stride_check(ngx_radix_tree_t *tree, uint64_t *rnd)
+{
+	uint32_t keys[4096];
+	uintptr_t values[4096], stride[4096];
+
+	ngx_radix32_stride_t *st = ngx_radix32_stride_build(tree, NULL);
+	if (st == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < 4096; i++)
+	{
+		uint32_t key;
+
+		switch (i & 3)
+		{
+		case 0:
+			key = (uint32_t) ngx_test_random(rnd);
+			break;
+
+		case 1:
+			/* the last and first keys of adjacent level 2 and 3 tables */
+			key = (ngx_test_key(rnd) & 0xffffff00) | ((i & 4) ? 0xff : 0);
+			break;
+
+		default:
+			key = ngx_test_key(rnd);
+		}
+
+		if (ngx_radix32_stride_find(st, key) != ngx_radix32tree_find(tree, key))
+		{
+			fprintf(stderr, "stride lookup of %08x is wrong\n", key);
+			return NGX_ERROR;
+		}
+
+		keys[i] = key;
+	}
+
+	/* batches of any length, the last one is partial */
+
+	ngx_uint_t n = 4096 - ngx_test_random(rnd) % (2 * NGX_RADIX_BATCH);
+
+	ngx_radix32tree_find_batch(tree, keys, n, values);
+	ngx_radix32_stride_find_batch(st, keys, n, stride);
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		uintptr_t value = ngx_radix32tree_find(tree, keys[i]);
+
+		if (values[i] != value || stride[i] != value)
+		{
+			fprintf(stderr, "batch lookup of %08x is wrong\n", keys[i]);
+			return NGX_ERROR;
+		}
+	}
+
+	free(st->tables);
+	free(st);
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_test_fuzz(ngx_uint_t ops, uint64_t seed)
+{
+	ngx_test_prefix_t prefixes[NGX_TEST_FUZZ_PREFIXES];
+	uint64_t rnd = seed;
+
+	ngx_radix_tree_t *tree = ngx_radix_tree_create(NULL, -1);
+	if (tree == NULL)
+		return NGX_ERROR;
+
+	/* a fresh tree may be compacted, and compacted again */
+
+	if (ngx_radix_tree_compact(tree, NULL) != NGX_OK
+		|| ngx_radix_tree_compact(tree, NULL) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	for (ngx_uint_t i = 0; i < NGX_TEST_FUZZ_PREFIXES; i++)
+	{
+		ngx_uint_t bits = 8 + ngx_test_random(&rnd) % 25;
+
+		prefixes[i].mask = (uint32_t) 0xffffffff << (32 - bits);
+		prefixes[i].key = ngx_test_key(&rnd) & prefixes[i].mask;
+		prefixes[i].value = i;
+		prefixes[i].present = 0;
+
+		/* the same prefix drawn twice is kept once */
+
+		for (ngx_uint_t j = 0; j < i; j++)
+		{
+			if (prefixes[j].key == prefixes[i].key && prefixes[j].mask == prefixes[i].mask)
+				prefixes[i].mask = 0;
+		}
+	}
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_test_prefix_t *p = &prefixes[ngx_test_random(&rnd) % NGX_TEST_FUZZ_PREFIXES];
+		if (p->mask == 0)
+			continue;
+
+		if (p->present)
+		{
+			if (ngx_radix32tree_delete(tree, p->key, p->mask) != NGX_OK)
+			{
+				fprintf(stderr, "delete failed\n");
+				return NGX_ERROR;
+			}
+		}
+		else if (ngx_radix32tree_insert(tree, p->key, p->mask, p->value) != NGX_OK)
+		{
+			fprintf(stderr, "insert failed\n");
+			return NGX_ERROR;
+		}
+
+		p->present ^= 1;
+
+		if (op % 4093 == 0)
+		{
+			if (ngx_test_stride_check(tree, &rnd) != NGX_OK)
+			{
+				fprintf(stderr, "failed at operation %lu, seed %llu\n",
+						(unsigned long) op, (unsigned long long) seed);
+				return NGX_ERROR;
+			}
+
+			if (ngx_radix_tree_compact(tree, NULL) != NGX_OK)
+				return NGX_ERROR;
+
+			ngx_radix_tree_stat_t stat;
+			ngx_radix_tree_stat(tree, &stat);
+
+			if (stat.free || stat.pages || stat.size != stat.nodes * sizeof(ngx_radix_node_t))
+			{
+				fprintf(stderr, "compacted tree still holds free nodes or pages\n");
+				return NGX_ERROR;
+			}
+		}
+
+		if (ngx_test_check(tree, prefixes, &rnd) != NGX_OK)
+		{
+			fprintf(stderr, "failed at operation %lu, seed %llu\n",
+					(unsigned long) op, (unsigned long long) seed);
+			return NGX_ERROR;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static ngx_radix_tree_t *ngx_test_shared_tree(uint64_t *rnd)
+{
+	ngx_radix_tree_t *tree = ngx_radix_tree_create(NULL, 0);
+	if (tree == NULL)
+		return NULL;
+
+	for (ngx_uint_t i = 0; i < NGX_TEST_FUZZ_PREFIXES; i++)
+	{
+		uint32_t mask = (uint32_t) 0xffffffff << (24 - ngx_test_random(rnd) % 17);
+
+		(void) ngx_radix32tree_insert(tree, ngx_test_key(rnd) & mask, mask, i);
+	}
+
+	return tree;
+}
+
+static ngx_int_t ngx_test_shared_check(ngx_test_shared_t *t, ngx_uint_t n)
+{
+	for (ngx_uint_t i = 0; i < NGX_TEST_SHARED_KEYS; i++)
+	{
+		if (ngx_radix32_shared_find(t->sh, t->keys[i]) != t->expected[n][i])
+		{
+			fprintf(stderr, "shared lookup of %08x is wrong\n", t->keys[i]);
+			return NGX_ERROR;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static void *ngx_test_shared_publisher(void *data)
+{
+	ngx_test_shared_t *t = data;
+
+	for (ngx_uint_t i = 0; i < NGX_TEST_SHARED_ROUNDS; i++)
+	{
+		if (ngx_radix32_shared_publish(t->sh, t->tree[i & 1]) != NGX_OK)
+			(void) ngx_atomic_fetch_add(&t->errors, 1);
+	}
+
+	(void) ngx_atomic_fetch_add(&t->publishers, -1);
+
+	return NULL;
+}
+
+/* every lookup must see one of the two tables whole */
+
+static void *ngx_test_shared_reader(void *data)
+{
+	ngx_test_shared_t *t = data;
+	ngx_uint_t errors = 0;
+
+	while (t->publishers)
+	{
+		for (ngx_uint_t i = 0; i < NGX_TEST_SHARED_KEYS; i++)
+		{
+			uintptr_t value = ngx_radix32_shared_find(t->sh, t->keys[i]);
+
+			if (value != t->expected[0][i] && value != t->expected[1][i])
+				errors++;
+		}
+	}
+
+	(void) ngx_atomic_fetch_add(&t->errors, errors);
+
+	return NULL;
+}
+
+/*
+ * Two tables are published in turn by concurrent publishers while
+ * readers look up; then a publisher dies in the middle of a rewrite and
+ * the next publish must recover both the mutex and the slot.
+ */
+
+static ngx_int_t ngx_test_shared(uint64_t seed)
+{
+	ngx_test_shared_t t;
+	ngx_shmtx_sh_t lock;
+	ngx_shmtx_t mutex;
+	pthread_t tid[2 * NGX_TEST_SHARED_THREADS];
+	uint64_t rnd = seed;
+	size_t size = 4 * 1024 * 1024;
+
+	ngx_memzero(&t, sizeof(ngx_test_shared_t));
+	ngx_memzero(&lock, sizeof(ngx_shmtx_sh_t));
+
+	u_char *addr = ngx_pmemalign(NULL, size, ngx_pagesize);
+	if (addr == NULL || ngx_shmtx_create(&mutex, &lock, NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	t.sh = ngx_radix32_shared_init(addr, size, &mutex);
+	t.tree[0] = ngx_test_shared_tree(&rnd);
+	t.tree[1] = ngx_test_shared_tree(&rnd);
+	if (t.sh == NULL || t.tree[0] == NULL || t.tree[1] == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < NGX_TEST_SHARED_KEYS; i++)
+	{
+		t.keys[i] = (i & 1) ? ngx_test_key(&rnd) : (uint32_t) ngx_test_random(&rnd);
+		t.expected[0][i] = ngx_radix32tree_find(t.tree[0], t.keys[i]);
+		t.expected[1][i] = ngx_radix32tree_find(t.tree[1], t.keys[i]);
+
+		if (ngx_radix32_shared_find(t.sh, t.keys[i]) != NGX_RADIX_NO_VALUE)
+		{
+			fprintf(stderr, "a fresh shared table is not empty\n");
+			return NGX_ERROR;
+		}
+	}
+
+	for (ngx_uint_t n = 0; n < 2; n++)
+	{
+		if (ngx_radix32_shared_publish(t.sh, t.tree[n]) != NGX_OK
+			|| ngx_test_shared_check(&t, n) != NGX_OK)
+		{
+			return NGX_ERROR;
+		}
+	}
+
+	t.publishers = NGX_TEST_SHARED_THREADS;
+
+	for (ngx_uint_t i = 0; i < NGX_TEST_SHARED_THREADS; i++)
+	{
+		if (pthread_create(&tid[i], NULL, ngx_test_shared_publisher, &t) != 0
+			|| pthread_create(&tid[NGX_TEST_SHARED_THREADS + i], NULL, ngx_test_shared_reader, &t) != 0)
+		{
+			return NGX_ERROR;
+		}
+	}
+
+	for (ngx_uint_t i = 0; i < 2 * NGX_TEST_SHARED_THREADS; i++)
+		pthread_join(tid[i], NULL);
+
+	if (t.errors)
+	{
+		fprintf(stderr, "%lu shared lookups or publishes failed\n", (unsigned long) t.errors);
+		return NGX_ERROR;
+	}
+
+	/* the publisher of pid 1 died holding the mutex, with the slot odd */
+
+	ngx_uint_t next = !t.sh->active;
+	ngx_radix32_snapshot_t *snap = (ngx_radix32_snapshot_t *)
+		((u_char *) (t.sh + 1) + next * t.sh->slot_size);
+
+	snap->seq |= 1;
+	lock.lock = 1;
+
+	if (!ngx_shmtx_force_unlock(&mutex, 1)
+		|| ngx_radix32_shared_publish(t.sh, t.tree[0]) != NGX_OK
+		|| t.sh->active != next || (snap->seq & 1)
+		|| ngx_test_shared_check(&t, 0) != NGX_OK)
+	{
+		fprintf(stderr, "shared table not recovered after a dead publisher\n");
+		return NGX_ERROR;
+	}
+
+	/* a table which does not fit is declined, the old one stays */
+
+	size = sizeof(ngx_radix32_shared_t)
+		   + 2 * (sizeof(ngx_radix32_snapshot_t) + ngx_radix32_stride_tables_size(8) + ngx_pagesize);
+
+	t.sh = ngx_radix32_shared_init(addr, size, &mutex);
+
+	if (t.sh == NULL || ngx_radix32_shared_publish(t.sh, t.tree[0]) != NGX_DECLINED
+		|| ngx_radix32_shared_find(t.sh, t.keys[0]) != NGX_RADIX_NO_VALUE)
+	{
+		fprintf(stderr, "shared table accepted a table too large\n");
+		return NGX_ERROR;
+	}
+
+	free(addr);
+
+	return NGX_OK;
+}
+
+static void ngx_test_mask6(u_char *mask, ngx_uint_t bits)
+{
+	for (ngx_uint_t i = 0; i < 16; i++)
+	{
+		ngx_uint_t n = (bits > 8 * i) ? bits - 8 * i : 0;
+		mask[i] = (n >= 8) ? 0xff : (u_char) (0xff00 >> n);
+	}
+}
+
+static void ngx_test_apply_mask6(u_char *key, u_char *addr, u_char *mask)
+{
+	for (ngx_uint_t i = 0; i < 16; i++)
+		key[i] = addr[i] & mask[i];
+}
+
+static uintptr_t ngx_test_match6(ngx_test_prefix6_t *prefixes, ngx_uint_t n, u_char *addr)
+{
+	uintptr_t value = NGX_RADIX_NO_VALUE;
+	ngx_uint_t best = 0;
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		if (!prefixes[i].present || prefixes[i].bits < best)
+			continue;
+
+		u_char key[16];
+		ngx_test_apply_mask6(key, addr, prefixes[i].mask);
+
+		if (ngx_memcmp(key, prefixes[i].key, 16) == 0)
+		{
+			value = prefixes[i].value;
+			best = prefixes[i].bits;
+		}
+	}
+
+	return value;
+}
+
+/*
+ * Prefixes of 16 to 128 bits within 2001:db8::/32, with only a few bits
+ * of the first bytes random, so that they nest; the addresses looked up
+ * are the addresses of the prefixes with one bit flipped.
+ */
+
+static ngx_int_t ngx_test_fuzz6(ngx_uint_t ops, uint64_t seed)
+{
+	ngx_test_prefix6_t prefixes[NGX_TEST_FUZZ_PREFIXES];
+	uint64_t rnd = seed;
+
+	ngx_radix_tree_t *tree = ngx_radix_tree_create(NULL, 0);
+	if (tree == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < NGX_TEST_FUZZ_PREFIXES; i++)
+	{
+		ngx_test_prefix6_t *p = &prefixes[i];
+		uint64_t r = ngx_test_random(&rnd);
+
+		p->addr[0] = 0x20;
+		p->addr[1] = 0x01;
+		p->addr[2] = 0x0d;
+		p->addr[3] = 0xb8;
+		p->addr[4] = r & 0x03;
+		p->addr[5] = (r >> 8) & 0x81;
+
+		for (ngx_uint_t j = 6; j < 16; j++)
+			p->addr[j] = (u_char) (ngx_test_random(&rnd) & ((j & 1) ? 0xff : 0x11));
+
+		p->bits = 16 + ngx_test_random(&rnd) % 113;
+		ngx_test_mask6(p->mask, p->bits);
+		ngx_test_apply_mask6(p->key, p->addr, p->mask);
+		p->value = i;
+		p->present = 0;
+
+		for (ngx_uint_t j = 0; j < i; j++)
+		{
+			if (prefixes[j].bits == p->bits && ngx_memcmp(prefixes[j].key, p->key, 16) == 0)
+				p->bits = 0;
+		}
+	}
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_test_prefix6_t *p = &prefixes[ngx_test_random(&rnd) % NGX_TEST_FUZZ_PREFIXES];
+		if (p->bits == 0)
+			continue;
+
+		if (p->present)
+		{
+			if (ngx_radix128tree_delete(tree, p->key, p->mask) != NGX_OK)
+			{
+				fprintf(stderr, "delete6 failed\n");
+				return NGX_ERROR;
+			}
+		}
+		else if (ngx_radix128tree_insert(tree, p->key, p->mask, p->value) != NGX_OK)
+		{
+			fprintf(stderr, "insert6 failed\n");
+			return NGX_ERROR;
+		}
+
+		p->present ^= 1;
+
+		if (op % 4093 == 0 && ngx_radix_tree_compact(tree, NULL) != NGX_OK)
+			return NGX_ERROR;
+
+		for (ngx_uint_t i = 0; i < 16; i++)
+		{
+			u_char addr[16];
+			ngx_uint_t bit = ngx_test_random(&rnd) % 128;
+
+			ngx_memcpy(addr, prefixes[ngx_test_random(&rnd) % NGX_TEST_FUZZ_PREFIXES].addr, 16);
+			addr[bit / 8] ^= 0x80 >> (bit % 8);
+
+			if (ngx_radix128tree_find(tree, addr) != ngx_test_match6(prefixes, NGX_TEST_FUZZ_PREFIXES, addr))
+			{
+				fprintf(stderr, "lookup6 is wrong at operation %lu, seed %llu\n",
+						(unsigned long) op, (unsigned long long) seed);
+				return NGX_ERROR;
+			}
+		}
+	}
+
+	return NGX_OK;
+}
+
+static uint64_t ngx_test_lookups(ngx_radix_tree_t *tree, uint32_t *keys, ngx_uint_t n)
+{
+	volatile uintptr_t sink = 0;
+	uintptr_t sum = 0;
+
+	uint64_t start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		sum += ngx_radix32tree_find(tree, keys[i]);
+
+	sink = sum;
+	(void) sink;
+
+	return ngx_test_nsec() - start;
+}
+
+static uint64_t ngx_test_stride_lookups(ngx_radix32_stride_t *st, uint32_t *keys, ngx_uint_t n)
+{
+	volatile uintptr_t sink = 0;
+	uintptr_t sum = 0;
+
+	uint64_t start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		sum += ngx_radix32_stride_find(st, keys[i]);
+
+	sink = sum;
+	(void) sink;
+
+	return ngx_test_nsec() - start;
+}
+
+static void ngx_test_report_stat(const char *name, ngx_radix_tree_t *tree, ngx_uint_t n, uint64_t ns)
+{
+	ngx_radix_tree_stat_t stat;
+	ngx_radix_tree_stat(tree, &stat);
+
+	printf("%-10s %8lu nodes %8lu free %6lu pages %10lu bytes %7.1f ns/lookup\n", name,
+		   (unsigned long) stat.nodes, (unsigned long) stat.free, (unsigned long) stat.pages,
+		   (unsigned long) stat.size, (double) ns / n);
+}
+
+/*
+ * n random /16../32 prefixes are inserted, then churn deletes of a random
+ * half and inserts of new ones scatter the live nodes over the pages.
+ * The same random keys are looked up before and after the compaction.
+ */
+
+static ngx_int_t ngx_test_bench(ngx_uint_t n, ngx_uint_t churn)
+{
+	uint64_t rnd = 1;
+	ngx_uint_t lookups = 4 * n;
+
+	uint32_t *keys = malloc(n * sizeof(uint32_t));
+	uint32_t *masks = malloc(n * sizeof(uint32_t));
+	uint32_t *probe = malloc(lookups * sizeof(uint32_t));
+	if (keys == NULL || masks == NULL || probe == NULL)
+		return NGX_ERROR;
+
+	ngx_radix_tree_t *tree = ngx_radix_tree_create(NULL, -1);
+	if (tree == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		masks[i] = (uint32_t) 0xffffffff << (16 - ngx_test_random(&rnd) % 17);
+		keys[i] = (uint32_t) ngx_test_random(&rnd) & masks[i];
+
+		(void) ngx_radix32tree_insert(tree, keys[i], masks[i], i);
+	}
+
+	for (ngx_uint_t round = 0; round < churn; round++)
+	{
+		for (ngx_uint_t i = 0; i < n; i++)
+		{
+			if (ngx_test_random(&rnd) & 1)
+				continue;
+
+			(void) ngx_radix32tree_delete(tree, keys[i], masks[i]);
+
+			keys[i] = (uint32_t) ngx_test_random(&rnd) & masks[i];
+			(void) ngx_radix32tree_insert(tree, keys[i], masks[i], i);
+		}
+	}
+
+	for (ngx_uint_t i = 0; i < lookups; i++)
+		probe[i] = (uint32_t) ngx_test_random(&rnd);
+
+	/* one pass warms the caches for both measurements alike */
+	(void) ngx_test_lookups(tree, probe, lookups);
+
+	ngx_test_report_stat("churned", tree, lookups, ngx_test_lookups(tree, probe, lookups));
+
+	uint64_t start = ngx_test_nsec();
+
+	if (ngx_radix_tree_compact(tree, NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	printf("compaction %.1f ms\n", (ngx_test_nsec() - start) / 1e6);
+
+	ngx_test_report_stat("compacted", tree, lookups, ngx_test_lookups(tree, probe, lookups));
+
+	start = ngx_test_nsec();
+
+	ngx_radix32_stride_t *st = ngx_radix32_stride_build(tree, NULL);
+	if (st == NULL)
+		return NGX_ERROR;
+
+	printf("stride build %.1f ms\n", (ngx_test_nsec() - start) / 1e6);
+
+	(void) ngx_test_stride_lookups(st, probe, lookups);
+
+	uint64_t ns = ngx_test_stride_lookups(st, probe, lookups);
+
+	printf("%-10s %8lu tables %8lu values %21lu bytes %7.1f ns/lookup\n", "stride",
+		   (unsigned long) st->ntables, (unsigned long) st->nvalues,
+		   (unsigned long) (ngx_radix32_stride_tables_size(st->ntables) + st->nvalues * sizeof(uintptr_t)),
+		   (double) ns / lookups);
+
+	/* the same keys in batches, against the single lookups above */
+
+	uintptr_t *values = malloc(lookups * sizeof(uintptr_t));
+	if (values == NULL)
+		return NGX_ERROR;
+
+	start = ngx_test_nsec();
+	ngx_radix32tree_find_batch(tree, probe, lookups, values);
+	printf("%-10s %63.1f ns/lookup\n", "batch", (double) (ngx_test_nsec() - start) / lookups);
+
+	start = ngx_test_nsec();
+	ngx_radix32_stride_find_batch(st, probe, lookups, values);
+	printf("%-10s %63.1f ns/lookup\n", "st. batch", (double) (ngx_test_nsec() - start) / lookups);
+
+	free(values);
+
+	return NGX_OK;
+}
+
+/*
+ * The prefix lengths of the global IPv6 table: most routes are /48s and
+ * /32s, the rest spread between them.  The routes fall into allocations
+ * of 2000::/3, so that the more specific ones nest.  The addresses looked
+ * up are routed ones with random host bits, and random ones of 2000::/3,
+ * which mostly miss.
+ */
+
+static ngx_uint_t ngx_test_bgp6_bits(uint64_t *rnd)
+{
+	static ngx_uint_t  bits[] = { 48, 48, 48, 48, 48, 48, 48, 48, 48, 48,
+								  32, 32, 32, 44, 44, 40, 40, 36, 29, 0 };
+
+	ngx_uint_t n = bits[ngx_test_random(rnd) % (sizeof(bits) / sizeof(bits[0]))];
+
+	/* the rest is spread over /33../47 */
+	return n ? n : 33 + ngx_test_random(rnd) % 15;
+}
+
+static ngx_int_t ngx_test_bench6(ngx_uint_t n)
+{
+	uint64_t rnd = 1;
+	ngx_uint_t lookups = 4 * n;
+
+	u_char (*blocks)[16] = malloc(NGX_TEST_BGP6_BLOCKS * 16);
+	u_char (*probe)[16] = malloc(lookups * 16);
+	if (blocks == NULL || probe == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t i = 0; i < NGX_TEST_BGP6_BLOCKS; i++)
+	{
+		uint64_t r = ngx_test_random(&rnd);
+
+		ngx_memzero(blocks[i], 16);
+		blocks[i][0] = 0x20 | ((r >> 8) & 0x1f);
+		blocks[i][1] = (u_char) (r >> 16);
+		blocks[i][2] = (u_char) (r >> 24);
+		blocks[i][3] = (u_char) (r >> 32) & 0xf8;
+	}
+
+	ngx_radix_tree_t *tree = ngx_radix_tree_create(NULL, 0);
+	if (tree == NULL)
+		return NGX_ERROR;
+
+	u_char addr[16], key[16], mask[16];
+	ngx_uint_t routes = 0;
+
+	uint64_t start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		ngx_memcpy(addr, blocks[ngx_test_random(&rnd) % NGX_TEST_BGP6_BLOCKS], 16);
+
+		uint64_t r = ngx_test_random(&rnd);
+		addr[3] |= r & 0x07;
+		addr[4] = (u_char) (r >> 8);
+		addr[5] = (u_char) (r >> 16);
+
+		ngx_test_mask6(mask, ngx_test_bgp6_bits(&rnd));
+		ngx_test_apply_mask6(key, addr, mask);
+
+		if (ngx_radix128tree_insert(tree, key, mask, i) == NGX_OK)
+			routes++;
+	}
+
+	printf("bgp6 insert %lu routes %.1f ms\n", (unsigned long) routes, (ngx_test_nsec() - start) / 1e6);
+
+	for (ngx_uint_t i = 0; i < lookups; i++)
+	{
+		uint64_t r = ngx_test_random(&rnd);
+
+		if (r & 1)
+		{
+			ngx_memcpy(probe[i], blocks[(r >> 1) % NGX_TEST_BGP6_BLOCKS], 16);
+			probe[i][3] |= (r >> 40) & 0x07;
+
+			for (ngx_uint_t j = 4; j < 16; j++)
+				probe[i][j] = (u_char) ngx_test_random(&rnd);
+		}
+		else
+		{
+			for (ngx_uint_t j = 0; j < 16; j++)
+				probe[i][j] = (u_char) ngx_test_random(&rnd);
+
+			probe[i][0] = 0x20 | (probe[i][0] & 0x1f);
+		}
+	}
+
+	volatile uintptr_t sink = 0;
+	uintptr_t sum = 0;
+
+	for (ngx_uint_t pass = 0; pass < 2; pass++)
+	{
+		/* the first pass warms the caches */
+
+		start = ngx_test_nsec();
+
+		for (ngx_uint_t i = 0; i < lookups; i++)
+			sum += ngx_radix128tree_find(tree, probe[i]);
+	}
+
+	sink = sum;
+	(void) sink;
+
+	ngx_test_report_stat("bgp6", tree, lookups, ngx_test_nsec() - start);
+
+	if (ngx_radix_tree_compact(tree, NULL) != NGX_OK)
+		return NGX_ERROR;
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < lookups; i++)
+		sum += ngx_radix128tree_find(tree, probe[i]);
+
+	sink = sum;
+
+	ngx_test_report_stat("compacted", tree, lookups, ngx_test_nsec() - start);
+
+	free(blocks);
+	free(probe);
+
+	return NGX_OK;
+}
+
+ngx_pid_t  ngx_pid;
+
+
+int main(int argc, char *argv[])
+{
+	ngx_pid = getpid();
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		ngx_uint_t n = (argc > 2) ? strtoul(argv[2], NULL, 10) : 500000;
+		ngx_uint_t churn = (argc > 3) ? strtoul(argv[3], NULL, 10) : 4;
+
+		return (n && ngx_test_bench(n, churn) == NGX_OK
+				&& ngx_test_bench6(NGX_TEST_BGP6_PREFIXES) == NGX_OK) ? 0 : 1;
+	}
+
+	ngx_uint_t ops = (argc > 2) ? strtoul(argv[2], NULL, 10) : 100000;
+	uint64_t seed = (argc > 3) ? strtoull(argv[3], NULL, 10) : 1;
+
+	if (ngx_test_fuzz(ops, seed ? seed : 1) != NGX_OK)
+		return 1;
+
+	if (ngx_test_fuzz6(ops, seed ? seed : 1) != NGX_OK)
+		return 1;
+
+	if (ngx_test_shared(seed ? seed : 1) != NGX_OK)
+		return 1;
+
+	printf("radix tree fuzz: %lu operations ok\n", (unsigned long) ops);
+
+	return 0;
+}
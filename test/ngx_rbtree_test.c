@@ -0,0 +1,821 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * A randomized property test and a delete-heavy benchmark of ngx_rbtree.
+ *
+ * The fuzzer drives random insert, delete, delete-min, ngx_rbtree_next(),
+ * ngx_rbtree_extract_le() and range iteration against a sorted array of
+ * the keys, and checks the red-black invariants and the black height with
+ * ngx_rbtree_verify() after every operation.  It runs over both inserters,
+ * the timer keys are placed around the wraparound point of ngx_msec_t.
+ * ngx_rbtree_seq_lookup() is checked on a tree where most keys collide,
+ * and against a writer thread, which also makes the benchmark of the
+ * lock-free readers against readers taking the mutex.
+ *
+ *     ngx_rbtree_test fuzz [ops [seed]]
+ *     ngx_rbtree_test bench [nodes [ops]]
+ */
+
+
+#define NGX_TEST_FUZZ_NODES    512
+#define NGX_TEST_FUZZ_RANGE    2048
+
+
+typedef struct {
+	ngx_rbtree_t           tree;
+	ngx_rbtree_node_t      sentinel;
+	ngx_rbtree_node_t     *nodes;
+	u_char                *in;
+	ngx_uint_t             n;
+
+	/* the reference: sorted offsets of the keys from base */
+	ngx_rbtree_key_t      *ref;
+	ngx_uint_t             count;
+	ngx_rbtree_key_t       base;
+
+	/* nodes handed to the extract handler, and those out of the key order */
+	ngx_uint_t             extracted;
+	ngx_uint_t             misordered;
+} ngx_test_rbtree_t;
+
+
+static ngx_test_rbtree_t  *ngx_test_extract_tree;
+
+
+static void ngx_test_ref_insert(ngx_test_rbtree_t *t, ngx_rbtree_key_t off)
+{
+	ngx_uint_t i = t->count;
+
+	while (i > 0 && t->ref[i - 1] > off)
+	{
+		t->ref[i] = t->ref[i - 1];
+		i--;
+	}
+
+	t->ref[i] = off;
+	t->count++;
+}
+
+static void ngx_test_ref_delete(ngx_test_rbtree_t *t, ngx_rbtree_key_t off)
+{
+	ngx_uint_t i = 0;
+
+	while (t->ref[i] != off)
+		i++;
+
+	ngx_memmove(&t->ref[i], &t->ref[i + 1], (t->count - i - 1) * sizeof(ngx_rbtree_key_t));
+	t->count--;
+}
+
+static void ngx_test_extract_handler(ngx_rbtree_node_t *node)
+{
+	ngx_test_rbtree_t *t = ngx_test_extract_tree;
+
+	/* the reference still holds the extracted keys at its head */
+
+	if (t->extracted >= t->count || node->key - t->base != t->ref[t->extracted])
+		t->misordered++;
+
+	t->in[node - t->nodes] = 0;
+	t->extracted++;
+}
+
+/* the tree and the reference must hold the same keys in the same order */
+
+static ngx_int_t ngx_test_check(ngx_test_rbtree_t *t)
+{
+	if (ngx_rbtree_verify(&t->tree) == NGX_ERROR)
+	{
+		fprintf(stderr, "invariant broken\n");
+		return NGX_ERROR;
+	}
+
+	ngx_uint_t i = 0;
+
+	for (ngx_rbtree_node_t *node = t->tree.leftmost;
+		 node != &t->sentinel && node != NULL;
+		 node = ngx_rbtree_next(&t->tree, node))
+	{
+		if (i == t->count || node->key - t->base != t->ref[i])
+		{
+			fprintf(stderr, "order broken at %lu\n", (unsigned long) i);
+			return NGX_ERROR;
+		}
+
+		i++;
+	}
+
+	if (i != t->count)
+	{
+		fprintf(stderr, "%lu keys in tree, %lu expected\n", (unsigned long) i, (unsigned long) t->count);
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_test_iter(ngx_test_rbtree_t *t, uint64_t *rnd)
+{
+	ngx_rbtree_key_t start = ngx_test_random(rnd) % NGX_TEST_FUZZ_RANGE;
+	ngx_rbtree_key_t end = start + ngx_test_random(rnd) % (NGX_TEST_FUZZ_RANGE / 4);
+	ngx_uint_t backward = ngx_test_random(rnd) & 1;
+
+	ngx_uint_t expected = 0;
+	for (ngx_uint_t i = 0; i < t->count; i++)
+	{
+		if (t->ref[i] >= start && t->ref[i] <= end)
+			expected++;
+	}
+
+	ngx_rbtree_iter_t it;
+	ngx_rbtree_iter_init(&it, &t->tree, t->base + start, t->base + end, backward);
+
+	ngx_uint_t n = 0;
+	ngx_rbtree_key_t prev = backward ? end : start;
+	ngx_rbtree_node_t *node;
+
+	while ((node = ngx_rbtree_iter_next(&it)) != NULL)
+	{
+		ngx_rbtree_key_t off = node->key - t->base;
+
+		if (off < start || off > end || (backward ? off > prev : off < prev))
+		{
+			fprintf(stderr, "iterator out of order\n");
+			return NGX_ERROR;
+		}
+
+		prev = off;
+		n++;
+	}
+
+	if (n != expected)
+	{
+		fprintf(stderr, "iterator returned %lu of %lu\n", (unsigned long) n, (unsigned long) expected);
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_test_fuzz(ngx_uint_t timer, ngx_rbtree_key_t base, ngx_uint_t ops, uint64_t seed)
+{
+	ngx_test_rbtree_t t;
+	uint64_t rnd = seed;
+
+	ngx_memzero(&t, sizeof(ngx_test_rbtree_t));
+
+	t.n = NGX_TEST_FUZZ_NODES;
+	t.base = base;
+	t.nodes = calloc(t.n, sizeof(ngx_rbtree_node_t));
+	t.in = calloc(t.n, 1);
+	t.ref = calloc(t.n, sizeof(ngx_rbtree_key_t));
+	if (t.nodes == NULL || t.in == NULL || t.ref == NULL)
+		return NGX_ERROR;
+
+	if (timer)
+	{
+		ngx_rbtree_timer_init(&t.tree, &t.sentinel);
+	}
+	else
+	{
+		ngx_rbtree_init(&t.tree, &t.sentinel, ngx_rbtree_insert_value);
+	}
+
+	ngx_test_extract_tree = &t;
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_uint_t r = ngx_test_random(&rnd) % 100;
+		ngx_uint_t i = ngx_test_random(&rnd) % t.n;
+
+		if (r < 45)
+		{
+			/* insert, duplicate keys are frequent */
+
+			if (!t.in[i])
+			{
+				ngx_rbtree_key_t off = ngx_test_random(&rnd) % NGX_TEST_FUZZ_RANGE;
+
+				t.nodes[i].key = base + off;
+				ngx_rbtree_insert(&t.tree, &t.nodes[i]);
+				ngx_test_ref_insert(&t, off);
+				t.in[i] = 1;
+			}
+		}
+		else if (r < 80)
+		{
+			if (t.in[i])
+			{
+				/* the delete clears the key */
+				ngx_test_ref_delete(&t, t.nodes[i].key - base);
+				ngx_rbtree_delete(&t.tree, &t.nodes[i]);
+				t.in[i] = 0;
+			}
+		}
+		else if (r < 92)
+		{
+			/* the timer expiry pattern */
+
+			ngx_rbtree_node_t *node = t.tree.leftmost;
+			if (node != &t.sentinel)
+			{
+				ngx_test_ref_delete(&t, node->key - base);
+				ngx_rbtree_delete(&t.tree, node);
+				t.in[node - t.nodes] = 0;
+			}
+		}
+		else if (r < 96)
+		{
+			ngx_rbtree_key_t bound = ngx_test_random(&rnd) % NGX_TEST_FUZZ_RANGE;
+
+			ngx_uint_t expected = 0;
+			while (expected < t.count && t.ref[expected] <= bound)
+				expected++;
+
+			t.extracted = 0;
+			t.misordered = 0;
+
+			if (ngx_rbtree_extract_le(&t.tree, base + bound, ngx_test_extract_handler) != expected
+				|| t.extracted != expected)
+			{
+				fprintf(stderr, "extract returned a wrong count\n");
+				return NGX_ERROR;
+			}
+
+			if (t.misordered)
+			{
+				fprintf(stderr, "extract handed %lu nodes out of order\n", (unsigned long) t.misordered);
+				return NGX_ERROR;
+			}
+
+			ngx_memmove(t.ref, t.ref + expected, (t.count - expected) * sizeof(ngx_rbtree_key_t));
+			t.count -= expected;
+		}
+		else
+		{
+			if (ngx_test_iter(&t, &rnd) != NGX_OK)
+				return NGX_ERROR;
+		}
+
+		if (ngx_test_check(&t) != NGX_OK)
+		{
+			fprintf(stderr, "failed at operation %lu, seed %llu\n",
+					(unsigned long) op, (unsigned long long) seed);
+			return NGX_ERROR;
+		}
+	}
+
+	free(t.nodes);
+	free(t.in);
+	free(t.ref);
+
+	return NGX_OK;
+}
+
+/*
+ * ngx_rbtree_seq_lookup() over a tree of colliding keys, the nodes of
+ * a key are ordered by their id as a string-keyed tree orders them
+ */
+
+typedef struct {
+	ngx_rbtree_node_t      node;
+	ngx_uint_t             id;
+} ngx_test_seq_node_t;
+
+static void ngx_test_seq_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+	ngx_rbtree_node_t **p;
+
+	for ( ;; )
+	{
+		if (node->key != temp->key)
+			p = (node->key < temp->key) ? &temp->left : &temp->right;
+		else
+			p = (((ngx_test_seq_node_t *) node)->id < ((ngx_test_seq_node_t *) temp)->id) ? &temp->left : &temp->right;
+
+		if (*p == sentinel)
+			break;
+
+		temp = *p;
+	}
+
+	*p = node;
+	node->parent = temp;
+	node->left = sentinel;
+	node->right = sentinel;
+	ngx_rbt_red(node);
+}
+
+static ngx_int_t ngx_test_seq_compare(ngx_rbtree_node_t *node, void *data)
+{
+	ngx_uint_t id = *(ngx_uint_t *) data;
+	ngx_uint_t nid = ((ngx_test_seq_node_t *) node)->id;
+
+	return (id < nid) ? -1 : (id > nid);
+}
+
+static ngx_int_t ngx_test_seq_copy(ngx_rbtree_node_t *node, void *data)
+{
+	*(ngx_uint_t *) data = ((ngx_test_seq_node_t *) node)->id;
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_test_seq(uint64_t seed)
+{
+	ngx_rbtree_seq_t tree;
+	ngx_rbtree_node_t sentinel;
+	ngx_test_seq_node_t nodes[NGX_TEST_FUZZ_NODES];
+	u_char in[NGX_TEST_FUZZ_NODES];
+	uint64_t rnd = seed;
+
+	ngx_rbtree_seq_init(&tree, &sentinel, ngx_test_seq_insert_value);
+	ngx_memzero(in, sizeof(in));
+
+	for (ngx_uint_t op = 0; op < 20 * NGX_TEST_FUZZ_NODES; op++)
+	{
+		ngx_uint_t i = ngx_test_random(&rnd) % NGX_TEST_FUZZ_NODES;
+
+		if (in[i])
+		{
+			ngx_rbtree_seq_delete(&tree, &nodes[i].node);
+		}
+		else
+		{
+			/* seven keys only, nearly every node collides */
+			nodes[i].node.key = i % 7;
+			nodes[i].id = i;
+			ngx_rbtree_seq_insert(&tree, &nodes[i].node);
+		}
+
+		in[i] ^= 1;
+
+		ngx_uint_t j = ngx_test_random(&rnd) % NGX_TEST_FUZZ_NODES;
+		ngx_uint_t id = j;
+
+		ngx_int_t rc = ngx_rbtree_seq_lookup(&tree, j % 7, ngx_test_seq_compare, ngx_test_seq_copy, &id);
+
+		if ((in[j] && (rc != NGX_OK || id != j)) || (!in[j] && rc != NGX_DECLINED))
+		{
+			fprintf(stderr, "seq lookup of %lu failed at operation %lu\n", (unsigned long) j, (unsigned long) op);
+			return NGX_ERROR;
+		}
+	}
+
+	return NGX_OK;
+}
+
+static void ngx_test_report(const char *name, ngx_uint_t ops, uint64_t ns)
+{
+	printf("%-28s %10lu ops %8.1f ns/op %8.2f Mops/s\n", name, (unsigned long) ops,
+		   (double) ns / ops, ops * 1000.0 / ns);
+}
+
+/*
+ * Readers against a writer in other threads: the writer keeps inserting
+ * and deleting the churn nodes under a mutex, as a worker would under
+ * the slab mutex, while the readers look up both the stable nodes, which
+ * must always be found, and the churn ones.  A lookup which returns
+ * NGX_BUSY falls back to the mutex.  With locked set the readers always
+ * take the mutex, for the comparison.
+ */
+
+#define NGX_TEST_SEQ_STABLE   256
+#define NGX_TEST_SEQ_CHURN    256
+#define NGX_TEST_SEQ_KEYS     61
+#define NGX_TEST_SEQ_READERS  4
+
+typedef struct {
+	ngx_rbtree_seq_t       tree;
+	ngx_rbtree_node_t      sentinel;
+	pthread_mutex_t        mutex;
+	ngx_test_seq_node_t    nodes[NGX_TEST_SEQ_STABLE + NGX_TEST_SEQ_CHURN];
+	ngx_uint_t             locked;
+	volatile ngx_uint_t    stop;
+	ngx_uint_t             writes;
+} ngx_test_seq_shared_t;
+
+typedef struct {
+	ngx_test_seq_shared_t *sh;
+	pthread_t              tid;
+	uint64_t               rnd;
+	ngx_uint_t             lookups;
+	ngx_uint_t             busy;
+	ngx_uint_t             errors;
+} ngx_test_seq_reader_t;
+
+static ngx_int_t ngx_test_seq_read(ngx_test_seq_shared_t *sh, ngx_uint_t *id, ngx_uint_t *busy)
+{
+	ngx_rbtree_key_t key = *id % NGX_TEST_SEQ_KEYS;
+	ngx_int_t rc;
+
+	if (!sh->locked)
+	{
+		rc = ngx_rbtree_seq_lookup(&sh->tree, key, ngx_test_seq_compare, ngx_test_seq_copy, id);
+		if (rc != NGX_BUSY)
+			return rc;
+
+		(*busy)++;
+	}
+
+	pthread_mutex_lock(&sh->mutex);
+
+	ngx_rbtree_seq_repair(&sh->tree);
+	rc = ngx_rbtree_seq_lookup(&sh->tree, key, ngx_test_seq_compare, ngx_test_seq_copy, id);
+
+	pthread_mutex_unlock(&sh->mutex);
+
+	return rc;
+}
+
+static void *ngx_test_seq_reader(void *data)
+{
+	ngx_test_seq_reader_t *r = data;
+
+	for (ngx_uint_t i = 0; i < r->lookups; i++)
+	{
+		ngx_uint_t j = ngx_test_random(&r->rnd) % (NGX_TEST_SEQ_STABLE + NGX_TEST_SEQ_CHURN);
+		ngx_uint_t id = j;
+
+		ngx_int_t rc = ngx_test_seq_read(r->sh, &id, &r->busy);
+
+		if (rc == NGX_OK ? id != j : (rc != NGX_DECLINED || j < NGX_TEST_SEQ_STABLE))
+			r->errors++;
+	}
+
+	return NULL;
+}
+
+static void *ngx_test_seq_writer(void *data)
+{
+	ngx_test_seq_shared_t *sh = data;
+	u_char in[NGX_TEST_SEQ_CHURN];
+	uint64_t rnd = 7;
+
+	ngx_memzero(in, sizeof(in));
+
+	while (!sh->stop)
+	{
+		ngx_uint_t i = ngx_test_random(&rnd) % NGX_TEST_SEQ_CHURN;
+		ngx_rbtree_node_t *node = &sh->nodes[NGX_TEST_SEQ_STABLE + i].node;
+
+		pthread_mutex_lock(&sh->mutex);
+
+		if (in[i])
+		{
+			ngx_rbtree_seq_delete(&sh->tree, node);
+		}
+		else
+		{
+			node->key = (NGX_TEST_SEQ_STABLE + i) % NGX_TEST_SEQ_KEYS;
+			ngx_rbtree_seq_insert(&sh->tree, node);
+		}
+
+		pthread_mutex_unlock(&sh->mutex);
+
+		in[i] ^= 1;
+		sh->writes++;
+	}
+
+	return NULL;
+}
+
+/* returns the wall time of the readers, or 0 on a failure */
+
+static uint64_t ngx_test_seq_contend(ngx_test_seq_shared_t *sh, ngx_uint_t readers, ngx_uint_t lookups, ngx_uint_t locked, ngx_uint_t *busy)
+{
+	ngx_test_seq_reader_t r[NGX_TEST_SEQ_READERS];
+	pthread_t writer;
+
+	ngx_rbtree_seq_init(&sh->tree, &sh->sentinel, ngx_test_seq_insert_value);
+	pthread_mutex_init(&sh->mutex, NULL);
+
+	for (ngx_uint_t i = 0; i < NGX_TEST_SEQ_STABLE; i++)
+	{
+		sh->nodes[i].node.key = i % NGX_TEST_SEQ_KEYS;
+		sh->nodes[i].id = i;
+		ngx_rbtree_seq_insert(&sh->tree, &sh->nodes[i].node);
+	}
+
+	for (ngx_uint_t i = NGX_TEST_SEQ_STABLE; i < NGX_TEST_SEQ_STABLE + NGX_TEST_SEQ_CHURN; i++)
+		sh->nodes[i].id = i;
+
+	sh->locked = locked;
+	sh->stop = 0;
+	sh->writes = 0;
+
+	if (pthread_create(&writer, NULL, ngx_test_seq_writer, sh) != 0)
+		return 0;
+
+	uint64_t start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < readers; i++)
+	{
+		r[i].sh = sh;
+		r[i].rnd = i + 1;
+		r[i].lookups = lookups;
+		r[i].busy = 0;
+		r[i].errors = 0;
+
+		if (pthread_create(&r[i].tid, NULL, ngx_test_seq_reader, &r[i]) != 0)
+			return 0;
+	}
+
+	ngx_uint_t errors = 0;
+	*busy = 0;
+
+	for (ngx_uint_t i = 0; i < readers; i++)
+	{
+		pthread_join(r[i].tid, NULL);
+		errors += r[i].errors;
+		*busy += r[i].busy;
+	}
+
+	uint64_t ns = ngx_test_nsec() - start;
+
+	sh->stop = 1;
+	pthread_join(writer, NULL);
+	pthread_mutex_destroy(&sh->mutex);
+
+	if (errors)
+	{
+		fprintf(stderr, "%lu seq lookups failed under contention\n", (unsigned long) errors);
+		return 0;
+	}
+
+	return ns ? ns : 1;
+}
+
+/*
+ * The contention run, then a writer which dies in the middle of a change:
+ * lookups must give up with NGX_BUSY, and the repair under the mutex
+ * must bring them back.
+ */
+
+static ngx_int_t ngx_test_seq_threads(ngx_uint_t lookups)
+{
+	ngx_test_seq_shared_t *sh = calloc(1, sizeof(ngx_test_seq_shared_t));
+	ngx_uint_t busy;
+
+	if (sh == NULL || ngx_test_seq_contend(sh, NGX_TEST_SEQ_READERS, lookups, 0, &busy) == 0)
+		return NGX_ERROR;
+
+	sh->tree.seq |= 1;
+
+	ngx_uint_t id = 0;
+
+	if (ngx_rbtree_seq_lookup(&sh->tree, 0, ngx_test_seq_compare, ngx_test_seq_copy, &id) != NGX_BUSY)
+	{
+		fprintf(stderr, "seq lookup did not give up on a dead writer\n");
+		return NGX_ERROR;
+	}
+
+	ngx_rbtree_seq_repair(&sh->tree);
+
+	if (ngx_rbtree_seq_lookup(&sh->tree, 0, ngx_test_seq_compare, ngx_test_seq_copy, &id) != NGX_OK || id != 0)
+	{
+		fprintf(stderr, "seq lookup failed after the repair\n");
+		return NGX_ERROR;
+	}
+
+	free(sh);
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_test_seq_bench(ngx_uint_t lookups)
+{
+	ngx_test_seq_shared_t *sh = calloc(1, sizeof(ngx_test_seq_shared_t));
+	char name[64];
+
+	if (sh == NULL)
+		return NGX_ERROR;
+
+	for (ngx_uint_t readers = 1; readers <= NGX_TEST_SEQ_READERS; readers *= 2)
+	{
+		for (ngx_uint_t locked = 0; locked < 2; locked++)
+		{
+			ngx_uint_t busy;
+			uint64_t ns = ngx_test_seq_contend(sh, readers, lookups, locked, &busy);
+			if (ns == 0)
+				return NGX_ERROR;
+
+			snprintf(name, sizeof(name), "%s lookup, %lu readers", locked ? "mutex" : "seq",
+					 (unsigned long) readers);
+			ngx_test_report(name, readers * lookups, ns);
+
+			printf("%-28s %10lu writes, %lu fell back to the mutex\n", "", (unsigned long) sh->writes,
+				   (unsigned long) busy);
+		}
+	}
+
+	free(sh);
+
+	return NGX_OK;
+}
+
+/*
+ * Delete-heavy workloads over a tree of n nodes:
+ *   random   - delete a random node and insert it back with a new key,
+ *   expire   - delete the minimum and re-arm it, as the event timers do,
+ *   batch    - expire every key up to a moving bound, by deletes of the
+ *              minimum and by ngx_rbtree_extract_le(), and re-arm them;
+ *              only the expiry is timed,
+ *   drain    - delete every node in random order.
+ */
+
+#define NGX_TEST_BENCH_BATCH  64
+
+static ngx_rbtree_node_t  **ngx_test_batch;
+static ngx_uint_t           ngx_test_batch_n;
+
+static void ngx_test_batch_handler(ngx_rbtree_node_t *node)
+{
+	ngx_test_batch[ngx_test_batch_n++] = node;
+}
+
+/*
+ * Keys spread over a minute, the bound moves so that a batch averages
+ * NGX_TEST_BENCH_BATCH nodes.  Returns the time spent expiring.
+ */
+
+static uint64_t ngx_test_bench_batch(ngx_rbtree_t *tree, ngx_uint_t n, ngx_uint_t ops, ngx_uint_t split, ngx_uint_t *expired, uint64_t *rnd)
+{
+	ngx_rbtree_key_t now = tree->leftmost->key;
+	ngx_rbtree_key_t step = 60000 * NGX_TEST_BENCH_BATCH / n + 1;
+	uint64_t ns = 0;
+
+	*expired = 0;
+
+	while (*expired < ops)
+	{
+		now += step;
+		ngx_test_batch_n = 0;
+
+		uint64_t start = ngx_test_nsec();
+
+		if (split)
+		{
+			ngx_rbtree_extract_le(tree, now, ngx_test_batch_handler);
+		}
+		else
+		{
+			while (tree->leftmost != tree->sentinel && (ngx_rbtree_key_int_t) (tree->leftmost->key - now) <= 0)
+			{
+				ngx_rbtree_node_t *node = tree->leftmost;
+
+				ngx_rbtree_delete(tree, node);
+				ngx_test_batch_handler(node);
+			}
+		}
+
+		ns += ngx_test_nsec() - start;
+
+		for (ngx_uint_t i = 0; i < ngx_test_batch_n; i++)
+		{
+			ngx_test_batch[i]->key = now + 1 + ngx_test_random(rnd) % 60000;
+			ngx_rbtree_insert(tree, ngx_test_batch[i]);
+		}
+
+		*expired += ngx_test_batch_n;
+	}
+
+	return ns;
+}
+
+static ngx_int_t ngx_test_bench(ngx_uint_t n, ngx_uint_t ops)
+{
+	ngx_rbtree_t tree;
+	ngx_rbtree_node_t sentinel;
+	uint64_t rnd = 1;
+
+	ngx_rbtree_node_t *nodes = calloc(n, sizeof(ngx_rbtree_node_t));
+	ngx_uint_t *order = calloc(n, sizeof(ngx_uint_t));
+	if (nodes == NULL || order == NULL)
+		return NGX_ERROR;
+
+	ngx_test_batch = calloc(n, sizeof(ngx_rbtree_node_t *));
+	if (ngx_test_batch == NULL)
+		return NGX_ERROR;
+
+	ngx_rbtree_timer_init(&tree, &sentinel);
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		nodes[i].key = ngx_test_random(&rnd) % 60000;
+		ngx_rbtree_insert(&tree, &nodes[i]);
+	}
+
+	uint64_t start = ngx_test_nsec();
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_rbtree_node_t *node = &nodes[ngx_test_random(&rnd) % n];
+
+		ngx_rbtree_delete(&tree, node);
+		node->key = ngx_test_random(&rnd) % 60000;
+		ngx_rbtree_insert(&tree, node);
+	}
+
+	ngx_test_report("random delete+insert", ops, ngx_test_nsec() - start);
+
+	ngx_msec_t now = 60000;
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t op = 0; op < ops; op++)
+	{
+		ngx_rbtree_node_t *node = tree.leftmost;
+
+		ngx_rbtree_delete(&tree, node);
+		node->key = now++ + ngx_test_random(&rnd) % 60000;
+		ngx_rbtree_insert(&tree, node);
+	}
+
+	ngx_test_report("expire min+insert", ops, ngx_test_nsec() - start);
+
+	ngx_uint_t expired;
+	uint64_t ns = ngx_test_bench_batch(&tree, n, ops, 0, &expired, &rnd);
+	ngx_test_report("batch of delete min", expired, ns);
+
+	ns = ngx_test_bench_batch(&tree, n, ops, 1, &expired, &rnd);
+	ngx_test_report("batch extract_le", expired, ns);
+
+	if (ngx_rbtree_verify(&tree) == NGX_ERROR)
+	{
+		fprintf(stderr, "invariant broken after extract\n");
+		return NGX_ERROR;
+	}
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		order[i] = i;
+
+	for (ngx_uint_t i = n - 1; i > 0; i--)
+	{
+		ngx_uint_t j = ngx_test_random(&rnd) % (i + 1);
+		ngx_uint_t k = order[i];
+		order[i] = order[j];
+		order[j] = k;
+	}
+
+	start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		ngx_rbtree_delete(&tree, &nodes[order[i]]);
+
+	ngx_test_report("drain random order", n, ngx_test_nsec() - start);
+
+	if (tree.root != &sentinel || tree.leftmost != &sentinel)
+	{
+		fprintf(stderr, "tree not empty after drain\n");
+		return NGX_ERROR;
+	}
+
+	free(nodes);
+	free(order);
+	free(ngx_test_batch);
+
+	return NGX_OK;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		ngx_uint_t n = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1000000;
+		ngx_uint_t ops = (argc > 3) ? strtoul(argv[3], NULL, 10) : 2000000;
+
+		return (n && ngx_test_bench(n, ops) == NGX_OK && ngx_test_seq_bench(ops / 4) == NGX_OK) ? 0 : 1;
+	}
+
+	ngx_uint_t ops = (argc > 2) ? strtoul(argv[2], NULL, 10) : 200000;
+	uint64_t seed = (argc > 3) ? strtoull(argv[3], NULL, 10) : 1;
+
+	if (seed == 0)
+		seed = 1;
+
+	if (ngx_test_fuzz(0, 0, ops, seed) != NGX_OK)
+		return 1;
+
+	/* timer keys straddle the wraparound of ngx_msec_t */
+
+	if (ngx_test_fuzz(1, (ngx_rbtree_key_t) -(NGX_TEST_FUZZ_RANGE / 2), ops, seed) != NGX_OK)
+		return 1;
+
+	if (ngx_test_seq(seed) != NGX_OK)
+		return 1;
+
+	if (ngx_test_seq_threads(ops / 4) != NGX_OK)
+		return 1;
+
+	printf("rbtree fuzz: %lu operations per inserter ok\n", (unsigned long) ops);
+
+	return 0;
+}
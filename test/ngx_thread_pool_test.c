@@ -0,0 +1,529 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_thread_pool.h>
+
+
+/*
+ * A test and benchmark of the thread pool, driven the way a worker process
+ * drives it: a pool is configured with the "thread_pool" directive and
+ * started by ngx_thread_pool_module, and the completions are run by the
+ * handler passed to ngx_notify().  A run keeps a number of tasks in flight,
+ * each completion posts its task again, and every post must run the task
+ * exactly once.
+ *
+ *     ngx_thread_pool_test [tasks]
+ *     ngx_thread_pool_test bench [tasks]
+ */
+
+
+typedef struct {
+	ngx_uint_t             runs;
+	ngx_uint_t             spin;
+	ngx_uint_t             sleep;
+	uint64_t               posted;
+} ngx_test_task_t;
+
+
+typedef struct {
+	const char            *name;
+	const char            *params;
+	ngx_uint_t             inflight;
+
+	/* every 8th task spins this long, so the threads get uneven loads */
+	ngx_uint_t             spin;
+
+	/* the tasks completed by a handler run are posted again at once */
+	ngx_uint_t             batch;
+
+	/* the tasks are spread over the priorities */
+	ngx_uint_t             priorities;
+
+	/* every 4th post expires this many milliseconds later, 0 for none */
+	ngx_msec_t             deadline;
+
+	/* the tasks block for this many microseconds */
+	ngx_uint_t             sleep;
+
+	/* the number of tasks, if not the one given to the test */
+	ngx_uint_t             tasks;
+
+	/* the pool must grow beyond these threads, and shrink back when idle */
+	ngx_uint_t             threads;
+} ngx_test_run_t;
+
+
+extern ngx_module_t  ngx_thread_pool_module;
+
+static ngx_int_t ngx_test_notify(ngx_event_handler_pt handler);
+
+volatile ngx_msec_t  ngx_current_msec;
+ngx_uint_t           ngx_process = NGX_PROCESS_WORKER;
+ngx_uint_t           ngx_worker;
+ngx_pid_t            ngx_pid;
+
+ngx_int_t (*ngx_notify)(ngx_event_handler_pt handler) = ngx_test_notify;
+
+
+static sem_t                 ngx_test_notified;
+static ngx_atomic_t          ngx_test_notifies;
+static ngx_event_handler_pt  ngx_test_handler;
+
+static ngx_cycle_t           ngx_test_cycle;
+static void                 *ngx_test_conf_ctx[1];
+
+volatile ngx_cycle_t        *ngx_cycle = &ngx_test_cycle;
+
+static ngx_thread_pool_t    *ngx_test_tp;
+static ngx_uint_t            ngx_test_tasks;
+static ngx_uint_t            ngx_test_posts;
+static ngx_uint_t            ngx_test_done;
+static ngx_uint_t            ngx_test_failed;
+
+static ngx_uint_t            ngx_test_batch;
+static ngx_thread_task_t   **ngx_test_pending;
+static ngx_uint_t            ngx_test_npending;
+
+static ngx_msec_t            ngx_test_deadline;
+static ngx_uint_t            ngx_test_expired;
+static uint64_t              ngx_test_latency[NGX_THREAD_TASK_PRIORITIES];
+static ngx_uint_t            ngx_test_completed[NGX_THREAD_TASK_PRIORITIES];
+
+static const char           *ngx_test_priorities[] = { "high", "normal", "low" };
+
+static ngx_uint_t            ngx_test_elastic;
+static ngx_uint_t            ngx_test_peak;
+
+
+/*
+ * The completions of all the threads are run by the handler passed here,
+ * the completions pushed before the handler runs share one notification.
+ */
+
+static ngx_int_t ngx_test_notify(ngx_event_handler_pt handler)
+{
+	ngx_test_handler = handler;
+	(void) ngx_atomic_fetch_add(&ngx_test_notifies, 1);
+
+	return (sem_post(&ngx_test_notified) == 0) ? NGX_OK : NGX_ERROR;
+}
+
+static void ngx_test_time_update(void)
+{
+	ngx_current_msec = (ngx_msec_t) (ngx_test_nsec() / 1000000);
+}
+
+/* the event loop sleeps until the nearest timer, as ngx_process_events() does */
+
+static int ngx_test_sem_wait(void)
+{
+	struct timespec ts;
+
+	ngx_msec_t timer = ngx_event_find_timer();
+	if (timer == NGX_TIMER_INFINITE)
+		return sem_wait(&ngx_test_notified);
+
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+
+	ts.tv_sec += timer / 1000;
+	ts.tv_nsec += (timer % 1000) * 1000000;
+
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	return sem_timedwait(&ngx_test_notified, &ts);
+}
+
+/* a new configuration for every run, as after a reload */
+
+static ngx_thread_pool_t *ngx_test_start(const char *params)
+{
+	static ngx_conf_file_t file = { { ngx_string("ngx_thread_pool_test") }, 1 };
+
+	ngx_core_module_t *ctx = ngx_thread_pool_module.ctx;
+	ngx_command_t *cmd = &ngx_thread_pool_module.commands[0];
+	ngx_str_t name = ngx_string("test");
+	ngx_str_t value[16];
+	char buf[256];
+
+	ngx_test_cycle.conf_ctx = ngx_test_conf_ctx;
+	ngx_test_conf_ctx[ngx_thread_pool_module.index] = ctx->create_conf(&ngx_test_cycle);
+
+	if (ngx_test_conf_ctx[ngx_thread_pool_module.index] == NULL)
+		return NULL;
+
+	ngx_array_t args = { value, 0, sizeof(ngx_str_t), 16, NULL };
+
+	value[args.nelts++] = cmd->name;
+	value[args.nelts++] = name;
+
+	(void) snprintf(buf, sizeof(buf), "%s", params);
+
+	for (char *p = strtok(buf, " "); p != NULL && args.nelts < 16; p = strtok(NULL, " "))
+	{
+		value[args.nelts].data = (u_char *) p;
+		value[args.nelts++].len = strlen(p);
+	}
+
+	ngx_conf_t cf;
+	ngx_memzero(&cf, sizeof(ngx_conf_t));
+
+	cf.args = &args;
+	cf.cycle = &ngx_test_cycle;
+	cf.conf_file = &file;
+
+	if (cmd->set(&cf, cmd, NULL) != NGX_CONF_OK
+		|| ctx->init_conf(&ngx_test_cycle, ngx_test_conf_ctx[ngx_thread_pool_module.index]) != NGX_CONF_OK
+		|| ngx_thread_pool_module.init_process(&ngx_test_cycle) != NGX_OK)
+	{
+		return NULL;
+	}
+
+	return ngx_thread_pool_get(&ngx_test_cycle, &name);
+}
+
+static void ngx_test_work(void *data, ngx_log_t *log)
+{
+	ngx_test_task_t *t = data;
+
+	t->runs++;
+
+	for (volatile ngx_uint_t i = 0; i < t->spin; i++) { /* void */ }
+
+	if (t->sleep)
+		(void) usleep(t->sleep);
+}
+
+static ngx_int_t ngx_test_post(ngx_thread_task_t *task)
+{
+	ngx_test_task_t *t = task->ctx;
+
+	task->deadline = (ngx_test_deadline && ngx_test_posts % 4 == 0)
+					 ? ngx_current_msec + ngx_test_deadline : 0;
+
+	t->posted = ngx_test_nsec();
+	ngx_test_posts++;
+
+	if (ngx_test_batch)
+	{
+		ngx_test_pending[ngx_test_npending++] = task;
+		return NGX_OK;
+	}
+
+	return ngx_thread_task_post(ngx_test_tp, task);
+}
+
+static ngx_int_t ngx_test_flush(void)
+{
+	ngx_uint_t n = ngx_test_npending;
+
+	ngx_test_npending = 0;
+
+	return ngx_thread_task_post_n(ngx_test_tp, ngx_test_pending, n);
+}
+
+static void ngx_test_complete(ngx_event_t *ev)
+{
+	ngx_thread_task_t *task = ev->data;
+	ngx_test_task_t *t = task->ctx;
+
+	/* an expired task is completed without being run */
+
+	if (ev->timedout)
+	{
+		ngx_test_failed += (t->runs != 0);
+		ngx_test_expired++;
+	}
+	else
+	{
+		ngx_test_failed += (t->runs != 1);
+		ngx_test_latency[task->priority] += ngx_test_nsec() - t->posted;
+		ngx_test_completed[task->priority]++;
+	}
+
+	t->runs = 0;
+	ngx_test_done++;
+
+	if (ngx_test_posts < ngx_test_tasks && ngx_test_post(task) != NGX_OK)
+		ngx_test_failed++;
+}
+
+static ngx_uint_t ngx_test_running(void)
+{
+	ngx_thread_pool_stat_t stat[64];
+	ngx_uint_t running = 0;
+
+	ngx_uint_t n = ngx_thread_pool_stat(ngx_test_tp, stat, 64);
+
+	for (ngx_uint_t i = 0; i < n; i++)
+		running += stat[i].running;
+
+	return running;
+}
+
+static ngx_int_t ngx_test_wait(void)
+{
+	ngx_event_t ev;
+	ngx_memzero(&ev, sizeof(ngx_event_t));
+
+	while (ngx_test_done < ngx_test_tasks && ngx_test_failed == 0)
+	{
+		if (ngx_test_sem_wait() != 0 && errno != EINTR && errno != ETIMEDOUT)
+			return NGX_ERROR;
+
+		ngx_test_time_update();
+		ngx_event_expire_timers();
+
+		if (ngx_test_handler)
+			ngx_test_handler(&ev);
+
+		if (ngx_test_elastic)
+			ngx_test_peak = ngx_max(ngx_test_peak, ngx_test_running());
+
+		if (ngx_test_flush() != NGX_OK)
+			return NGX_ERROR;
+	}
+
+	return (ngx_test_failed == 0) ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * Once the tasks are done, the resize timer retires the extra threads
+ * idle for idle_timeout one by one.
+ */
+
+static ngx_int_t ngx_test_shrink(ngx_test_run_t *run, uint64_t *ns)
+{
+	ngx_uint_t running;
+	uint64_t start = ngx_test_nsec();
+
+	while ((running = ngx_test_running()) > run->threads && ngx_test_nsec() - start < 5000000000ULL)
+	{
+		(void) usleep(10000);
+
+		ngx_test_time_update();
+		ngx_event_expire_timers();
+	}
+
+	if (ngx_test_peak <= run->threads || running != run->threads)
+	{
+		fprintf(stderr, "\"%s\": grew to %lu threads, shrank to %lu\n", run->name,
+				(unsigned long) ngx_test_peak, (unsigned long) running);
+		return NGX_ERROR;
+	}
+
+	*ns = ngx_test_nsec() - start;
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_test_run(ngx_test_run_t *run, ngx_uint_t tasks, ngx_uint_t report)
+{
+	ngx_thread_pool_stat_t stat[64];
+
+	if (run->tasks)
+		tasks = run->tasks;
+
+	ngx_test_tasks = tasks;
+	ngx_test_posts = 0;
+	ngx_test_done = 0;
+	ngx_test_failed = 0;
+	ngx_test_notifies = 0;
+	ngx_test_expired = 0;
+
+	ngx_test_deadline = run->deadline;
+	ngx_test_elastic = run->threads;
+	ngx_test_peak = 0;
+	ngx_test_handler = NULL;
+
+	for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++)
+	{
+		ngx_test_latency[c] = 0;
+		ngx_test_completed[c] = 0;
+	}
+
+	ngx_test_batch = run->batch;
+	ngx_test_npending = 0;
+
+	ngx_test_pending = malloc(run->inflight * sizeof(ngx_thread_task_t *));
+	if (ngx_test_pending == NULL)
+		return NGX_ERROR;
+
+	if (sem_init(&ngx_test_notified, 0, 0) != 0)
+		return NGX_ERROR;
+
+	ngx_test_time_update();
+
+	ngx_test_tp = ngx_test_start(run->params);
+	if (ngx_test_tp == NULL)
+	{
+		fprintf(stderr, "thread pool \"%s\" failed to start\n", run->params);
+		return NGX_ERROR;
+	}
+
+	uint64_t start = ngx_test_nsec();
+
+	for (ngx_uint_t i = 0; i < run->inflight && ngx_test_posts < tasks; i++)
+	{
+		ngx_thread_task_t *task = ngx_thread_task_alloc(NULL, sizeof(ngx_test_task_t));
+		if (task == NULL)
+			return NGX_ERROR;
+
+		ngx_test_task_t *t = task->ctx;
+		t->spin = (i % 8 == 0) ? run->spin : 0;
+		t->sleep = run->sleep;
+
+		if (run->priorities)
+			task->priority = i % NGX_THREAD_TASK_PRIORITIES;
+
+		task->handler = ngx_test_work;
+		task->event.handler = ngx_test_complete;
+		task->event.data = task;
+
+		if (ngx_test_post(task) != NGX_OK)
+			return NGX_ERROR;
+	}
+
+	ngx_int_t rc = (ngx_test_flush() == NGX_OK) ? ngx_test_wait() : NGX_ERROR;
+
+	uint64_t ns = ngx_test_nsec() - start;
+
+	ngx_uint_t n = ngx_thread_pool_stat(ngx_test_tp, stat, 64);
+	ngx_uint_t run_tasks = 0, steals = 0, expired = 0;
+
+	for (ngx_uint_t i = 0; i < n; i++)
+	{
+		run_tasks += stat[i].tasks;
+		steals += stat[i].steals;
+		expired += stat[i].expired;
+	}
+
+	uint64_t shrink = 0;
+
+	if (rc == NGX_OK && run->threads)
+		rc = ngx_test_shrink(run, &shrink);
+
+	ngx_thread_pool_module.exit_process(&ngx_test_cycle);
+	(void) sem_destroy(&ngx_test_notified);
+	free(ngx_test_pending);
+
+	/* a completion notifies at most once */
+
+	/* the exit tasks of the pool leave no resize timer behind */
+
+	if (rc != NGX_OK || run_tasks + expired != tasks || expired != ngx_test_expired
+		|| ngx_test_notifies == 0 || ngx_test_notifies > tasks || ngx_event_timer_stat->armed)
+	{
+		fprintf(stderr, "\"%s\": %lu tasks done, %lu run, %lu expired, %lu failed, %lu notifies\n",
+				run->name, (unsigned long) ngx_test_done, (unsigned long) run_tasks,
+				(unsigned long) expired, (unsigned long) ngx_test_failed,
+				(unsigned long) ngx_test_notifies);
+		return NGX_ERROR;
+	}
+
+	if (report)
+	{
+		printf("%-24s %8lu tasks %8.0f ns/task %10.0f tasks/s %5.1f%% stolen %5.3f notifies/task\n",
+			   run->name, (unsigned long) tasks, (double) ns / tasks, tasks * 1e9 / ns,
+			   100.0 * steals / tasks, (double) ngx_test_notifies / tasks);
+	}
+
+	if (report && (run->priorities || run->deadline))
+	{
+		printf("%-24s", "");
+
+		for (ngx_uint_t c = 0; c < NGX_THREAD_TASK_PRIORITIES; c++)
+		{
+			printf(" %s %8.1f us", ngx_test_priorities[c],
+				   ngx_test_completed[c] ? ngx_test_latency[c] / 1e3 / ngx_test_completed[c] : 0.0);
+		}
+
+		printf(" %8lu expired\n", (unsigned long) expired);
+	}
+
+	if (report && run->threads)
+	{
+		printf("%-24s grew to %lu threads, shrank to %lu in %.0f ms\n", "",
+			   (unsigned long) ngx_test_peak, (unsigned long) run->threads, shrink / 1e6);
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * The submit throughput of the queues: one task in flight measures the
+ * round trip, many keep the producer and the threads on the queue, with
+ * 1 to 64 threads contending for the mutex or the ring.  With
+ * uneven tasks the deques of queue=steal fill unevenly and the idle
+ * threads steal from their peers.  The batched runs post the completed
+ * tasks with one ngx_thread_task_post_n() per handler run.  Under the
+ * same uneven load, the tasks of a higher priority should wait less, and
+ * tasks still queued at their deadline are cancelled.  The elastic pools
+ * start with two threads and tasks that block, so they have to grow.
+ */
+
+static ngx_test_run_t  ngx_test_runs[] = {
+	{ "mutex, 1 in flight",    "threads=4 queue=mutex", 1,   0,     0, 0, 0, 0,    0,    0 },
+	{ "ring, 1 in flight",     "threads=4 queue=ring",  1,   0,     0, 0, 0, 0,    0,    0 },
+	{ "steal, 1 in flight",    "threads=4 queue=steal", 1,   0,     0, 0, 0, 0,    0,    0 },
+	{ "mutex, 256 in flight",  "threads=4 queue=mutex", 256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "ring, 256 in flight",   "threads=4 queue=ring",  256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "steal, 256 in flight",  "threads=4 queue=steal", 256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "mutex, 1 thread",       "threads=1 queue=mutex", 256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "ring, 1 thread",        "threads=1 queue=ring",  256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "mutex, 8 threads",      "threads=8 queue=mutex", 256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "ring, 8 threads",       "threads=8 queue=ring",  256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "mutex, 32 threads",     "threads=32 queue=mutex", 256, 0,    0, 0, 0, 0,    0,    0 },
+	{ "ring, 32 threads",      "threads=32 queue=ring", 256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "mutex, 64 threads",     "threads=64 queue=mutex", 256, 0,    0, 0, 0, 0,    0,    0 },
+	{ "ring, 64 threads",      "threads=64 queue=ring", 256, 0,     0, 0, 0, 0,    0,    0 },
+	{ "mutex, batched",        "threads=4 queue=mutex", 256, 0,     1, 0, 0, 0,    0,    0 },
+	{ "ring, batched",         "threads=4 queue=ring",  256, 0,     1, 0, 0, 0,    0,    0 },
+	{ "steal, batched",        "threads=4 queue=steal", 256, 0,     1, 0, 0, 0,    0,    0 },
+	{ "mutex, uneven",         "threads=4 queue=mutex", 256, 20000, 0, 0, 0, 0,    0,    0 },
+	{ "ring, uneven",          "threads=4 queue=ring",  256, 20000, 0, 0, 0, 0,    0,    0 },
+	{ "steal, uneven",         "threads=4 queue=steal", 256, 20000, 0, 0, 0, 0,    0,    0 },
+	{ "mutex, priorities",     "threads=4 queue=mutex", 256, 20000, 0, 1, 0, 0,    0,    0 },
+	{ "ring, priorities",      "threads=4 queue=ring",  256, 20000, 0, 1, 0, 0,    0,    0 },
+	{ "steal, priorities",     "threads=4 queue=steal", 256, 20000, 0, 1, 0, 0,    0,    0 },
+	{ "mutex, deadlines",      "threads=4 queue=mutex", 256, 20000, 0, 0, 1, 0,    0,    0 },
+	{ "ring, deadlines",       "threads=4 queue=ring",  256, 20000, 0, 0, 1, 0,    0,    0 },
+	{ "steal, deadlines",      "threads=4 queue=steal", 256, 20000, 0, 0, 1, 0,    0,    0 },
+	{ "mutex, elastic",        "threads=2 max_threads=8 idle_timeout=200ms queue=mutex",
+							   64,  0,     0, 0, 0, 2000, 2000, 2 },
+	{ "ring, elastic",         "threads=2 max_threads=8 idle_timeout=200ms queue=ring",
+							   64,  0,     0, 0, 0, 2000, 2000, 2 },
+	{ "steal, elastic",        "threads=2 max_threads=8 idle_timeout=200ms queue=steal",
+							   64,  0,     0, 0, 0, 2000, 2000, 2 },
+};
+
+int main(int argc, char *argv[])
+{
+	ngx_uint_t bench = (argc > 1 && strcmp(argv[1], "bench") == 0);
+	ngx_uint_t runs = sizeof(ngx_test_runs) / sizeof(ngx_test_run_t);
+
+	ngx_uint_t tasks = (argc > 1 + bench) ? strtoul(argv[1 + bench], NULL, 10)
+										  : (bench ? 200000 : 20000);
+	if (tasks == 0 || ngx_event_timer_init(NULL) != NGX_OK)
+		return 1;
+
+	for (ngx_uint_t i = 0; i < runs; i++)
+	{
+		if (ngx_test_run(&ngx_test_runs[i], tasks, bench) != NGX_OK)
+			return 1;
+	}
+
+	if (!bench)
+		printf("thread pool test: %lu runs of %lu tasks ok\n", (unsigned long) runs, (unsigned long) tasks);
+
+	return 0;
+}